@@ -0,0 +1,94 @@
+// Allocation microbenchmarks for reallocate().
+//
+// Reports wall time and how many system allocator calls each operation
+// costs. Build once with CLOX_POOL_ALLOCATOR=ON and once with OFF to compare.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clox/object.h"
+#include "clox/vm.h"
+#include "memory.h"
+
+#define ITERATIONS 1000000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(clox_vm* vm, const char* name, double seconds, size_t system_before, size_t pool_before)
+{
+    printf(
+        "%-24s %8.1f ns/op %6.2f system allocs/op %6.2f pool allocs/op\n",
+        name,
+        seconds * 1e9 / ITERATIONS,
+        (double)(vm->pool.system_allocations - system_before) / ITERATIONS,
+        (double)(vm->pool.pool_allocations - pool_before) / ITERATIONS
+    );
+}
+
+// Mirrors concatenate() in vm.c: a fresh buffer for the result, handed to
+// clox_take_string() which allocates the string header.
+static void bench_concatenate(clox_vm* vm)
+{
+    clox_obj_string* a = clox_copy_string(vm, "hello ", 6);
+    clox_stack_push(vm, CLOX_OBJ_VAL(a));
+
+    char suffix[32];
+    size_t system_before = vm->pool.system_allocations;
+    size_t pool_before = vm->pool.pool_allocations;
+    double start = now();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int suffix_length = snprintf(suffix, sizeof(suffix), "%d", i);
+
+        int length = a->length + suffix_length;
+        char* chars = ALLOCATE(vm, char, length + 1, CLOX_ALLOC_STRING_CHARS);
+        memcpy(chars, a->chars, a->length);
+        memcpy(chars + a->length, suffix, suffix_length);
+        chars[length] = '\0';
+
+        clox_take_string(vm, chars, length);
+    }
+
+    report(vm, "concatenate", now() - start, system_before, pool_before);
+    clox_stack_pop(vm);
+}
+
+static void bench_object_churn(clox_vm* vm, const char* name, size_t size)
+{
+    size_t system_before = vm->pool.system_allocations;
+    size_t pool_before = vm->pool.pool_allocations;
+    double start = now();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        void* block = reallocate(vm, NULL, 0, size, CLOX_ALLOC_STRING);
+        reallocate(vm, block, size, 0, CLOX_ALLOC_STRING);
+    }
+
+    report(vm, name, now() - start, system_before, pool_before);
+}
+
+int main()
+{
+    clox_vm* vm = clox_new_vm();
+
+#ifdef CLOX_POOL_ALLOCATOR
+    printf("pool allocator: on\n");
+#else
+    printf("pool allocator: off\n");
+#endif
+
+    bench_object_churn(vm, "string header churn", sizeof(clox_obj_string));
+    bench_object_churn(vm, "function header churn", sizeof(clox_obj_function));
+    bench_object_churn(vm, "short buffer churn", 24);
+    bench_concatenate(vm);
+
+    clox_free_vm(vm);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Differential test for the AOT backend. Builds the interpreter once, then
+# for every script compares what the interpreter prints and exits with
+# against a native program made with `Clox --emit-c` and the local cc.
+# Scripts that call clock() print their elapsed time as the last line, like
+# the benchmarks do, so that line is left out of the comparison.
+#
+# Usage: bench/aot-compare.sh [build-dir] [script.lox...]
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD="${1:-$ROOT/_aot_build}"
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- "$ROOT"/bench/*.lox
+CC="${CC:-cc}"
+
+cmake -S "$ROOT" -B "$BUILD" \
+    -DCMAKE_BUILD_TYPE=Release \
+    -DCLOX_DEBUG_PRINT_CODE=OFF \
+    -DCLOX_DEBUG_TRACE_EXECUTION=OFF > /dev/null
+cmake --build "$BUILD" > /dev/null
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+# Runs a command and records its output streams and exit status.
+capture() {
+    name="$1"
+    shift
+    set +e
+    "$@" > "$WORK/$name.out" 2> "$WORK/$name.err"
+    status=$?
+    set -e
+    if grep -q 'clock()' "$script"; then
+        sed '$d' "$WORK/$name.out" > "$WORK/$name.cmp"
+    else
+        cp "$WORK/$name.out" "$WORK/$name.cmp"
+    fi
+    echo "exit $status" >> "$WORK/$name.cmp"
+}
+
+failed=0
+total=0
+for script in "$@"; do
+    total=$((total + 1))
+    capture interp "$BUILD/Clox" --no-cache --no-jit "$script"
+
+    if ! "$BUILD/Clox" --emit-c "$script" > "$WORK/program.c" 2> "$WORK/emit.err"; then
+        # Scripts that do not compile must fail the same way in both.
+        if grep -q '^exit 65$' "$WORK/interp.cmp"; then
+            echo "ok   $script"
+        else
+            echo "FAIL $script: --emit-c failed"
+            cat "$WORK/emit.err"
+            failed=$((failed + 1))
+        fi
+        continue
+    fi
+
+    $CC -O2 -I "$ROOT/include" -I "$BUILD" -o "$WORK/program" "$WORK/program.c" \
+        -L "$BUILD" -lclox -Wl,-rpath,"$BUILD" -lm
+    capture aot "$WORK/program"
+
+    if cmp -s "$WORK/interp.cmp" "$WORK/aot.cmp" && cmp -s "$WORK/interp.err" "$WORK/aot.err"; then
+        echo "ok   $script"
+    else
+        echo "FAIL $script"
+        diff "$WORK/interp.cmp" "$WORK/aot.cmp" || true
+        diff "$WORK/interp.err" "$WORK/aot.err" || true
+        failed=$((failed + 1))
+    fi
+done
+
+echo "$failed of $total scripts differ between the interpreter and the AOT build"
+[ "$failed" -eq 0 ]
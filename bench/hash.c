@@ -0,0 +1,141 @@
+// String hashing microbenchmarks.
+//
+// Times the byte-at-a-time FNV-1a that strings used to be hashed with
+// against clox_hash_string() on keys of several lengths, then checks how
+// evenly sequential names spread over the bits each table indexes with.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clox/hash.h"
+
+#define BYTES_PER_LENGTH (256 * 1024 * 1024)
+#define BUFFER_SIZE (64 * 1024)
+#define DISTRIBUTION_KEYS (1 << 20)
+#define BUCKETS (1 << 16)
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t fnv1a(const char* chars, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Hashes at different offsets of the buffer so every call sees other bytes
+// and the loop cannot be folded away.
+static void bench_length(const char* buffer, int length)
+{
+    long calls = BYTES_PER_LENGTH / length;
+    if (calls > 20000000) calls = 20000000;
+    int offsets = BUFFER_SIZE - length + 1;
+    volatile uint32_t sink = 0;
+    uint32_t acc = 0;
+
+    double start = now();
+    for (long i = 0; i < calls; i++) {
+        acc += fnv1a(buffer + (i * 7) % offsets, length);
+    }
+    double old_seconds = now() - start;
+    sink = acc;
+
+    acc = 0;
+    start = now();
+    for (long i = 0; i < calls; i++) {
+        acc += clox_hash_string(buffer + (i * 7) % offsets, length);
+    }
+    double new_seconds = now() - start;
+    sink = acc;
+    (void)sink;
+
+    printf(
+        "%6d bytes  fnv1a %8.2f ns %6.2f GB/s  clox_hash_string %8.2f ns %6.2f GB/s\n",
+        length,
+        old_seconds * 1e9 / calls,
+        (double)calls * length / old_seconds / 1e9,
+        new_seconds * 1e9 / calls,
+        (double)calls * length / new_seconds / 1e9
+    );
+}
+
+// Chi-squared over BUCKETS buckets divided by its degrees of freedom: close
+// to 1 for a uniform spread, far above it when keys pile up.
+static double chi_squared(const uint32_t* hashes, int count, int shift, uint32_t mask)
+{
+    uint32_t* buckets = (uint32_t*)calloc(mask + 1, sizeof(uint32_t));
+    if (buckets == NULL) return -1;
+    for (int i = 0; i < count; i++) {
+        buckets[(hashes[i] >> shift) & mask]++;
+    }
+
+    double expected = (double)count / (mask + 1);
+    double sum = 0;
+    for (uint32_t i = 0; i <= mask; i++) {
+        double difference = buckets[i] - expected;
+        sum += difference * difference / expected;
+    }
+    free(buckets);
+    return sum / mask;
+}
+
+static void bench_distribution(const char* name, uint32_t (*hash)(const char*, int))
+{
+    uint32_t* hashes = (uint32_t*)malloc(sizeof(uint32_t) * DISTRIBUTION_KEYS);
+    if (hashes == NULL) return;
+    for (int i = 0; i < DISTRIBUTION_KEYS; i++) {
+        char key[32];
+        int length = snprintf(key, sizeof(key), "key%d", i);
+        hashes[i] = hash(key, length);
+    }
+
+    // The intern set indexes with the low bits, clox_table with the bits
+    // above the 7 it keeps in the control byte.
+    printf(
+        "%-18s chi2/df  intern index %6.2f  table position %6.2f  control byte %6.2f\n",
+        name,
+        chi_squared(hashes, DISTRIBUTION_KEYS, 0, BUCKETS - 1),
+        chi_squared(hashes, DISTRIBUTION_KEYS, 7, BUCKETS - 1),
+        chi_squared(hashes, DISTRIBUTION_KEYS, 0, 0x7F)
+    );
+    free(hashes);
+}
+
+static uint32_t new_hash(const char* chars, int length)
+{
+    return clox_hash_string(chars, length);
+}
+
+int main()
+{
+    char* buffer = (char*)malloc(BUFFER_SIZE);
+    if (buffer == NULL) return 1;
+    uint32_t seed = 2463534242u;
+    for (int i = 0; i < BUFFER_SIZE; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buffer[i] = (char)('a' + seed % 26);
+    }
+
+    int lengths[] = { 1, 3, 4, 8, 12, 16, 24, 32, 48, 64, 128, 256, 1024, 4096, 65536 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        bench_length(buffer, lengths[i]);
+    }
+    bench_distribution("fnv1a", fnv1a);
+    bench_distribution("clox_hash_string", new_hash);
+
+    free(buffer);
+    return 0;
+}
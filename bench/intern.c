@@ -0,0 +1,134 @@
+// String interning microbenchmarks.
+//
+// Times clox_copy_string() on strings that are new and on strings that are
+// already interned, reports what the intern set costs per string, and times
+// compiling a script full of identifiers and string literals on a fresh VM.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clox/compiler.h"
+#include "clox/heap.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+
+#define STRINGS (1 << 18)
+#define LOOKUPS 4000000
+#define SCRIPT_LINES 20000
+#define COMPILES 20
+
+static uint32_t seed = 2463534242u;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void bench_copy(char** names, int* lengths)
+{
+    clox_vm* vm = clox_new_vm();
+    // Nothing references the strings, so the collector must not run.
+    vm->next_gc = SIZE_MAX;
+
+    clox_heap_stats before;
+    clox_get_heap_stats(vm, &before);
+
+    double start = now();
+    for (int i = 0; i < STRINGS; i++) {
+        clox_copy_string(vm, names[i], lengths[i]);
+    }
+    double seconds = now() - start;
+    printf("%-24s %8.1f ns/op\n", "intern new", seconds * 1e9 / STRINGS);
+
+    clox_heap_stats after;
+    clox_get_heap_stats(vm, &after);
+    size_t set_bytes = after.kinds[CLOX_ALLOC_INTERN].bytes - before.kinds[CLOX_ALLOC_INTERN].bytes;
+    printf("%-24s %8.1f bytes/string\n", "intern set", (double)set_bytes / STRINGS);
+
+    volatile uintptr_t sink = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int index = (int)(next_random() % STRINGS);
+        sink += (uintptr_t)clox_copy_string(vm, names[index], lengths[index]);
+    }
+    printf("%-24s %8.1f ns/op\n", "intern existing", (now() - start) * 1e9 / LOOKUPS);
+
+    clox_free_vm(vm);
+}
+
+// Every line assigns a global from a pool of a few thousand a string
+// literal seen nowhere else. A chunk holds at most 256 constants, so the
+// lines are split over functions.
+static void bench_compile()
+{
+    size_t capacity = (size_t)SCRIPT_LINES * 64;
+    char* source = (char*)malloc(capacity);
+    if (source == NULL) return;
+
+    size_t length = 0;
+    for (int i = 0; i < SCRIPT_LINES; i++) {
+        if (i % 100 == 0) length += snprintf(source + length, capacity - length, "fun chunk%d() {\n", i / 100);
+        length += snprintf(
+            source + length,
+            capacity - length,
+            "  name%d = \"literal%d\"; print name%d;\n",
+            i % 5000,
+            i,
+            (i * 7) % 5000
+        );
+        if (i % 100 == 99) length += snprintf(source + length, capacity - length, "}\n");
+    }
+
+    double seconds = 0;
+    for (int round = 0; round < COMPILES; round++) {
+        clox_vm* vm = clox_new_vm();
+        double start = now();
+        clox_obj_function* function = clox_compile(vm, source);
+        seconds += now() - start;
+        if (function == NULL) printf("compile error\n");
+        clox_free_vm(vm);
+    }
+    printf(
+        "%-24s %8.1f us per 1000 lines\n",
+        "compile",
+        seconds * 1e6 / COMPILES / (SCRIPT_LINES / 1000.0)
+    );
+
+    free(source);
+}
+
+int main()
+{
+    char** names = (char**)malloc(sizeof(char*) * STRINGS);
+    int* lengths = (int*)malloc(sizeof(int) * STRINGS);
+    if (names == NULL || lengths == NULL) return 1;
+
+    for (int i = 0; i < STRINGS; i++) {
+        char name[32];
+        lengths[i] = snprintf(name, sizeof(name), "identifier_%d", i);
+        names[i] = (char*)malloc(lengths[i] + 1);
+        if (names[i] == NULL) return 1;
+        memcpy(names[i], name, lengths[i] + 1);
+    }
+
+    bench_copy(names, lengths);
+    bench_compile();
+
+    for (int i = 0; i < STRINGS; i++) free(names[i]);
+    free(names);
+    free(lengths);
+    return 0;
+}
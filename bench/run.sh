@@ -0,0 +1,43 @@
+#!/bin/sh
+# Builds the interpreter once per configuration and runs every benchmark
+# script against each build. Each script prints its own elapsed time as
+# the last line of output.
+#
+# Usage: bench/run.sh [build-root]
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD_ROOT="${1:-$ROOT/_bench_build}"
+
+build() {
+    name="$1"
+    shift
+    cmake -S "$ROOT" -B "$BUILD_ROOT/$name" \
+        -DCMAKE_BUILD_TYPE=Release \
+        -DCLOX_DEBUG_PRINT_CODE=OFF \
+        -DCLOX_DEBUG_TRACE_EXECUTION=OFF \
+        "$@" > /dev/null
+    cmake --build "$BUILD_ROOT/$name" > /dev/null
+}
+
+build switch -DCLOX_COMPUTED_GOTO=OFF
+build goto -DCLOX_COMPUTED_GOTO=ON
+build nan-boxing -DCLOX_COMPUTED_GOTO=ON -DCLOX_NAN_BOXING=ON
+build jit -DCLOX_COMPUTED_GOTO=ON -DCLOX_NAN_BOXING=ON -DCLOX_JIT=ON
+
+CONFIGS="switch goto nan-boxing jit"
+
+printf "%-16s" "script"
+for config in $CONFIGS; do
+    printf " %12s" "$config"
+done
+printf "\n"
+
+for script in "$ROOT"/bench/*.lox; do
+    printf "%-16s" "$(basename "$script" .lox)"
+    for config in $CONFIGS; do
+        printf " %12s" "$("$BUILD_ROOT/$config/Clox" --no-cache "$script" | tail -n 1)"
+    done
+    printf "\n"
+done
@@ -0,0 +1,201 @@
+// Hash table microbenchmarks for clox_table.
+//
+// Runs lookup, insert and delete mixes on tables of a few sizes with
+// interned string keys, the way the global slot table uses them, and
+// reports the time per operation and the capacity the table ends up with.
+// Then times every single insert into a growing table, once rehashing in
+// one step and once incrementally, and reports the latency percentiles.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "clox/object.h"
+#include "clox/table.h"
+#include "clox/vm.h"
+
+#define ITERATIONS 4000000
+#define LATENCY_ROUNDS 20
+
+static uint32_t seed = 2463534242u;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void report(const char* name, int size, double seconds, long operations, clox_table* table)
+{
+    printf(
+        "%-22s %7d keys %8.1f ns/op  capacity %d\n",
+        name,
+        size,
+        seconds * 1e9 / operations,
+        table->capacity
+    );
+}
+
+// Keys 0..size-1 are inserted, size..2*size-1 are never present.
+static void bench_size(clox_vm* vm, clox_obj_string** keys, int size)
+{
+    clox_table table;
+    volatile long found = 0;
+    clox_value value;
+
+    // Builds the table from scratch until ITERATIONS keys went in.
+    long rounds = ITERATIONS / size;
+    double start = now();
+    for (long round = 0; round < rounds; round++) {
+        clox_init_table(&table);
+        for (int i = 0; i < size; i++) {
+            clox_table_set(vm, &table, keys[i], CLOX_NUMBER_VAL(i));
+        }
+        if (round + 1 < rounds) clox_free_table(vm, &table);
+    }
+    report("insert", size, now() - start, rounds * size, &table);
+
+    start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        found += clox_table_get(&table, keys[next_random() % size], &value);
+    }
+    report("lookup hit", size, now() - start, ITERATIONS, &table);
+
+    start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        found += clox_table_get(&table, keys[size + next_random() % size], &value);
+    }
+    report("lookup miss", size, now() - start, ITERATIONS, &table);
+
+    // Half the keys churn: every step deletes one of them and puts it back,
+    // which is what short-lived interned strings do to the intern set.
+    start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        clox_obj_string* key = keys[next_random() % (size / 2 + 1)];
+        clox_table_delete(&table, key);
+        clox_table_set(vm, &table, key, CLOX_NIL_VAL);
+    }
+    report("delete + insert", size, now() - start, ITERATIONS, &table);
+
+    // Deletes every key and inserts unseen ones, so a table that does not
+    // reuse its tombstones keeps growing.
+    start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        int from = (int)(i % (2 * size));
+        int to = (int)((i + size) % (2 * size));
+        clox_table_delete(&table, keys[from]);
+        clox_table_set(vm, &table, keys[to], CLOX_NIL_VAL);
+    }
+    report("rolling window", size, now() - start, ITERATIONS, &table);
+
+    clox_free_table(vm, &table);
+    if (found == 0) printf("nothing found\n");
+}
+
+// What clox_copy_string() does before it allocates: the intern set holds
+// every key.
+static void bench_intern(clox_vm* vm, clox_obj_string** keys, int count)
+{
+    volatile long found = 0;
+
+    double start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        clox_obj_string* key = keys[next_random() % count];
+        found += clox_intern_set_find(&vm->strings, key->chars, key->length, key->hash) != NULL;
+    }
+    printf(
+        "%-22s %7d keys %8.1f ns/op  capacity %d\n",
+        "intern lookup",
+        vm->strings.count,
+        (now() - start) * 1e9 / ITERATIONS,
+        vm->strings.capacity
+    );
+    if (found == 0) printf("nothing found\n");
+}
+
+static int compare_times(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Fills a fresh table with count keys, LATENCY_ROUNDS times.
+static void bench_latency(clox_vm* vm, clox_obj_string** keys, int count, bool incremental)
+{
+    long samples = (long)count * LATENCY_ROUNDS;
+    uint64_t* times = (uint64_t*)malloc(sizeof(uint64_t) * samples);
+    if (times == NULL) return;
+
+    long sample = 0;
+    for (int round = 0; round < LATENCY_ROUNDS; round++) {
+        clox_table table;
+        clox_init_table(&table);
+        table.incremental = incremental;
+        for (int i = 0; i < count; i++) {
+            uint64_t start = now_ns();
+            clox_table_set(vm, &table, keys[i], CLOX_NIL_VAL);
+            times[sample++] = now_ns() - start;
+        }
+        clox_free_table(vm, &table);
+    }
+    qsort(times, samples, sizeof(uint64_t), compare_times);
+
+    printf(
+        "%-22s %7d keys  p50 %5llu  p99 %5llu  p999 %6llu  p9999 %8llu  max %8llu ns\n",
+        incremental ? "insert (incremental)" : "insert (one step)",
+        count,
+        (unsigned long long)times[samples / 2],
+        (unsigned long long)times[samples - samples / 100],
+        (unsigned long long)times[samples - samples / 1000],
+        (unsigned long long)times[samples - samples / 10000],
+        (unsigned long long)times[samples - 1]
+    );
+    free(times);
+}
+
+int main()
+{
+    clox_vm* vm = clox_new_vm();
+    int sizes[] = { 8, 64, 1024, 65536 };
+    int max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+    clox_obj_string** keys = (clox_obj_string**)malloc(sizeof(clox_obj_string*) * 2 * max_size);
+    if (keys == NULL) return 1;
+
+    // The keys are only referenced from here, so the collector must not run.
+    vm->next_gc = SIZE_MAX;
+    for (int i = 0; i < 2 * max_size; i++) {
+        char name[32];
+        int length = snprintf(name, sizeof(name), "key%d", i);
+        keys[i] = clox_copy_string(vm, name, length);
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_size(vm, keys, sizes[i]);
+    }
+    bench_intern(vm, keys, 2 * max_size);
+    bench_latency(vm, keys, 2 * max_size, false);
+    bench_latency(vm, keys, 2 * max_size, true);
+
+    free(keys);
+    clox_free_vm(vm);
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Runs one VM per thread on 1, 2, 4, ... threads at the same time and
+// reports how throughput scales. Every run creates a fresh VM, interprets
+// the script and frees the VM again, so VM setup and teardown are stressed
+// alongside the interpreter. Only the public API is used.
+//
+// usage: clox_threads_bench [script.lox] [max-threads] [runs-per-thread]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clox/vm.h"
+
+static const char* default_source =
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 2) + fib(n - 1);\n"
+    "}\n"
+    "var result = fib(22);\n";
+
+typedef struct {
+    const char* source;
+    int runs;
+    int failures;
+} worker;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* read_file(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer != NULL) {
+        size_t read = fread(buffer, 1, size, file);
+        buffer[read] = '\0';
+    }
+
+    fclose(file);
+    return buffer;
+}
+
+static void* run_worker(void* arg)
+{
+    worker* work = (worker*)arg;
+
+    for (int i = 0; i < work->runs; i++) {
+        clox_vm* vm = clox_new_vm();
+        if (vm == NULL || clox_interpret(vm, work->source) != CLOX_INTERPRET_OK) {
+            work->failures++;
+        }
+        if (vm != NULL) clox_free_vm(vm);
+    }
+
+    return NULL;
+}
+
+// Returns the wall time for `threads` workers, or a negative value if any
+// run failed.
+static double run_threads(const char* source, int threads, int runs)
+{
+    pthread_t* ids = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    worker* workers = (worker*)malloc(sizeof(worker) * threads);
+    if (ids == NULL || workers == NULL) exit(1);
+
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (worker){ source, runs, 0 };
+        pthread_create(&ids[i], NULL, run_worker, &workers[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        failures += workers[i].failures;
+    }
+    double elapsed = now() - start;
+
+    free(ids);
+    free(workers);
+    return failures > 0 ? -1.0 : elapsed;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* source = default_source;
+    char* file_source = NULL;
+    if (argc > 1) {
+        file_source = read_file(argv[1]);
+        if (file_source == NULL) {
+            fprintf(stderr, "Could not read \"%s\".\n", argv[1]);
+            return 74;
+        }
+        source = file_source;
+    }
+
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = argc > 3 ? atoi(argv[3]) : 20;
+    if (max_threads < 1) max_threads = 1;
+    if (runs < 1) runs = 1;
+
+    printf("%8s %10s %10s %8s %10s\n", "threads", "wall s", "runs/s", "speedup", "efficiency");
+
+    double base = 0;
+    int status = 0;
+    // 1, 2, 4, ... and finally max_threads itself.
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+
+        double elapsed = run_threads(source, threads, runs);
+        if (elapsed < 0) {
+            fprintf(stderr, "%d thread(s): a run did not finish with CLOX_INTERPRET_OK\n", threads);
+            status = 1;
+            break;
+        }
+
+        double throughput = threads * runs / elapsed;
+        if (threads == 1) base = throughput;
+        printf(
+            "%8d %10.3f %10.1f %8.2f %9.0f%%\n",
+            threads, elapsed, throughput, throughput / base, 100.0 * throughput / base / threads
+        );
+
+        if (threads == max_threads) break;
+    }
+
+    free(file_source);
+    return status;
+}
@@ -0,0 +1,193 @@
+#ifndef __CLOX_AOT_H__
+#define __CLOX_AOT_H__
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Writes a C translation unit for the function tree produced by
+// clox_compile(). Every Lox function becomes one C function over the VM's
+// value stack, and the program's main() runs the script through
+// clox_aot_main(). The result is built against the clox library:
+//
+//     cc -O2 -I include -I build out.c -L build -lclox
+//
+// Returns false if out could not be written.
+API bool clox_emit_c(clox_vm* vm, FILE* out, clox_obj_function* script);
+
+// Entry point of an emitted program. Loads the embedded bytecode image into
+// a fresh VM, attaches functions to the loaded function tree in the order
+// clox_emit_c() numbered them and runs the script. Returns the exit status
+// the interpreter would use.
+API int clox_aot_main(const uint8_t* image, size_t size, const clox_aot_fn* functions, int count);
+
+// The rest of this header is used by the emitted code. Each function keeps
+// its stack depth at every instruction as a compile-time constant, so stack
+// values are addressed as fixed offsets from slots and vm->stack_top is only
+// written before something that can look at it.
+
+static inline bool clox_aot_is_falsey(clox_value value)
+{
+    return CLOX_IS_NIL(value) || (CLOX_IS_BOOL(value) && !CLOX_AS_BOOL(value));
+}
+
+static inline void clox_aot_enter(clox_vm* vm, int arg_count)
+{
+    clox_value* slots = vm->stack_top - arg_count - 1;
+    clox_call_frame* frame = &vm->frames[vm->frame_count];
+    frame->function = CLOX_AS_FUNCTION(*slots);
+    frame->ip = frame->function->chunk.code;
+    frame->slots = slots;
+    atomic_signal_fence(memory_order_release);
+    vm->frame_count++;
+}
+
+// Finishes a frame that a tail call handed to another function.
+static inline bool clox_aot_resume(clox_vm* vm)
+{
+    clox_obj_function* function = vm->frames[vm->frame_count - 1].function;
+    if (function->aot != NULL) return function->aot(vm);
+    return clox_runtime_resume(vm) == CLOX_INTERPRET_OK;
+}
+
+#define CLOX_AOT_PROLOGUE() \
+    clox_call_frame* frame = &vm->frames[vm->frame_count - 1]; \
+    clox_value* slots = frame->slots; \
+    clox_value* constants = frame->function->chunk.constants.values; \
+    clox_value* globals = vm->global_values.values; \
+    uint8_t* code = frame->function->chunk.code; \
+    (void)constants; \
+    (void)globals; \
+    (void)code
+
+// Points the frame past the current instruction, the way the interpreter
+// leaves it, so runtime errors report the same lines.
+#define CLOX_AOT_SYNC(depth, next) \
+    (vm->stack_top = slots + (depth), frame->ip = code + (next))
+
+#define CLOX_AOT_ERROR(message, next) \
+    do { \
+        frame->ip = code + (next); \
+        clox_runtime_error(vm, message); \
+        return false; \
+    } while (false)
+
+#define CLOX_AOT_GET_GLOBAL(to, slot, next) \
+    do { \
+        slots[to] = globals[slot]; \
+        if (CLOX_IS_UNDEFINED(slots[to])) { \
+            frame->ip = code + (next); \
+            clox_runtime_undefined_global(vm, slot); \
+            return false; \
+        } \
+    } while (false)
+
+#define CLOX_AOT_SET_GLOBAL(slot, from, next) \
+    do { \
+        if (CLOX_IS_UNDEFINED(globals[slot])) { \
+            frame->ip = code + (next); \
+            clox_runtime_undefined_global(vm, slot); \
+            return false; \
+        } \
+        globals[slot] = slots[from]; \
+    } while (false)
+
+#define CLOX_AOT_ADD(a, next) \
+    do { \
+        if (CLOX_IS_NUMBER(slots[a]) && CLOX_IS_NUMBER(slots[(a) + 1])) { \
+            slots[a] = CLOX_NUMBER_VAL(CLOX_AS_NUMBER(slots[a]) + CLOX_AS_NUMBER(slots[(a) + 1])); \
+        } else { \
+            CLOX_AOT_SYNC((a) + 2, next); \
+            if (!clox_runtime_add(vm)) return false; \
+        } \
+    } while (false)
+
+#define CLOX_AOT_EQUAL(a, next) \
+    do { \
+        if (CLOX_IS_UNINTERNED(slots[a]) || CLOX_IS_UNINTERNED(slots[(a) + 1])) { \
+            CLOX_AOT_SYNC((a) + 2, next); \
+            clox_runtime_equal(vm); \
+        } else { \
+            slots[a] = CLOX_BOOL_VAL(clox_value_equal(slots[a], slots[(a) + 1])); \
+        } \
+    } while (false)
+
+#define CLOX_AOT_BINARY(value_type, op, a, next) \
+    do { \
+        if (!CLOX_IS_NUMBER(slots[a]) || !CLOX_IS_NUMBER(slots[(a) + 1])) { \
+            CLOX_AOT_ERROR("Operands must be numbers.", next); \
+        } \
+        slots[a] = value_type(CLOX_AS_NUMBER(slots[a]) op CLOX_AS_NUMBER(slots[(a) + 1])); \
+    } while (false)
+
+#define CLOX_AOT_NEGATE(a, next) \
+    do { \
+        if (!CLOX_IS_NUMBER(slots[a])) CLOX_AOT_ERROR("Operand must be number.", next); \
+        slots[a] = CLOX_NUMBER_VAL(-CLOX_AS_NUMBER(slots[a])); \
+    } while (false)
+
+#define CLOX_AOT_PRINT(a) \
+    do { \
+        clox_print_value(vm->out, slots[a]); \
+        fputc('\n', vm->out); \
+    } while (false)
+
+#define CLOX_AOT_CALL(callee, arg_count, next) \
+    do { \
+        CLOX_AOT_SYNC((callee) + (arg_count) + 1, next); \
+        if (clox_runtime_call(vm, arg_count) != CLOX_INTERPRET_OK) return false; \
+    } while (false)
+
+// Calls a function the emitter proved is the callee. Arity was checked when
+// the code was emitted. A full frame or value stack goes through the
+// generic path, which reports the overflow, and so do calls too deep to
+// nest on the C stack, which it runs in the interpreter.
+#define CLOX_AOT_CALL_KNOWN(target, callee, arg_count, next) \
+    do { \
+        CLOX_AOT_SYNC((callee) + (arg_count) + 1, next); \
+        if (vm->frame_count == vm->frame_max || vm->frame_count >= CLOX_NATIVE_FRAME_MAX \
+            || slots + (callee) + CLOX_AS_FUNCTION(slots[(callee)])->max_slots > vm->stack_end) { \
+            if (clox_runtime_call(vm, arg_count) != CLOX_INTERPRET_OK) return false; \
+        } else { \
+            clox_aot_enter(vm, arg_count); \
+            if (!target(vm)) return false; \
+        } \
+    } while (false)
+
+// Both tail calls end the C function with a call in tail position, which
+// an optimizing compiler turns into a jump.
+#define CLOX_AOT_TAIL_CALL(callee, arg_count, next) \
+    do { \
+        CLOX_AOT_SYNC((callee) + (arg_count) + 1, next); \
+        clox_tail_call_result result = clox_runtime_tail_call(vm, arg_count); \
+        if (result == CLOX_TAIL_CALL_ERROR) return false; \
+        if (result == CLOX_TAIL_CALL_REPLACED) return clox_aot_resume(vm); \
+    } while (false)
+
+#define CLOX_AOT_TAIL_CALL_KNOWN(target, callee, arg_count) \
+    do { \
+        memmove(slots, slots + (callee), sizeof(clox_value) * ((arg_count) + 1)); \
+        vm->stack_top = slots + (arg_count) + 1; \
+        frame->function = CLOX_AS_FUNCTION(slots[0]); \
+        frame->ip = frame->function->chunk.code; \
+        return target(vm); \
+    } while (false)
+
+#define CLOX_AOT_RETURN(from) \
+    do { \
+        vm->frame_count--; \
+        if (vm->frame_count == 0) { \
+            vm->stack_top = slots; \
+            return true; \
+        } \
+        slots[0] = slots[from]; \
+        vm->stack_top = slots + 1; \
+        return true; \
+    } while (false)
+
+#endif // __CLOX_AOT_H__
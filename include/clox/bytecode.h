@@ -0,0 +1,28 @@
+#ifndef __CLOX_BYTECODE_H__
+#define __CLOX_BYTECODE_H__
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Bump whenever the opcode set, operand layout or file layout changes so
+// stale .loxc files are recompiled instead of loaded.
+#define CLOX_BYTECODE_VERSION 2
+
+API uint64_t clox_hash_source(const char *source, size_t length);
+
+// Writes the function tree produced by clox_compile() to path. The file is
+// written next to its final name and renamed into place, so a concurrent
+// reader never sees a partial cache.
+API bool clox_write_bytecode(clox_vm* vm, const char *path, clox_obj_function *function, uint64_t source_hash);
+
+// The same image written to an open stream, for embedding it elsewhere.
+API bool clox_dump_bytecode(clox_vm* vm, FILE *file, clox_obj_function *function, uint64_t source_hash);
+
+// Returns NULL when the file is missing, was written by another version or
+// for another source, or cannot be parsed.
+API clox_obj_function *clox_read_bytecode(clox_vm* vm, const char *path, uint64_t source_hash);
+API clox_obj_function *clox_load_bytecode(clox_vm* vm, const uint8_t *image, size_t size, uint64_t source_hash);
+
+#endif // __CLOX_BYTECODE_H__
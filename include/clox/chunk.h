@@ -29,21 +29,83 @@ typedef enum {
     CLOX_OP_JUMP_IF_FALSE,
     CLOX_OP_JUMP,
     CLOX_OP_LOOP,
-    CLOX_OP_CALL
+    CLOX_OP_CALL,
+    // A CALL whose result is returned right away. Reuses the caller's frame
+    // for Lox callees; the RETURN after it still handles natives.
+    CLOX_OP_TAIL_CALL,
+    // Superinstructions. Each one replaces only the first opcode of the
+    // sequence it covers and leaves the rest of the bytes in place, so a
+    // handler can fall back to the original instructions at any point.
+    CLOX_OP_ADD_LOCALS,
+    CLOX_OP_ADD_LOCAL_CONSTANT,
+    CLOX_OP_SUBTRACT_LOCAL_CONSTANT,
+    CLOX_OP_LESS_LOCAL_CONSTANT_JUMP,
+    CLOX_OP_SET_LOCAL_POP,
+    CLOX_OP_POP_LOOP,
+    // Quickened forms. The VM rewrites a generic arithmetic or comparison
+    // opcode into one of these once it has seen number operands, and back
+    // again the first time the guard fails.
+    CLOX_OP_ADD_NUM,
+    CLOX_OP_SUBTRACT_NUM,
+    CLOX_OP_MULTIPLY_NUM,
+    CLOX_OP_DEVIDE_NUM,
+    CLOX_OP_GREATER_NUM,
+    CLOX_OP_LESS_NUM,
+    CLOX_OP_COUNT
 } clox_op_code;
 
+// Start of a run of bytecode emitted for the same source line. The run
+// extends up to the offset of the next entry.
+typedef struct {
+    int offset;
+    int line;
+} clox_line_run;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     clox_value_array constants;
-    int *lines;
+    int line_count;
+    int line_capacity;
+    clox_line_run *lines;
 } clox_chunk;
 
 void clox_init_chunk(clox_chunk *chunk);
-void clox_free_chunk(clox_chunk *chunk);
-void clox_write_chunk(clox_chunk *chunk, uint8_t byte, int line);
+void clox_free_chunk(clox_vm* vm, clox_chunk *chunk);
+void clox_write_chunk(clox_vm* vm, clox_chunk *chunk, uint8_t byte, int line);
+
+int clox_chunk_add_constant(clox_vm* vm, clox_chunk *chunk, clox_value value);
+int clox_chunk_get_line(clox_chunk *chunk, int offset);
+
+// Superinstructions and quickened opcodes only replace the first opcode of
+// the sequence they stand for and fall back to it, so code generators can
+// translate the plain instruction stream underneath them.
+uint8_t clox_base_opcode(uint8_t instruction);
+
+int clox_instruction_length(uint8_t instruction);
+
+// Records the stack depth before every reachable instruction, counting the
+// callee and its arguments, and which offsets are jump targets. Bytecode
+// from the compiler has the same depth on every path into an instruction;
+// code that does not, or that jumps or reads operands outside the chunk, is
+// rejected. All three arrays hold chunk->count + 1 entries. Returns the
+// deepest stack the code uses, or -1 for rejected code.
+int clox_analyze_stack(const clox_chunk* chunk, int arity, int* depth, bool* target, int* work);
+
+// The arrays clox_analyze_stack() fills, taken from the VM's heap as one
+// block. Allocating is the only step that can fail, and nothing else
+// allocates until they are freed, so a failure leaves nothing behind.
+typedef struct {
+    int* depth;
+    bool* target;
+    int* work;
+    int count;
+} clox_stack_analysis;
 
-int clox_chunk_add_constant(clox_chunk *chunk, clox_value value);
+void clox_init_stack_analysis(clox_vm* vm, clox_stack_analysis* analysis, const clox_chunk* chunk);
+void clox_free_stack_analysis(clox_vm* vm, clox_stack_analysis* analysis);
+// clox_analyze_stack() without the per-instruction results.
+int clox_max_stack_depth(clox_vm* vm, const clox_chunk* chunk, int arity);
 
 #endif // __CLOX_CHUNK_H__
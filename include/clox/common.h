@@ -7,8 +7,8 @@
 
 #include "CloxExport.h"
 
-#define CLOX_DEBUG_PRINT_CODE
-#define CLOX_DEBUG_TRACE_EXECUTION
 #define CLOX_UINT8_COUNT (UINT8_MAX + 1)
 
+typedef struct clox_vm clox_vm;
+
 #endif // __CLOX_COMMON_H__
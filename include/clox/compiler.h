@@ -4,6 +4,10 @@
 #include "chunk.h"
 #include "object.h"
 
-clox_obj_function* clox_compile(const char *source);
+API clox_obj_function* clox_compile(clox_vm* vm, const char *source);
+void clox_mark_compiler_roots(clox_vm* vm);
+// Rewrites the first opcode of every sequence that has a superinstruction.
+// The chunk must hold plain opcodes only.
+void clox_fuse_superinstructions(clox_chunk* chunk);
 
 #endif // __CLOX_COMPILER_H__
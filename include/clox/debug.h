@@ -1,9 +1,13 @@
 #ifndef __CLOX_DEBUG_H__
 #define __CLOX_DEBUG_H__
 
+#include <stdio.h>
+
 #include "chunk.h"
 
-void clox_disassemble_chunk(clox_chunk *chunk, const char *name);
-int clox_disassemble_instruction(clox_chunk *chunk, int offset);
+void clox_disassemble_chunk(clox_vm* vm, clox_chunk *chunk, const char *name);
+void clox_print_chunk_memory(FILE *out, clox_chunk *chunk, const char *name);
+int clox_disassemble_instruction(clox_vm* vm, clox_chunk *chunk, int offset);
+const char* clox_opcode_name(uint8_t instruction);
 
 #endif // __CLOX_DEBUG_H__
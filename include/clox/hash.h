@@ -0,0 +1,118 @@
+#ifndef __CLOX_HASH_H__
+#define __CLOX_HASH_H__
+
+#include <string.h>
+
+#include "common.h"
+
+// wyhash (final version 4): reads 8 bytes at a time and mixes them with
+// 64x64->128-bit multiplies, 48 bytes per round for long inputs. It only
+// needs the multiply, which every 64-bit target has, so there is nothing to
+// detect at runtime. Targets without a 128-bit integer type build the
+// product from 32-bit halves. Words are read in native byte order, so hashes
+// are only stable on machines of the same byte order.
+
+#define CLOX_HASH_SECRET0 0xa0761d6478bd642full
+#define CLOX_HASH_SECRET1 0xe7037ed1a0b428dbull
+#define CLOX_HASH_SECRET2 0x8ebc6af09c88c6e3ull
+#define CLOX_HASH_SECRET3 0x589965cc75374cc3ull
+
+static inline void clox_hash_multiply(uint64_t* a, uint64_t* b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t a_high = *a >> 32, a_low = (uint32_t)*a;
+    uint64_t b_high = *b >> 32, b_low = (uint32_t)*b;
+    uint64_t high = a_high * b_high, middle0 = a_high * b_low;
+    uint64_t middle1 = b_high * a_low, low = a_low * b_low;
+    uint64_t t = low + (middle0 << 32);
+    uint64_t carry = t < low;
+    uint64_t result_low = t + (middle1 << 32);
+    carry += result_low < t;
+    *a = result_low;
+    *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t clox_hash_mix(uint64_t a, uint64_t b)
+{
+    clox_hash_multiply(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t clox_hash_read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t clox_hash_read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t clox_hash_bytes(const void* bytes, size_t length, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)bytes;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= clox_hash_mix(seed ^ CLOX_HASH_SECRET0, CLOX_HASH_SECRET1);
+    if (length <= 16) {
+        if (length >= 4) {
+            // Two overlapping pairs of 4-byte words cover 4 to 16 bytes.
+            size_t offset = (length >> 3) << 2;
+            a = (clox_hash_read32(p) << 32) | clox_hash_read32(p + offset);
+            b = (clox_hash_read32(p + length - 4) << 32) | clox_hash_read32(p + length - 4 - offset);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t left = length;
+        if (left > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = clox_hash_mix(clox_hash_read64(p) ^ CLOX_HASH_SECRET1, clox_hash_read64(p + 8) ^ seed);
+                seed1 = clox_hash_mix(clox_hash_read64(p + 16) ^ CLOX_HASH_SECRET2, clox_hash_read64(p + 24) ^ seed1);
+                seed2 = clox_hash_mix(clox_hash_read64(p + 32) ^ CLOX_HASH_SECRET3, clox_hash_read64(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = clox_hash_mix(clox_hash_read64(p) ^ CLOX_HASH_SECRET1, clox_hash_read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, overlapping what was already mixed.
+        a = clox_hash_read64(p + left - 16);
+        b = clox_hash_read64(p + left - 8);
+    }
+
+    a ^= CLOX_HASH_SECRET1;
+    b ^= seed;
+    clox_hash_multiply(&a, &b);
+    return clox_hash_mix(a ^ CLOX_HASH_SECRET0 ^ length, b ^ CLOX_HASH_SECRET1);
+}
+
+// The 32-bit hash kept in every string. Both halves are folded in, since
+// clox_table probes with the high bits and the intern set with the low ones.
+static inline uint32_t clox_hash_string(const char* chars, int length)
+{
+    uint64_t hash = clox_hash_bytes(chars, (size_t)length, 0);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#endif // __CLOX_HASH_H__
@@ -0,0 +1,58 @@
+#ifndef __CLOX_HEAP_H__
+#define __CLOX_HEAP_H__
+
+#include <stdio.h>
+
+#include "common.h"
+
+// What an allocation made through the VM's heap is for.
+typedef enum {
+    CLOX_ALLOC_STRING,
+    CLOX_ALLOC_FUNCTION,
+    CLOX_ALLOC_NATIVE_FUNCTION,
+    // Characters of strings, including buffers that are not strings yet.
+    CLOX_ALLOC_STRING_CHARS,
+    // Bytecode and line tables.
+    CLOX_ALLOC_CODE,
+    CLOX_ALLOC_CONSTANTS,
+    CLOX_ALLOC_GLOBALS,
+    // Entries of the global slot table.
+    CLOX_ALLOC_TABLE,
+    // Slots of the intern set and the compiler's batch of names to intern.
+    CLOX_ALLOC_INTERN,
+    // Per-function counters of builds with CLOX_STATS.
+    CLOX_ALLOC_STATS,
+    CLOX_ALLOC_KIND_COUNT
+} clox_alloc_kind;
+
+typedef struct {
+    size_t bytes;
+    size_t count;
+} clox_heap_usage;
+
+// Live bytes and blocks of every kind, the most bytes the heap ever held and
+// how often the collector ran. The stacks, JIT code and profiler tables live
+// outside the heap and are not counted.
+typedef struct {
+    size_t bytes_allocated;
+    size_t peak_bytes;
+    size_t heap_limit;
+    size_t next_gc;
+    uint64_t collections;
+    clox_heap_usage kinds[CLOX_ALLOC_KIND_COUNT];
+} clox_heap_stats;
+
+API void clox_get_heap_stats(clox_vm* vm, clox_heap_stats* stats);
+API const char* clox_alloc_kind_name(clox_alloc_kind kind);
+// Writes clox_get_heap_stats() as a JSON object.
+API bool clox_write_heap_stats(clox_vm* vm, FILE* out);
+// Caps the heap at limit bytes, 0 for no cap. An allocation that would go
+// past it collects garbage first, and if that does not make room the script
+// stops with a runtime error, the same as when the system runs out of
+// memory. Both only apply inside clox_interpret() and the other
+// clox_interpret_*() calls. Elsewhere there is no script to stop: the limit
+// is not enforced, and a failed allocation prints "Out of memory." to the
+// VM's error stream and aborts the process.
+API void clox_set_heap_limit(clox_vm* vm, size_t limit);
+
+#endif // __CLOX_HEAP_H__
@@ -0,0 +1,66 @@
+#ifndef __CLOX_INTERN_H__
+#define __CLOX_INTERN_H__
+
+#include "common.h"
+#include "value.h"
+
+// A string's hash and length sit next to the pointer, so a probe only reads
+// the string object once they both match.
+typedef struct {
+    uint32_t hash;
+    int length;
+    clox_obj_string* string;
+} clox_intern_slot;
+
+// The set of interned strings: open addressing with linear probing, at most
+// 3/4 full. Removing a string shifts the rest of its run back instead of
+// leaving a tombstone. Like clox_table, a full set is resized incrementally:
+// the old slots stay beside the new ones and every add and lookup copies a
+// few of them over. The old slots are never written, and lookups search them
+// only until all of their strings were copied.
+typedef struct {
+    // Live strings, old ones included.
+    int count;
+    // Zero, or a power of two of at least 16.
+    int capacity;
+    clox_intern_slot* slots;
+
+    // Old strings not copied yet, the old slots and the first one not copied.
+    int old_count;
+    int old_capacity;
+    int migrated;
+    clox_intern_slot* old_slots;
+
+    // Set by clox_init_intern_set(). Clear it before the first add to resize
+    // in one step.
+    bool incremental;
+} clox_intern_set;
+
+// Strings to intern in one go: chars and lengths in, hashes and strings out.
+// The compiler keeps the identifiers and string literals of a script here.
+// The collector marks the first `interned` strings.
+typedef struct {
+    int count;
+    int capacity;
+    int interned;
+    const char** chars;
+    int* lengths;
+    uint32_t* hashes;
+    clox_obj_string** strings;
+} clox_intern_batch;
+
+void clox_init_intern_set(clox_intern_set* set);
+void clox_free_intern_set(clox_vm* vm, clox_intern_set* set);
+clox_obj_string* clox_intern_set_find(clox_intern_set* set, const char* chars, int length, uint32_t hash);
+// The string must not be in the set yet.
+void clox_intern_set_add(clox_vm* vm, clox_intern_set* set, clox_obj_string* string);
+// Pulls the slot a lookup of hash starts at into the cache.
+void clox_intern_set_prefetch(clox_intern_set* set, uint32_t hash);
+void clox_intern_set_remove_white(clox_vm* vm, clox_intern_set* set);
+
+void clox_init_intern_batch(clox_intern_batch* batch);
+void clox_free_intern_batch(clox_vm* vm, clox_intern_batch* batch);
+void clox_intern_batch_push(clox_vm* vm, clox_intern_batch* batch, const char* chars, int length);
+void clox_intern_batch_clear(clox_intern_batch* batch);
+
+#endif // __CLOX_INTERN_H__
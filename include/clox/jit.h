@@ -0,0 +1,41 @@
+#ifndef __CLOX_JIT_H__
+#define __CLOX_JIT_H__
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// The baseline JIT emits System V x86-64 code into mmap'd pages, so it is
+// only built on that target even when CLOX_JIT is on. Stats builds count
+// every instruction in the interpreter and go without it.
+#if defined(CLOX_JIT) && !defined(CLOX_STATS) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CLOX_HAVE_JIT
+#endif
+
+typedef struct clox_jit_code clox_jit_code;
+
+API bool clox_has_jit();
+
+// Translates function into native code with one template per opcode. On
+// failure the function is marked so it is never tried again.
+bool clox_jit_compile(clox_vm* vm, clox_obj_function* function);
+
+// Runs frame in native code starting at the instruction ip points to, until
+// the frame returns or a runtime error unwinds the VM. Any instruction
+// boundary is a valid entry, which is what on-stack replacement at loop
+// back-edges relies on.
+clox_interpret_result clox_jit_run(clox_vm* vm, clox_call_frame* frame, uint8_t* ip);
+
+void clox_free_jit_code(clox_jit_code* code);
+
+// Counts one call or loop back-edge and compiles function once it reaches
+// the VM's threshold. Returns whether native code is available.
+static inline bool clox_jit_is_hot(clox_vm* vm, clox_obj_function* function)
+{
+    if (function->jit != NULL) return true;
+    if (!vm->jit_enabled || function->hotness < 0) return false;
+    if (++function->hotness < vm->jit_threshold) return false;
+    return clox_jit_compile(vm, function);
+}
+
+#endif // __CLOX_JIT_H__
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "intern.h"
 #include "value.h"
 
 typedef enum {
@@ -13,24 +14,72 @@ typedef enum {
 
 struct clox_obj {
     clox_obj_type type;
+    bool is_marked;
     struct clox_obj* next;
 };
 
+// Strings from the source are interned, so equal ones are the same object.
+// Strings made at runtime are not: they are neither hashed nor looked up
+// until clox_intern_string() is called on them, which happens when one
+// becomes a table key or after CLOX_INTERN_AFTER_COMPARES comparisons.
 struct clox_obj_string {
     clox_obj obj;
     int length;
+    // NULL while the string is a rope that has not been flattened.
     char* chars;
+    // 0 until computed.
     uint32_t hash;
+    bool is_rope;
+    bool is_interned;
+    // How often clox_runtime_equal() compared the string while it was not
+    // interned, up to CLOX_INTERN_AFTER_COMPARES.
+    uint8_t compares;
 };
 
+// Concatenations of at least CLOX_ROPE_MIN_LENGTH characters only link
+// their operands, so appending to a string in a loop costs the same however
+// long it has grown. The characters are copied out the first time they are
+// needed: clox_flatten_string() copies them into the rope and lets go of
+// the operands. Until then chars is NULL; clox_value_equal() compares
+// ropes as they are, and the VM flattens them before comparing so later
+// comparisons are cheaper.
+typedef struct {
+    clox_obj_string string;
+    // Both NULL once the rope is flattened.
+    clox_obj_string* left;
+    clox_obj_string* right;
+} clox_obj_rope;
+
+#define CLOX_ROPE_MIN_LENGTH 32
+#define CLOX_INTERN_AFTER_COMPARES 4
+// Printing and clox_value_equal() have no VM to flatten with, so they copy
+// a rope out this many characters at a time into a buffer on the C stack.
+#define CLOX_ROPE_WINDOW 4096
+
+typedef bool (*clox_aot_fn)(clox_vm* vm);
+
 typedef struct {
     clox_obj obj;
     int arity;
+    // Deepest the function's stack gets, counting the callee and its
+    // arguments. Calls check it against the end of the value stack, since
+    // expressions can nest deeper than a frame's CLOX_UINT8_COUNT slots.
+    int max_slots;
     clox_chunk chunk;
     clox_obj_string* name;
+    // Calls and loop back-edges counted for the JIT, -1 once it gave up.
+    int hotness;
+    struct clox_jit_code* jit;
+    // Translated by the AOT backend; runs the function's frame to
+    // completion and returns false after a runtime error.
+    clox_aot_fn aot;
+#ifdef CLOX_STATS
+    // Execution counters.
+    struct clox_function_stats* stats;
+#endif
 } clox_obj_function;
 
-typedef clox_value (*clox_native_fn)(int arg_count, clox_value* args);
+typedef clox_value (*clox_native_fn)(clox_vm* vm, int arg_count, clox_value* args);
 
 typedef struct {
     clox_obj obj;
@@ -47,16 +96,52 @@ static inline bool clox_is_obj_type(clox_value value, clox_obj_type type)
 #define CLOX_IS_STRING(value) clox_is_obj_type(value, CLOX_OBJ_STRING)
 #define CLOX_IS_FUNCTION(value) clox_is_obj_type(value, CLOX_OBJ_FUNCTION)
 #define CLOX_IS_NATIVE_FUNCTION(value) clox_is_obj_type(value, CLOX_OBJ_NATIVE_FUNCTION)
+#define CLOX_IS_UNINTERNED(value) (CLOX_IS_STRING(value) && !CLOX_AS_STRING(value)->is_interned)
 
 #define CLOX_AS_STRING(value) ((clox_obj_string*)CLOX_AS_OBJ(value))
 #define CLOX_AS_CSTRING(value) (((clox_obj_string*)CLOX_AS_OBJ(value))->chars)
 #define CLOX_AS_FUNCTION(value) ((clox_obj_function*)CLOX_AS_OBJ(value))
 #define CLOX_AS_NATIVE_FUNCTION(value) (((clox_obj_native_function*)CLOX_AS_OBJ(value))->function)
 
-clox_obj_native_function* clox_new_native_function(clox_native_fn function);
-clox_obj_function* clox_new_function();
-clox_obj_string* clox_copy_string(const char *chars, int length);
-clox_obj_string* clox_take_string(char* chars, int length);
-void clox_print_object(clox_value value);
+API clox_obj_native_function* clox_new_native_function(clox_vm* vm, clox_native_fn function);
+API clox_obj_function* clox_new_function(clox_vm* vm);
+API clox_obj_string* clox_copy_string(clox_vm* vm, const char *chars, int length);
+API clox_obj_string* clox_take_string(clox_vm* vm, char* chars, int length);
+// a + b, not interned, and a rope when the result is long enough. Both must
+// be reachable by the collector. Returns NULL if the length would not fit
+// in an int.
+clox_obj_string* clox_concatenate(clox_vm* vm, clox_obj_string* a, clox_obj_string* b);
+// Copies the characters of any string, rope or not, to dest without
+// allocating.
+void clox_copy_chars(const clox_obj_string* string, char* dest);
+// Copies string[start, start + length) the same way.
+void clox_copy_range(const clox_obj_string* string, int start, int length, char* dest);
+// Gives a rope its characters. string must be reachable by the collector.
+API void clox_flatten_string(clox_vm* vm, clox_obj_string* string);
+// The interned string with the same characters: string itself if there was
+// none yet, otherwise the one that was interned first, and string keeps the
+// hash for later comparisons. string must be reachable by the collector.
+API clox_obj_string* clox_intern_string(clox_vm* vm, clox_obj_string* string);
+// Interns every string of the batch into batch->strings. All of them are
+// hashed and looked up first, with the slots of later lookups prefetched,
+// before any string is allocated.
+void clox_copy_strings(clox_vm* vm, clox_intern_batch* batch);
+// A stream whose output is collected in memory, for code that writes
+// through a FILE* but wants the bytes. Once closed, chars holds what was
+// written, NUL-terminated and to be released with free(). Both return false
+// if the stream could not be opened or written, and then there is nothing
+// to free.
+typedef struct {
+    FILE* file;
+    char* chars;
+    size_t length;
+} clox_memory_stream;
+
+bool clox_open_memory_stream(clox_memory_stream* stream);
+bool clox_close_memory_stream(clox_memory_stream* stream);
+// Captures what write prints into a string, for natives that hand a report
+// to the script. Returns NULL if write fails.
+clox_obj_string* clox_string_from_report(clox_vm* vm, bool (*write)(clox_vm* vm, FILE* out));
+API void clox_print_object(FILE* out, clox_value value);
 
 #endif // __CLOX_OBJECT_H__
@@ -0,0 +1,39 @@
+#ifndef __CLOX_POOL_H__
+#define __CLOX_POOL_H__
+
+#include "common.h"
+
+// Blocks are handed out in size classes 8 bytes apart. Anything larger than
+// CLOX_POOL_MAX_SIZE goes straight to the system allocator.
+#define CLOX_POOL_GRANULARITY 8
+#define CLOX_POOL_MAX_SIZE 128
+#define CLOX_POOL_CLASS_COUNT (CLOX_POOL_MAX_SIZE / CLOX_POOL_GRANULARITY)
+#define CLOX_POOL_PAGE_SIZE (16 * 1024)
+
+typedef struct clox_pool_block {
+    struct clox_pool_block* next;
+} clox_pool_block;
+
+typedef struct clox_pool_page {
+    struct clox_pool_page* next;
+} clox_pool_page;
+
+typedef struct {
+    clox_pool_block* free_lists[CLOX_POOL_CLASS_COUNT];
+    clox_pool_page* pages;
+    size_t page_count;
+    size_t pool_allocations;
+    size_t system_allocations;
+} clox_pool;
+
+void clox_init_pool(clox_pool* pool);
+void clox_free_pool(clox_pool* pool);
+void* clox_pool_allocate(clox_pool* pool, size_t size);
+void clox_pool_release(clox_pool* pool, void* pointer, size_t size);
+
+static inline bool clox_pool_fits(size_t size)
+{
+    return size > 0 && size <= CLOX_POOL_MAX_SIZE;
+}
+
+#endif // __CLOX_POOL_H__
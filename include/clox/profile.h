@@ -0,0 +1,19 @@
+#ifndef __CLOX_PROFILE_H__
+#define __CLOX_PROFILE_H__
+
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+
+// Counts executed opcodes together with the pairs and triples they form in
+// the dynamic instruction stream. Used to pick superinstruction candidates.
+// Each VM owns one profile, so profiled VMs can still run in parallel.
+typedef struct clox_opcode_profile clox_opcode_profile;
+
+clox_opcode_profile* clox_new_opcode_profile();
+void clox_free_opcode_profile(clox_opcode_profile* profile);
+void clox_profile_opcode(clox_opcode_profile* profile, uint8_t instruction);
+void clox_print_opcode_profile(clox_opcode_profile* profile, FILE* out, int limit);
+
+#endif // __CLOX_PROFILE_H__
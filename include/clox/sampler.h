@@ -0,0 +1,37 @@
+#ifndef __CLOX_SAMPLER_H__
+#define __CLOX_SAMPLER_H__
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Statistical profiler for running scripts. A SIGPROF interval timer
+// interrupts the process hz times per second of CPU time and the handler
+// records the VM's call frame chain, each frame as its function and line.
+// Identical stacks are counted in a table allocated when sampling starts,
+// so the handler never allocates or locks; stacks that no longer fit are
+// only counted as dropped.
+//
+// The timer and the signal handler belong to the process, so only one VM
+// at a time can be sampled, and it must run on the thread that started the
+// sampler. Callers are recorded at their call site. The innermost frame is
+// exact in the switch interpreter; threaded, JIT and AOT code only store
+// its ip at calls, so there its line is that of the last call it made.
+typedef struct clox_sampler clox_sampler;
+
+// Returns false if hz is outside 1..10000, this or another VM is already
+// being sampled or the platform has no interval timers.
+API bool clox_start_sampler(clox_vm* vm, int hz);
+// Stops the timer. The samples are kept for the reports below.
+API void clox_stop_sampler(clox_vm* vm);
+// One line per distinct stack, outermost frame first, the way flamegraph.pl
+// and speedscope read them: "script:12;fib:3;fib:4 57".
+API void clox_write_folded_stacks(clox_vm* vm, FILE* out);
+// The limit functions with the most self time, with the share of samples
+// each was running in (self) or on the stack for (total).
+API void clox_print_sampler_summary(clox_vm* vm, FILE* out, int limit);
+
+void clox_free_sampler(clox_vm* vm);
+void clox_mark_sampler_roots(clox_vm* vm);
+
+#endif // __CLOX_SAMPLER_H__
@@ -51,7 +51,13 @@ typedef struct {
     int line;
 } clox_token;
 
-void clox_init_scanner(const char *source);
-clox_token clox_scan_token();
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} clox_scanner;
+
+void clox_init_scanner(clox_scanner* scanner, const char *source);
+clox_token clox_scan_token(clox_scanner* scanner);
 
 #endif // __CLOX_SCANNER_H__
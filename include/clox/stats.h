@@ -0,0 +1,74 @@
+#ifndef __CLOX_STATS_H__
+#define __CLOX_STATS_H__
+
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Execution counters of builds with CLOX_STATS: how often every opcode was
+// dispatched, and the calls, dispatched instructions and allocated bytes of
+// every function. Allocations are charged to the function running when they
+// happen, or to the compiler while no frame is live. The JIT is left out of
+// these builds so every instruction goes through the interpreter. Without
+// CLOX_STATS none of the counting is compiled in.
+typedef struct clox_function_stats clox_function_stats;
+
+// Counters of one function. The VM keeps them after the function itself is
+// collected, so the report still covers it. They live in the VM's heap, in
+// one block with the name after them.
+struct clox_function_stats {
+    clox_function_stats* next;
+    char* name;
+    int line;
+    uint64_t calls;
+    uint64_t instructions;
+    uint64_t bytes_allocated;
+};
+
+typedef struct clox_stats {
+    uint64_t opcodes[CLOX_OP_COUNT];
+    uint64_t compiler_bytes;
+    clox_function_stats* functions;
+} clox_stats;
+
+API bool clox_has_stats();
+// Writes the counters as a JSON object. Returns false if the build does not
+// collect stats.
+API bool clox_write_stats(clox_vm* vm, FILE* out);
+
+#ifdef CLOX_STATS
+clox_stats* clox_new_stats();
+void clox_free_stats(clox_vm* vm, clox_stats* stats);
+clox_function_stats* clox_new_function_stats(clox_vm* vm, clox_obj_function* function);
+// vmstats(): the clox_write_stats() report as a string, or nil if it could
+// not be written.
+clox_value clox_vmstats_native(clox_vm* vm, int arg_count, clox_value* args);
+
+static inline clox_function_stats* clox_function_stats_of(clox_vm* vm, clox_obj_function* function)
+{
+    if (function->stats != NULL) return function->stats;
+    return clox_new_function_stats(vm, function);
+}
+
+static inline void clox_stats_instruction(clox_vm* vm, clox_obj_function* function, uint8_t instruction)
+{
+    if (instruction < CLOX_OP_COUNT) vm->stats->opcodes[instruction]++;
+    clox_function_stats_of(vm, function)->instructions++;
+}
+
+static inline void clox_stats_allocation(clox_vm* vm, size_t bytes)
+{
+    if (vm->stats == NULL) return;
+    if (vm->frame_count == 0) {
+        vm->stats->compiler_bytes += bytes;
+    } else {
+        clox_function_stats_of(vm, vm->frames[vm->frame_count - 1].function)->bytes_allocated += bytes;
+    }
+}
+#endif
+
+#endif // __CLOX_STATS_H__
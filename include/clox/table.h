@@ -4,23 +4,56 @@
 #include "common.h"
 #include "value.h"
 
+// Slots are probed in groups of this many control bytes at a time.
+#define CLOX_TABLE_GROUP 16
+// Whether a control byte belongs to a slot that holds an entry.
+#define CLOX_TABLE_IS_LIVE(control) (((control) & 0x80) == 0)
+
 typedef struct {
     clox_obj_string* key;
     clox_value value;
 } clox_entry;
 
+// Open addressing with one control byte per slot, kept apart from the
+// entries: the low 7 bits of the key's hash for a live slot, or a marker for
+// an empty or deleted one. A lookup compares a whole group of control bytes
+// with the hash bits at once and only reads the entries that match. The
+// control bytes of the first group are repeated after the last slot, so a
+// group starting anywhere can be loaded without wrapping. Only the entries
+// of live slots are initialized, so walks over the arrays go by the control
+// bytes.
+//
+// An incremental table does not rehash in one step when it fills up. It
+// allocates the new arrays and keeps the old ones beside them, and every
+// insert and lookup moves the entries of a few old slots over. Until the old
+// arrays are empty, lookups search both.
 typedef struct {
+    // Live entries, old ones included.
     int count;
+    // Zero, or a power of two of at least CLOX_TABLE_GROUP.
     int capacity;
+    // Empty slots that can still be filled before the table is rebuilt.
+    int growth_left;
+    uint8_t* control;
     clox_entry* entries;
+
+    // The arrays being moved out of, and the first slot not moved yet.
+    int old_count;
+    int old_capacity;
+    int migrated;
+    uint8_t* old_control;
+    clox_entry* old_entries;
+
+    // Set by clox_init_table(). Clear it before the first insert to rehash
+    // in one step.
+    bool incremental;
 } clox_table;
 
 void clox_init_table(clox_table* table);
-void clox_free_table(clox_table* table);
+void clox_free_table(clox_vm* vm, clox_table* table);
 bool clox_table_get(clox_table* table, clox_obj_string* key, clox_value* out_value);
-bool clox_table_set(clox_table* table, clox_obj_string* key, clox_value value);
+bool clox_table_set(clox_vm* vm, clox_table* table, clox_obj_string* key, clox_value value);
 bool clox_table_delete(clox_table* table, clox_obj_string* key);
-void clox_table_add_all(clox_table* from, clox_table* to);
-clox_obj_string* clox_table_find_string(clox_table* table, const char* chars, int length, uint32_t hash);
+void clox_table_add_all(clox_vm* vm, clox_table* from, clox_table* to);
 
 #endif // __CLOX_TABLE_H__
@@ -1,18 +1,76 @@
 #ifndef __CLOX_VALUE_H__
 #define __CLOX_VALUE_H__
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
+#include "heap.h"
+
+typedef struct clox_obj clox_obj;
+typedef struct clox_obj_string clox_obj_string;
+
+#ifdef CLOX_NAN_BOXING
+
+// Numbers are stored as raw doubles. Everything else lives in the payload of
+// a quiet NaN: nil and the booleans use the low tag bits, object pointers set
+// the sign bit and keep the pointer in the low 48 bits.
+typedef uint64_t clox_value;
+
+#define CLOX_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define CLOX_QNAN ((uint64_t)0x7ffc000000000000)
+
+#define CLOX_TAG_NIL 1
+#define CLOX_TAG_FALSE 2
+#define CLOX_TAG_TRUE 3
+#define CLOX_TAG_UNDEFINED 4
+
+#define CLOX_FALSE_VAL ((clox_value)(uint64_t)(CLOX_QNAN | CLOX_TAG_FALSE))
+#define CLOX_TRUE_VAL ((clox_value)(uint64_t)(CLOX_QNAN | CLOX_TAG_TRUE))
+
+#define CLOX_BOOL_VAL(value) ((value) ? CLOX_TRUE_VAL : CLOX_FALSE_VAL)
+#define CLOX_NIL_VAL ((clox_value)(uint64_t)(CLOX_QNAN | CLOX_TAG_NIL))
+#define CLOX_UNDEFINED_VAL ((clox_value)(uint64_t)(CLOX_QNAN | CLOX_TAG_UNDEFINED))
+#define CLOX_NUMBER_VAL(value) clox_number_to_value(value)
+#define CLOX_OBJ_VAL(object) \
+    ((clox_value)(CLOX_SIGN_BIT | CLOX_QNAN | (uint64_t)(uintptr_t)(object)))
+
+#define CLOX_AS_BOOL(value) ((value) == CLOX_TRUE_VAL)
+#define CLOX_AS_NUMBER(value) clox_value_to_number(value)
+#define CLOX_AS_OBJ(value) \
+    ((clox_obj*)(uintptr_t)((value) & ~(CLOX_SIGN_BIT | CLOX_QNAN)))
+
+#define CLOX_IS_BOOL(value) (((value) | 1) == CLOX_TRUE_VAL)
+#define CLOX_IS_NIL(value) ((value) == CLOX_NIL_VAL)
+#define CLOX_IS_UNDEFINED(value) ((value) == CLOX_UNDEFINED_VAL)
+#define CLOX_IS_NUMBER(value) (((value) & CLOX_QNAN) != CLOX_QNAN)
+#define CLOX_IS_OBJ(value) \
+    (((value) & (CLOX_QNAN | CLOX_SIGN_BIT)) == (CLOX_QNAN | CLOX_SIGN_BIT))
+
+static inline double clox_value_to_number(clox_value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(double));
+    return number;
+}
+
+static inline clox_value clox_number_to_value(double number)
+{
+    clox_value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum {
     CLOX_VAL_BOOL,
     CLOX_VAL_NIL,
     CLOX_VAL_NUMBER,
-    CLOX_VAL_OBJ
+    CLOX_VAL_OBJ,
+    CLOX_VAL_UNDEFINED
 } clox_value_type;
 
-typedef struct clox_obj clox_obj;
-typedef struct clox_obj_string clox_obj_string;
-
 typedef struct {
     clox_value_type type;
     union {
@@ -22,14 +80,9 @@ typedef struct {
     } as;
 } clox_value;
 
-typedef struct {
-    int capacity;
-    int count;
-    clox_value* values;
-} clox_value_array;
-
 #define CLOX_BOOL_VAL(value) ((clox_value){ CLOX_VAL_BOOL, {.boolean = value} })
 #define CLOX_NIL_VAL ((clox_value){ CLOX_VAL_NIL, {.number = 0} })
+#define CLOX_UNDEFINED_VAL ((clox_value){ CLOX_VAL_UNDEFINED, {.number = 0} })
 #define CLOX_NUMBER_VAL(value) ((clox_value){ CLOX_VAL_NUMBER, {.number = value} })
 #define CLOX_OBJ_VAL(object) ((clox_value){ CLOX_VAL_OBJ, {.obj = (clox_obj*)object} })
 
@@ -39,13 +92,24 @@ typedef struct {
 
 #define CLOX_IS_BOOL(value) ((value).type == CLOX_VAL_BOOL)
 #define CLOX_IS_NIL(value) ((value).type == CLOX_VAL_NIL)
+#define CLOX_IS_UNDEFINED(value) ((value).type == CLOX_VAL_UNDEFINED)
 #define CLOX_IS_NUMBER(value) ((value).type == CLOX_VAL_NUMBER)
 #define CLOX_IS_OBJ(value) ((value).type == CLOX_VAL_OBJ)
- 
+
+#endif // CLOX_NAN_BOXING
+
+typedef struct {
+    int capacity;
+    int count;
+    clox_value* values;
+} clox_value_array;
+
 void clox_init_value_array(clox_value_array *array);
-void clox_write_value_array(clox_value_array *array, clox_value value);
-void clox_free_value_array(clox_value_array *array);
-void clox_print_value(clox_value value);
-bool clox_value_equal(clox_value a, clox_value b);
+void clox_write_value_array(clox_vm* vm, clox_value_array *array, clox_value value, clox_alloc_kind kind);
+// Grows the array so the next count writes do not allocate.
+void clox_reserve_value_array(clox_vm* vm, clox_value_array *array, int count, clox_alloc_kind kind);
+void clox_free_value_array(clox_vm* vm, clox_value_array *array, clox_alloc_kind kind);
+API void clox_print_value(FILE* out, clox_value value);
+API bool clox_value_equal(clox_value a, clox_value b);
 
 #endif // __CLOX_VALUE_H__
@@ -1,13 +1,38 @@
 #ifndef __CLOX_VM_H__
 #define __CLOX_VM_H__
 
+#include <setjmp.h>
+
 #include "chunk.h"
+#include "heap.h"
 #include "value.h"
 #include "object.h"
 #include "table.h"
+#include "intern.h"
+#include "pool.h"
 
+// Default call depth of a new VM; clox_set_frame_max() changes it per VM,
+// up to CLOX_FRAME_LIMIT.
+#ifndef CLOX_FRAME_MAX
 #define CLOX_FRAME_MAX 64
-#define CLOX_STACK_MAX (CLOX_FRAME_MAX * CLOX_UINT8_COUNT)
+#endif
+#define CLOX_FRAME_LIMIT (1 << 20)
+// JIT and AOT code nest on the C stack once per call, so frames deeper than
+// this run in the interpreter, which does not.
+#define CLOX_NATIVE_FRAME_MAX 1024
+#define CLOX_GLOBALS_MAX (UINT16_MAX + 1)
+
+#ifndef CLOX_GC_HEAP_GROW_FACTOR
+#define CLOX_GC_HEAP_GROW_FACTOR 2
+#endif
+
+#ifndef CLOX_GC_INITIAL_HEAP
+#define CLOX_GC_INITIAL_HEAP (1024 * 1024)
+#endif
+
+#ifndef CLOX_JIT_THRESHOLD
+#define CLOX_JIT_THRESHOLD 1000
+#endif
 
 typedef struct {
     clox_obj_function* function;
@@ -15,15 +40,51 @@ typedef struct {
     clox_value* slots;
 } clox_call_frame;
 
-typedef struct {
-    clox_call_frame frames[CLOX_FRAME_MAX];
+struct clox_vm {
+    // Both stacks are sized for frame_max frames of CLOX_UINT8_COUNT slots
+    // each and never move while a script runs. A frame may use more than
+    // its share of slots; stack_end is where the value stack runs out.
+    clox_call_frame* frames;
     int frame_count;
-    clox_value stack[CLOX_STACK_MAX];
+    int frame_max;
+    clox_value* stack;
     clox_value* stack_top;
-    clox_table strings;
-    clox_table globals;
+    clox_value* stack_end;
+    clox_intern_set strings;
+    clox_table global_slots;
+    clox_value_array global_names;
+    clox_value_array global_values;
     clox_obj* objects;
-} clox_vm;
+    int gray_count;
+    int gray_capacity;
+    clox_obj** gray_stack;
+    size_t bytes_allocated;
+    size_t next_gc;
+    size_t peak_bytes;
+    size_t heap_limit;
+    uint64_t collections;
+    clox_heap_usage allocations[CLOX_ALLOC_KIND_COUNT];
+    // Where a failed allocation unwinds to while a script runs.
+    jmp_buf* out_of_memory;
+    double gc_heap_grow_factor;
+    clox_pool pool;
+    struct clox_compiler* compiler;
+    // Identifiers and string literals of the script being compiled.
+    clox_intern_batch compile_strings;
+    struct clox_opcode_profile* profile;
+    struct clox_sampler* sampler;
+#ifdef CLOX_STATS
+    struct clox_stats* stats;
+#endif
+    // Where print statements and diagnostics go; stdout and stderr unless
+    // the embedder points them somewhere else.
+    FILE* out;
+    FILE* err;
+    // Functions are compiled to native code after jit_threshold calls and
+    // loop back-edges. Only builds with CLOX_JIT on x86-64 have the tier.
+    bool jit_enabled;
+    int jit_threshold;
+};
 
 typedef enum {
     CLOX_INTERPRET_OK,
@@ -31,13 +92,55 @@ typedef enum {
     CLOX_INTERPRET_RUNTIME_ERROR
 } clox_interpret_result;
 
-extern clox_vm clox_vm_instance;
+// What a tail call did with the calling frame. The values line up with
+// clox_interpret_result, so generated code can hand an error straight back.
+typedef enum {
+    // A native ran and its result is on the stack, ready for the RETURN.
+    CLOX_TAIL_CALL_RETURNED = CLOX_INTERPRET_OK,
+    CLOX_TAIL_CALL_ERROR = CLOX_INTERPRET_RUNTIME_ERROR,
+    // The frame now runs the callee from its first instruction.
+    CLOX_TAIL_CALL_REPLACED
+} clox_tail_call_result;
+
+// Every VM owns its heap, interned strings and globals. Different VMs share
+// nothing and can run on different threads at the same time; a single VM
+// must only be used by one thread at a time.
+API clox_vm* clox_new_vm();
+API void clox_free_vm(clox_vm* vm);
+// Forgets every global the previous scripts defined, so the next script sees
+// a fresh VM. The heap, interned strings and pools are kept warm.
+API void clox_reset_vm(clox_vm* vm);
+// Calls nested deeper than frame_max fail with "Stack overflow.". The stacks
+// are reserved again for the new depth, so this only works while no script
+// is running. Returns false if frame_max is out of range or the memory
+// cannot be reserved; the VM keeps its old stacks then.
+API bool clox_set_frame_max(clox_vm* vm, int frame_max);
+API clox_interpret_result clox_interpret(clox_vm* vm, const char *source);
+API clox_interpret_result clox_interpret_function(clox_vm* vm, clox_obj_function* function);
+// Like clox_interpret(), but loads the script from the bytecode cache at
+// cache_path when it was written for this source, and writes it there
+// after compiling otherwise. Loading is held to the heap limit like
+// compiling is.
+API clox_interpret_result clox_interpret_cached(clox_vm* vm, const char* source, const char* cache_path);
+API int clox_resolve_global(clox_vm* vm, clox_obj_string* name);
+API void clox_stack_push(clox_vm* vm, clox_value value);
+API clox_value clox_stack_pop(clox_vm* vm);
+API clox_value clox_stack_peek(clox_vm* vm, int distance);
 
-void clox_init_vm();
-void clox_free_vm();
-clox_interpret_result clox_interpret(const char *source);
-void clox_stack_push(clox_value value);
-clox_value clox_stack_pop();
-clox_value clox_stack_peek(int distance);
+// Services for code that runs outside the interpreter loop: the JIT and C
+// emitted by the AOT backend. They expect vm->stack_top and the current
+// frame's ip to be up to date. clox_runtime_call() runs the callee to
+// completion and leaves its result in place of the callee and arguments.
+// clox_runtime_resume() runs the innermost frame from its ip until it
+// returns, in whichever tier its function has. clox_runtime_equal()
+// replaces the top two values with whether they are equal, flattening
+// ropes and counting the comparison against strings that are not interned.
+API clox_interpret_result clox_runtime_call(clox_vm* vm, int arg_count);
+API clox_tail_call_result clox_runtime_tail_call(clox_vm* vm, int arg_count);
+API clox_interpret_result clox_runtime_resume(clox_vm* vm);
+API bool clox_runtime_add(clox_vm* vm);
+API void clox_runtime_equal(clox_vm* vm);
+API void clox_runtime_error(clox_vm* vm, const char* message);
+API void clox_runtime_undefined_global(clox_vm* vm, int slot);
 
 #endif // __CLOX_VM_H__
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox/aot.h"
+#include "clox/bytecode.h"
+#include "clox/chunk.h"
+#include "clox/object.h"
+#include "clox/value.h"
+#include "clox/vm.h"
+
+// Every function in a script's tree, numbered in pre-order. The emitter and
+// clox_aot_main() both walk the constants the same way, so the numbers agree
+// between the compiled tree and the one loaded back from the image.
+typedef struct {
+    clox_obj_function** functions;
+    int count;
+    int capacity;
+} function_list;
+
+// Per-program facts the emitter needs while it translates one function.
+typedef struct {
+    FILE* out;
+    function_list list;
+    // Index into list of the function every read of a global slot returns,
+    // or -1 when the slot is not written exactly once by a declaration.
+    int* known;
+} emitter;
+
+static bool collect_functions(function_list* list, clox_obj_function* function)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        clox_obj_function** functions = (clox_obj_function**)realloc(
+            list->functions, sizeof(clox_obj_function*) * capacity
+        );
+        if (functions == NULL) return false;
+        list->functions = functions;
+        list->capacity = capacity;
+    }
+    list->functions[list->count++] = function;
+
+    clox_value_array* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (CLOX_IS_FUNCTION(constants->values[i])
+            && !collect_functions(list, CLOX_AS_FUNCTION(constants->values[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int find_function(function_list* list, clox_obj_function* function)
+{
+    for (int i = 0; i < list->count; i++) {
+        if (list->functions[i] == function) return i;
+    }
+    return -1;
+}
+
+static uint16_t read_short(uint8_t* code)
+{
+    return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+// A global is a known callee when the script defines it exactly once from a
+// function constant, the way a fun declaration compiles, and nothing ever
+// assigns it. Any read that succeeds then yields that function.
+static bool find_known_callees(clox_vm* vm, emitter* emitter)
+{
+    int count = vm->global_names.count;
+    int* defines = (int*)calloc(count + 1, sizeof(int));
+    emitter->known = (int*)malloc(sizeof(int) * (count + 1));
+    if (defines == NULL || emitter->known == NULL) {
+        free(defines);
+        return false;
+    }
+    for (int i = 0; i < count; i++) emitter->known[i] = -1;
+
+    for (int i = 0; i < emitter->list.count; i++) {
+        clox_chunk* chunk = &emitter->list.functions[i]->chunk;
+        int previous = -1;
+        for (int offset = 0; offset < chunk->count; offset += clox_instruction_length(chunk->code[offset])) {
+            uint8_t* code = chunk->code + offset;
+            uint8_t instruction = clox_base_opcode(code[0]);
+            if (instruction == CLOX_OP_DEFINE_GLOBAL || instruction == CLOX_OP_SET_GLOBAL) {
+                int slot = read_short(code + 1);
+                int known = -1;
+                if (i == 0 && instruction == CLOX_OP_DEFINE_GLOBAL && previous >= 0
+                    && clox_base_opcode(chunk->code[previous]) == CLOX_OP_CONSTANT) {
+                    clox_value constant = chunk->constants.values[chunk->code[previous + 1]];
+                    if (CLOX_IS_FUNCTION(constant)) {
+                        known = find_function(&emitter->list, CLOX_AS_FUNCTION(constant));
+                    }
+                }
+                // Assignments count as a second definition.
+                defines[slot] += known < 0 ? 2 : 1;
+                emitter->known[slot] = defines[slot] == 1 ? known : -1;
+            }
+            previous = offset;
+        }
+    }
+
+    free(defines);
+    return true;
+}
+
+static bool emit_function(emitter* emitter, int index)
+{
+    clox_obj_function* function = emitter->list.functions[index];
+    clox_chunk* chunk = &function->chunk;
+    FILE* out = emitter->out;
+
+    int* depth = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    bool* target = (bool*)malloc(sizeof(bool) * (chunk->count + 1));
+    int* work = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    int max_depth = depth != NULL && target != NULL && work != NULL
+        ? clox_analyze_stack(chunk, function->arity, depth, target, work)
+        : -1;
+    free(work);
+    // Which global each stack slot was read from, to spot known callees.
+    int* origin = max_depth >= 0 ? (int*)malloc(sizeof(int) * (max_depth + 1)) : NULL;
+    if (origin == NULL) {
+        free(depth);
+        free(target);
+        return false;
+    }
+    for (int i = 0; i <= max_depth; i++) origin[i] = -1;
+
+    fprintf(out, "\n// %s\n", function->name == NULL ? "script" : function->name->chars);
+    fprintf(out, "static bool fn_%d(clox_vm* vm)\n{\n    CLOX_AOT_PROLOGUE();\n", index);
+
+    bool ok = true;
+    for (int offset = 0; offset < chunk->count && ok; offset += clox_instruction_length(chunk->code[offset])) {
+        if (depth[offset] < 0) continue;
+
+        uint8_t* code = chunk->code + offset;
+        int d = depth[offset];
+        int next = offset + clox_instruction_length(code[0]);
+        if (target[offset]) {
+            fprintf(out, "L%d:\n", offset);
+            // Paths that join here may disagree about the top of the stack.
+            for (int i = d > 0 ? d - 1 : 0; i <= max_depth; i++) origin[i] = -1;
+        }
+
+        switch (clox_base_opcode(code[0])) {
+            case CLOX_OP_CONSTANT:
+                fprintf(out, "    slots[%d] = constants[%d];\n", d, code[1]);
+                origin[d] = -1;
+                break;
+            case CLOX_OP_NIL:
+                fprintf(out, "    slots[%d] = CLOX_NIL_VAL;\n", d);
+                origin[d] = -1;
+                break;
+            case CLOX_OP_TRUE:
+            case CLOX_OP_FALSE:
+                fprintf(out, "    slots[%d] = CLOX_BOOL_VAL(%s);\n", d, code[0] == CLOX_OP_TRUE ? "true" : "false");
+                origin[d] = -1;
+                break;
+            case CLOX_OP_POP:
+                break;
+            case CLOX_OP_GET_LOCAL:
+                fprintf(out, "    slots[%d] = slots[%d];\n", d, code[1]);
+                origin[d] = -1;
+                break;
+            case CLOX_OP_SET_LOCAL:
+                fprintf(out, "    slots[%d] = slots[%d];\n", code[1], d - 1);
+                if (code[1] <= max_depth) origin[code[1]] = -1;
+                break;
+            case CLOX_OP_GET_GLOBAL: {
+                int slot = read_short(code + 1);
+                fprintf(out, "    CLOX_AOT_GET_GLOBAL(%d, %d, %d);\n", d, slot, next);
+                origin[d] = slot;
+                break;
+            }
+            case CLOX_OP_SET_GLOBAL:
+                fprintf(out, "    CLOX_AOT_SET_GLOBAL(%d, %d, %d);\n", read_short(code + 1), d - 1, next);
+                break;
+            case CLOX_OP_DEFINE_GLOBAL:
+                fprintf(out, "    globals[%d] = slots[%d];\n", read_short(code + 1), d - 1);
+                break;
+            case CLOX_OP_ADD:
+                fprintf(out, "    CLOX_AOT_ADD(%d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_SUBTRACT:
+                fprintf(out, "    CLOX_AOT_BINARY(CLOX_NUMBER_VAL, -, %d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_MULTIPLY:
+                fprintf(out, "    CLOX_AOT_BINARY(CLOX_NUMBER_VAL, *, %d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_DEVIDE:
+                fprintf(out, "    CLOX_AOT_BINARY(CLOX_NUMBER_VAL, /, %d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_GREATER:
+                fprintf(out, "    CLOX_AOT_BINARY(CLOX_BOOL_VAL, >, %d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_LESS:
+                fprintf(out, "    CLOX_AOT_BINARY(CLOX_BOOL_VAL, <, %d, %d);\n", d - 2, next);
+                break;
+            case CLOX_OP_EQUAL:
+                fprintf(out, "    CLOX_AOT_EQUAL(%d, %d);\n", d - 2, next);
+                origin[d - 2] = -1;
+                break;
+            case CLOX_OP_NOT:
+                fprintf(out, "    slots[%d] = CLOX_BOOL_VAL(clox_aot_is_falsey(slots[%d]));\n", d - 1, d - 1);
+                origin[d - 1] = -1;
+                break;
+            case CLOX_OP_NEGATE:
+                fprintf(out, "    CLOX_AOT_NEGATE(%d, %d);\n", d - 1, next);
+                break;
+            case CLOX_OP_PRINT:
+                fprintf(out, "    CLOX_AOT_PRINT(%d);\n", d - 1);
+                break;
+            case CLOX_OP_JUMP_IF_FALSE:
+                fprintf(out, "    if (clox_aot_is_falsey(slots[%d])) goto L%d;\n", d - 1, next + read_short(code + 1));
+                break;
+            case CLOX_OP_JUMP:
+                fprintf(out, "    goto L%d;\n", next + read_short(code + 1));
+                for (int i = 0; i <= max_depth; i++) origin[i] = -1;
+                break;
+            case CLOX_OP_LOOP:
+                fprintf(out, "    goto L%d;\n", next - read_short(code + 1));
+                for (int i = 0; i <= max_depth; i++) origin[i] = -1;
+                break;
+            case CLOX_OP_CALL: {
+                int arg_count = code[1];
+                int callee = d - 1 - arg_count;
+                int known = origin[callee] >= 0 ? emitter->known[origin[callee]] : -1;
+                if (known >= 0 && emitter->list.functions[known]->arity == arg_count) {
+                    fprintf(out, "    CLOX_AOT_CALL_KNOWN(fn_%d, %d, %d, %d);\n", known, callee, arg_count, next);
+                } else {
+                    fprintf(out, "    CLOX_AOT_CALL(%d, %d, %d);\n", callee, arg_count, next);
+                }
+                origin[callee] = -1;
+                break;
+            }
+            case CLOX_OP_TAIL_CALL: {
+                int arg_count = code[1];
+                int callee = d - 1 - arg_count;
+                int known = origin[callee] >= 0 ? emitter->known[origin[callee]] : -1;
+                // The frame's slots were only checked for this function's
+                // stack, so a callee that needs more takes the generic path.
+                if (known >= 0 && emitter->list.functions[known]->arity == arg_count
+                    && emitter->list.functions[known]->max_slots <= function->max_slots) {
+                    fprintf(out, "    CLOX_AOT_TAIL_CALL_KNOWN(fn_%d, %d, %d);\n", known, callee, arg_count);
+                } else {
+                    fprintf(out, "    CLOX_AOT_TAIL_CALL(%d, %d, %d);\n", callee, arg_count, next);
+                }
+                origin[callee] = -1;
+                break;
+            }
+            case CLOX_OP_RETURN:
+                fprintf(out, "    CLOX_AOT_RETURN(%d);\n", d - 1);
+                for (int i = 0; i <= max_depth; i++) origin[i] = -1;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    fprintf(out, "}\n");
+
+    free(depth);
+    free(target);
+    free(origin);
+    return ok;
+}
+
+// The image carries everything the C code does not: constants, line runs
+// for error messages and the global slot assignment.
+static bool emit_image(clox_vm* vm, FILE* out, clox_obj_function* script)
+{
+    clox_memory_stream image;
+    if (!clox_open_memory_stream(&image)) return false;
+
+    bool ok = clox_dump_bytecode(vm, image.file, script, 0);
+    if (!clox_close_memory_stream(&image)) return false;
+
+    fprintf(out, "\nstatic const uint8_t image[] = {");
+    for (size_t i = 0; ok && i < image.length; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", (uint8_t)image.chars[i]);
+    }
+    fprintf(out, "\n};\n");
+
+    free(image.chars);
+    return ok;
+}
+
+bool clox_emit_c(clox_vm* vm, FILE* out, clox_obj_function* script)
+{
+    emitter emitter = { out, { NULL, 0, 0 }, NULL };
+    bool ok = collect_functions(&emitter.list, script) && find_known_callees(vm, &emitter);
+
+    fprintf(out, "// Generated by Clox --emit-c.\n");
+#ifdef CLOX_NAN_BOXING
+    fprintf(out, "#define CLOX_NAN_BOXING\n");
+#endif
+#ifdef CLOX_STATS
+    fprintf(out, "#define CLOX_STATS\n");
+#endif
+#ifdef CLOX_STATIC_DEFINE
+    fprintf(out, "#define CLOX_STATIC_DEFINE\n");
+#endif
+    fprintf(out, "#include \"clox/aot.h\"\n\n");
+
+    for (int i = 0; ok && i < emitter.list.count; i++) {
+        fprintf(out, "static bool fn_%d(clox_vm* vm);\n", i);
+    }
+    for (int i = 0; ok && i < emitter.list.count; i++) {
+        ok = emit_function(&emitter, i);
+    }
+    ok = ok && emit_image(vm, out, script);
+
+    if (ok) {
+        fprintf(out, "\nstatic const clox_aot_fn functions[] = {");
+        for (int i = 0; i < emitter.list.count; i++) {
+            fprintf(out, "%s fn_%d", i == 0 ? "" : ",", i);
+        }
+        fprintf(out, " };\n\n");
+        fprintf(out, "int main()\n{\n");
+        fprintf(out, "    return clox_aot_main(image, sizeof(image), functions, %d);\n", emitter.list.count);
+        fprintf(out, "}\n");
+    }
+
+    free(emitter.list.functions);
+    free(emitter.known);
+    return ok && !ferror(out);
+}
+
+int clox_aot_main(const uint8_t* image, size_t size, const clox_aot_fn* functions, int count)
+{
+    clox_vm* vm = clox_new_vm();
+    if (vm == NULL) {
+        fprintf(stderr, "Not enough memory to create a VM.\n");
+        return 74;
+    }
+
+    clox_obj_function* script = clox_load_bytecode(vm, image, size, 0);
+    function_list list = { NULL, 0, 0 };
+    if (script == NULL || !collect_functions(&list, script) || list.count != count) {
+        fprintf(stderr, "The embedded bytecode does not match this clox library.\n");
+        free(list.functions);
+        clox_free_vm(vm);
+        return 70;
+    }
+
+    for (int i = 0; i < count; i++) {
+        list.functions[i]->aot = functions[i];
+    }
+    free(list.functions);
+
+    clox_interpret_result result = clox_interpret_function(vm, script);
+    clox_free_vm(vm);
+    return result == CLOX_INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,481 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "clox/bytecode.h"
+#include "clox/compiler.h"
+#include "clox/hash.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+
+// File layout, all integers in host byte order:
+//
+//   "LOXC" u32 version  u32 byte order mark  u64 source hash
+//   u32 global count, then every global name in slot order
+//   the script function
+//
+// A function is its arity, an optional name, the code bytes, the line runs
+// as varint deltas and the constants. Nested functions are constants and
+// are written in place.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTE_ORDER_MARK 0x01020304u
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} constant_tag;
+
+typedef struct {
+    clox_vm* vm;
+    const uint8_t* current;
+    const uint8_t* end;
+    int depth;
+    bool ok;
+} reader;
+
+static void write_function(FILE* file, clox_obj_function* function);
+static clox_obj_function* read_function(reader* reader);
+
+uint64_t clox_hash_source(const char *source, size_t length)
+{
+    return clox_hash_bytes(source, length, 0);
+}
+
+static void write_u8(FILE* file, uint8_t value)
+{
+    fputc(value, file);
+}
+
+static void write_u32(FILE* file, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void write_varint(FILE* file, uint32_t value)
+{
+    while (value >= 0x80) {
+        write_u8(file, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    write_u8(file, (uint8_t)value);
+}
+
+static void write_string(FILE* file, clox_obj_string* string)
+{
+    write_u32(file, (uint32_t)string->length);
+    fwrite(string->chars, sizeof(char), string->length, file);
+}
+
+static void write_constant(FILE* file, clox_value value)
+{
+    if (CLOX_IS_NIL(value)) {
+        write_u8(file, CONSTANT_NIL);
+    } else if (CLOX_IS_BOOL(value)) {
+        write_u8(file, CLOX_AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (CLOX_IS_NUMBER(value)) {
+        double number = CLOX_AS_NUMBER(value);
+        write_u8(file, CONSTANT_NUMBER);
+        fwrite(&number, sizeof(number), 1, file);
+    } else if (CLOX_IS_STRING(value)) {
+        write_u8(file, CONSTANT_STRING);
+        write_string(file, CLOX_AS_STRING(value));
+    } else {
+        write_u8(file, CONSTANT_FUNCTION);
+        write_function(file, CLOX_AS_FUNCTION(value));
+    }
+}
+
+static void write_function(FILE* file, clox_obj_function* function)
+{
+    clox_chunk* chunk = &function->chunk;
+
+    write_u32(file, (uint32_t)function->arity);
+    write_u8(file, function->name != NULL);
+    if (function->name != NULL) write_string(file, function->name);
+
+    write_u32(file, (uint32_t)chunk->count);
+    fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+
+    write_u32(file, (uint32_t)chunk->line_count);
+    int offset = 0;
+    int line = 0;
+    for (int i = 0; i < chunk->line_count; i++) {
+        int line_delta = chunk->lines[i].line - line;
+        write_varint(file, (uint32_t)(chunk->lines[i].offset - offset));
+        write_varint(file, ((uint32_t)line_delta << 1) ^ (uint32_t)(line_delta >> 31));
+        offset = chunk->lines[i].offset;
+        line = chunk->lines[i].line;
+    }
+
+    write_u32(file, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        write_constant(file, chunk->constants.values[i]);
+    }
+}
+
+bool clox_dump_bytecode(clox_vm* vm, FILE *file, clox_obj_function *function, uint64_t source_hash)
+{
+    fwrite(BYTECODE_MAGIC, sizeof(char), 4, file);
+    write_u32(file, CLOX_BYTECODE_VERSION);
+    write_u32(file, BYTE_ORDER_MARK);
+    fwrite(&source_hash, sizeof(source_hash), 1, file);
+
+    // Global operands are slot numbers, so the loader has to reproduce the
+    // same name to slot assignment before any of the code can run.
+    clox_value_array* names = &vm->global_names;
+    write_u32(file, (uint32_t)names->count);
+    for (int i = 0; i < names->count; i++) {
+        write_string(file, CLOX_AS_STRING(names->values[i]));
+    }
+
+    write_function(file, function);
+    return !ferror(file);
+}
+
+bool clox_write_bytecode(clox_vm* vm, const char *path, clox_obj_function *function, uint64_t source_hash)
+{
+    size_t length = strlen(path);
+    char* temp_path = (char*)malloc(length + sizeof(".XXXXXX"));
+    if (temp_path == NULL) return false;
+    memcpy(temp_path, path, length);
+    memcpy(temp_path + length, ".XXXXXX", sizeof(".XXXXXX"));
+
+    // Batch runs can compile the same script on several threads at once, so
+    // every writer needs a temporary file of its own.
+    FILE* file = NULL;
+#ifdef CLOX_HAVE_MMAP
+    int fd = mkstemp(temp_path);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        file = fdopen(fd, "wb");
+        if (file == NULL) {
+            close(fd);
+            remove(temp_path);
+        }
+    }
+#else
+    memcpy(temp_path + length, ".tmp", sizeof(".tmp"));
+    file = fopen(temp_path, "wb");
+#endif
+    if (file == NULL) {
+        free(temp_path);
+        return false;
+    }
+
+    bool ok = clox_dump_bytecode(vm, file, function, source_hash);
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) remove(temp_path);
+
+    free(temp_path);
+    return ok;
+}
+
+static const uint8_t* read_bytes(reader* reader, size_t length)
+{
+    if (!reader->ok || (size_t)(reader->end - reader->current) < length) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    const uint8_t* bytes = reader->current;
+    reader->current += length;
+    return bytes;
+}
+
+static uint8_t read_u8(reader* reader)
+{
+    const uint8_t* bytes = read_bytes(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static uint32_t read_u32(reader* reader)
+{
+    uint32_t value = 0;
+    const uint8_t* bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t read_varint(reader* reader)
+{
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t byte = read_u8(reader);
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+
+    reader->ok = false;
+    return 0;
+}
+
+static clox_obj_string* read_string(reader* reader)
+{
+    uint32_t length = read_u32(reader);
+    if (length > INT32_MAX) reader->ok = false;
+
+    const uint8_t* chars = read_bytes(reader, length);
+    if (chars == NULL) return NULL;
+    return clox_copy_string(reader->vm, (const char*)chars, (int)length);
+}
+
+static bool read_constant(reader* reader, clox_chunk* chunk)
+{
+    clox_value value;
+
+    switch (read_u8(reader)) {
+    case CONSTANT_NIL:
+        value = CLOX_NIL_VAL;
+        break;
+    case CONSTANT_FALSE:
+        value = CLOX_BOOL_VAL(false);
+        break;
+    case CONSTANT_TRUE:
+        value = CLOX_BOOL_VAL(true);
+        break;
+    case CONSTANT_NUMBER: {
+        double number = 0;
+        const uint8_t* bytes = read_bytes(reader, sizeof(number));
+        if (bytes == NULL) return false;
+        memcpy(&number, bytes, sizeof(number));
+        value = CLOX_NUMBER_VAL(number);
+        break;
+    }
+    case CONSTANT_STRING: {
+        clox_obj_string* string = read_string(reader);
+        if (string == NULL) return false;
+        value = CLOX_OBJ_VAL(string);
+        break;
+    }
+    case CONSTANT_FUNCTION: {
+        clox_obj_function* function = read_function(reader);
+        if (function == NULL) return false;
+        value = CLOX_OBJ_VAL(function);
+        break;
+    }
+    default:
+        reader->ok = false;
+        return false;
+    }
+
+    clox_chunk_add_constant(reader->vm, chunk, value);
+    return reader->ok;
+}
+
+// Loaded code only runs if the VM could not read or jump outside it: every
+// reachable instruction must keep the stack consistent, name a constant,
+// global or local that exists and jump to the start of an instruction.
+// Fused and quickened opcodes are reset and fused again, so a
+// superinstruction always stands for the code under it.
+static bool check_code(reader* reader, clox_obj_function* function)
+{
+    clox_chunk* chunk = &function->chunk;
+    clox_stack_analysis analysis;
+    clox_init_stack_analysis(reader->vm, &analysis, chunk);
+    int* depth = analysis.depth;
+    function->max_slots = clox_analyze_stack(chunk, function->arity, depth, analysis.target, analysis.work);
+    bool ok = function->max_slots >= 0;
+
+    for (int offset = 0; ok && offset < chunk->count;) {
+        uint8_t* code = chunk->code + offset;
+        int length = clox_instruction_length(code[0]);
+        for (int i = 1; i < length && offset + i < chunk->count; i++) {
+            if (depth[offset + i] >= 0) ok = false;
+        }
+
+        code[0] = clox_base_opcode(code[0]);
+        if (depth[offset] >= 0) {
+            switch (code[0]) {
+                case CLOX_OP_CONSTANT:
+                    ok = ok && code[1] < chunk->constants.count;
+                    break;
+                case CLOX_OP_GET_LOCAL:
+                case CLOX_OP_SET_LOCAL:
+                    ok = ok && code[1] < depth[offset];
+                    break;
+                case CLOX_OP_DEFINE_GLOBAL:
+                case CLOX_OP_GET_GLOBAL:
+                case CLOX_OP_SET_GLOBAL:
+                    ok = ok && ((code[1] << 8) | code[2]) < reader->vm->global_values.count;
+                    break;
+                default:
+                    break;
+            }
+        }
+        offset += length;
+    }
+
+    clox_free_stack_analysis(reader->vm, &analysis);
+    if (ok) clox_fuse_superinstructions(chunk);
+    return ok;
+}
+
+// Allocates as it goes, so the function under construction stays on the VM
+// stack until it is complete and reachable from its parent.
+static clox_obj_function* read_function(reader* reader)
+{
+    if (!reader->ok || reader->depth == CLOX_FRAME_MAX) {
+        reader->ok = false;
+        return NULL;
+    }
+    reader->depth++;
+
+    clox_obj_function* function = clox_new_function(reader->vm);
+    clox_stack_push(reader->vm, CLOX_OBJ_VAL(function));
+    clox_chunk* chunk = &function->chunk;
+
+    uint32_t arity = read_u32(reader);
+    if (arity > UINT8_MAX) reader->ok = false;
+    function->arity = (int)arity;
+    if (read_u8(reader)) function->name = read_string(reader);
+
+    uint32_t code_count = read_u32(reader);
+    const uint8_t* code = read_bytes(reader, code_count);
+    if (code != NULL && code_count > 0) {
+        chunk->code = GROW_ARRAY(reader->vm, uint8_t, NULL, 0, code_count, CLOX_ALLOC_CODE);
+        chunk->capacity = (int)code_count;
+        chunk->count = (int)code_count;
+        memcpy(chunk->code, code, code_count);
+    }
+
+    uint32_t line_count = read_u32(reader);
+    if (line_count > code_count) reader->ok = false;
+    if (reader->ok && line_count > 0) {
+        chunk->lines = GROW_ARRAY(reader->vm, clox_line_run, NULL, 0, line_count, CLOX_ALLOC_CODE);
+        chunk->line_capacity = (int)line_count;
+
+        int offset = 0;
+        int line = 0;
+        for (uint32_t i = 0; i < line_count && reader->ok; i++) {
+            offset += (int)read_varint(reader);
+            uint32_t line_delta = read_varint(reader);
+            line += (int)(line_delta >> 1) ^ -(int)(line_delta & 1);
+            chunk->lines[i].offset = offset;
+            chunk->lines[i].line = line;
+            chunk->line_count++;
+        }
+    }
+
+    uint32_t constant_count = read_u32(reader);
+    for (uint32_t i = 0; i < constant_count && reader->ok; i++) {
+        read_constant(reader, chunk);
+    }
+
+    if (reader->ok && !check_code(reader, function)) reader->ok = false;
+
+    clox_stack_pop(reader->vm);
+    reader->depth--;
+    return reader->ok ? function : NULL;
+}
+
+static clox_obj_function* read_image(reader* reader, uint64_t source_hash)
+{
+    const uint8_t* magic = read_bytes(reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) return NULL;
+    if (read_u32(reader) != CLOX_BYTECODE_VERSION) return NULL;
+    if (read_u32(reader) != BYTE_ORDER_MARK) return NULL;
+
+    uint64_t hash = 0;
+    const uint8_t* hash_bytes = read_bytes(reader, sizeof(hash));
+    if (hash_bytes == NULL) return NULL;
+    memcpy(&hash, hash_bytes, sizeof(hash));
+    if (hash != source_hash) return NULL;
+
+    uint32_t global_count = read_u32(reader);
+    for (uint32_t i = 0; i < global_count && reader->ok; i++) {
+        clox_obj_string* name = read_string(reader);
+        if (name == NULL || clox_resolve_global(reader->vm, name) != (int)i) return NULL;
+    }
+
+    return read_function(reader);
+}
+
+clox_obj_function *clox_load_bytecode(clox_vm* vm, const uint8_t *image, size_t size, uint64_t source_hash)
+{
+    reader reader = { vm, image, image + size, 0, true };
+    return read_image(&reader, source_hash);
+}
+
+static void release_image(void* image, size_t size)
+{
+#ifdef CLOX_HAVE_MMAP
+    munmap(image, size);
+#else
+    (void)size;
+    free(image);
+#endif
+}
+
+// Loading allocates, and the jump reallocate() takes when memory runs out
+// would skip releasing image. The jump is caught here first and passed on
+// once the image is released.
+static clox_obj_function* load_and_release(clox_vm* vm, void* image, size_t size, uint64_t source_hash)
+{
+    jmp_buf out_of_memory;
+    jmp_buf* enclosing = vm->out_of_memory;
+    if (enclosing != NULL) {
+        if (setjmp(out_of_memory) != 0) {
+            vm->out_of_memory = enclosing;
+            release_image(image, size);
+            longjmp(*enclosing, 1);
+        }
+        vm->out_of_memory = &out_of_memory;
+    }
+
+    clox_obj_function* function = clox_load_bytecode(vm, (const uint8_t*)image, size, source_hash);
+    vm->out_of_memory = enclosing;
+    release_image(image, size);
+    return function;
+}
+
+clox_obj_function *clox_read_bytecode(clox_vm* vm, const char *path, uint64_t source_hash)
+{
+#ifdef CLOX_HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+
+    size_t size = length > 0 ? (size_t)length : 0;
+    void* image = size > 0 ? malloc(size) : NULL;
+    bool read = image != NULL && fread(image, 1, size, file) == size;
+    fclose(file);
+    if (!read) {
+        free(image);
+        return NULL;
+    }
+#endif
+
+    return load_and_release(vm, image, size, source_hash);
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "clox/chunk.h"
+#include "clox/vm.h"
 #include "memory.h"
 
 void clox_init_chunk(clox_chunk *chunk)
@@ -8,33 +9,245 @@ void clox_init_chunk(clox_chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
     clox_init_value_array(&chunk->constants);
 }
 
-void clox_free_chunk(clox_chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    clox_free_value_array(&chunk->constants);
+void clox_free_chunk(clox_vm* vm, clox_chunk *chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, CLOX_ALLOC_CODE);
+    FREE_ARRAY(vm, clox_line_run, chunk->lines, chunk->line_capacity, CLOX_ALLOC_CODE);
+    clox_free_value_array(vm, &chunk->constants, CLOX_ALLOC_CONSTANTS);
     clox_init_chunk(chunk);
 }
 
-void clox_write_chunk(clox_chunk *chunk, uint8_t byte, int line)
+void clox_write_chunk(clox_vm* vm, clox_chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1) {
-        int old_capacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, capacity, CLOX_ALLOC_CODE);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line) {
+        return;
+    }
+
+    if (chunk->line_capacity < chunk->line_count + 1) {
+        int capacity = GROW_CAPACITY(chunk->line_capacity);
+        chunk->lines = GROW_ARRAY(vm, clox_line_run, chunk->lines, chunk->line_capacity, capacity, CLOX_ALLOC_CODE);
+        chunk->line_capacity = capacity;
+    }
+
+    clox_line_run *run = &chunk->lines[chunk->line_count++];
+    run->offset = chunk->count - 1;
+    run->line = line;
+}
+
+uint8_t clox_base_opcode(uint8_t instruction)
+{
+    switch (instruction) {
+        case CLOX_OP_ADD_LOCALS:
+        case CLOX_OP_ADD_LOCAL_CONSTANT:
+        case CLOX_OP_SUBTRACT_LOCAL_CONSTANT:
+        case CLOX_OP_LESS_LOCAL_CONSTANT_JUMP:
+            return CLOX_OP_GET_LOCAL;
+        case CLOX_OP_SET_LOCAL_POP: return CLOX_OP_SET_LOCAL;
+        case CLOX_OP_POP_LOOP: return CLOX_OP_POP;
+        case CLOX_OP_ADD_NUM: return CLOX_OP_ADD;
+        case CLOX_OP_SUBTRACT_NUM: return CLOX_OP_SUBTRACT;
+        case CLOX_OP_MULTIPLY_NUM: return CLOX_OP_MULTIPLY;
+        case CLOX_OP_DEVIDE_NUM: return CLOX_OP_DEVIDE;
+        case CLOX_OP_GREATER_NUM: return CLOX_OP_GREATER;
+        case CLOX_OP_LESS_NUM: return CLOX_OP_LESS;
+        default: return instruction;
+    }
+}
+
+int clox_instruction_length(uint8_t instruction)
+{
+    switch (clox_base_opcode(instruction)) {
+        case CLOX_OP_CONSTANT:
+        case CLOX_OP_GET_LOCAL:
+        case CLOX_OP_SET_LOCAL:
+        case CLOX_OP_CALL:
+        case CLOX_OP_TAIL_CALL:
+            return 2;
+        case CLOX_OP_DEFINE_GLOBAL:
+        case CLOX_OP_GET_GLOBAL:
+        case CLOX_OP_SET_GLOBAL:
+        case CLOX_OP_JUMP_IF_FALSE:
+        case CLOX_OP_JUMP:
+        case CLOX_OP_LOOP:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+static uint16_t read_short(const uint8_t* code)
+{
+    return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+int clox_analyze_stack(const clox_chunk* chunk, int arity, int* depth, bool* target, int* work)
+{
+    for (int i = 0; i <= chunk->count; i++) {
+        depth[i] = -1;
+        target[i] = false;
+    }
+    if (chunk->count == 0) return -1;
+
+    int max_depth = arity + 1;
+    int work_count = 0;
+    depth[0] = max_depth;
+    work[work_count++] = 0;
+
+    // Each offset is queued at most once, when it is first reached.
+    while (work_count > 0) {
+        int offset = work[--work_count];
+        int current = depth[offset];
+        bool live = true;
+
+        while (live) {
+            const uint8_t* code = chunk->code + offset;
+            if (offset + clox_instruction_length(code[0]) > chunk->count) return -1;
+
+            int branch = -1;
+            uint8_t instruction = clox_base_opcode(code[0]);
+            switch (instruction) {
+                case CLOX_OP_CONSTANT:
+                case CLOX_OP_NIL:
+                case CLOX_OP_TRUE:
+                case CLOX_OP_FALSE:
+                case CLOX_OP_GET_LOCAL:
+                case CLOX_OP_GET_GLOBAL:
+                    current++;
+                    break;
+                case CLOX_OP_ADD:
+                case CLOX_OP_SUBTRACT:
+                case CLOX_OP_MULTIPLY:
+                case CLOX_OP_DEVIDE:
+                case CLOX_OP_EQUAL:
+                case CLOX_OP_GREATER:
+                case CLOX_OP_LESS:
+                case CLOX_OP_PRINT:
+                case CLOX_OP_POP:
+                case CLOX_OP_DEFINE_GLOBAL:
+                    current--;
+                    break;
+                case CLOX_OP_NEGATE:
+                case CLOX_OP_NOT:
+                case CLOX_OP_SET_LOCAL:
+                case CLOX_OP_SET_GLOBAL:
+                    break;
+                case CLOX_OP_CALL:
+                case CLOX_OP_TAIL_CALL:
+                    current -= code[1];
+                    break;
+                case CLOX_OP_JUMP_IF_FALSE:
+                    branch = offset + 3 + read_short(code + 1);
+                    break;
+                case CLOX_OP_JUMP:
+                    branch = offset + 3 + read_short(code + 1);
+                    live = false;
+                    break;
+                case CLOX_OP_LOOP:
+                    branch = offset + 3 - read_short(code + 1);
+                    if (branch < 0) return -1;
+                    live = false;
+                    break;
+                case CLOX_OP_RETURN:
+                    live = false;
+                    break;
+                default:
+                    return -1;
+            }
+            if (current < 1) return -1;
+            if (current > max_depth) max_depth = current;
+
+            if (branch >= 0) {
+                if (branch >= chunk->count) return -1;
+                target[branch] = true;
+                if (depth[branch] < 0) {
+                    depth[branch] = current;
+                    work[work_count++] = branch;
+                } else if (depth[branch] != current) {
+                    return -1;
+                }
+            }
+
+            offset += clox_instruction_length(code[0]);
+            if (!live) break;
+            if (offset >= chunk->count) return -1;
+            if (depth[offset] >= 0) {
+                if (depth[offset] != current) return -1;
+                break;
+            }
+            depth[offset] = current;
+        }
+    }
+    return max_depth;
+}
+
+static size_t stack_analysis_size(int count)
+{
+    return (sizeof(int) * 2 + sizeof(bool)) * count;
+}
+
+void clox_init_stack_analysis(clox_vm* vm, clox_stack_analysis* analysis, const clox_chunk* chunk)
+{
+    int count = chunk->count + 1;
+    uint8_t* block = ALLOCATE(vm, uint8_t, stack_analysis_size(count), CLOX_ALLOC_CODE);
+    analysis->depth = (int*)block;
+    analysis->work = analysis->depth + count;
+    analysis->target = (bool*)(analysis->work + count);
+    analysis->count = count;
 }
 
-int clox_chunk_add_constant(clox_chunk *chunk, clox_value value)
+void clox_free_stack_analysis(clox_vm* vm, clox_stack_analysis* analysis)
 {
-    clox_write_value_array(&chunk->constants, value);
+    FREE_ARRAY(vm, uint8_t, analysis->depth, stack_analysis_size(analysis->count), CLOX_ALLOC_CODE);
+    analysis->depth = NULL;
+    analysis->target = NULL;
+    analysis->work = NULL;
+    analysis->count = 0;
+}
+
+int clox_max_stack_depth(clox_vm* vm, const clox_chunk* chunk, int arity)
+{
+    clox_stack_analysis analysis;
+    clox_init_stack_analysis(vm, &analysis, chunk);
+    int max_depth = clox_analyze_stack(chunk, arity, analysis.depth, analysis.target, analysis.work);
+    clox_free_stack_analysis(vm, &analysis);
+    return max_depth;
+}
+
+int clox_chunk_add_constant(clox_vm* vm, clox_chunk *chunk, clox_value value)
+{
+    clox_stack_push(vm, value);
+    clox_write_value_array(vm, &chunk->constants, value, CLOX_ALLOC_CONSTANTS);
+    clox_stack_pop(vm);
     return chunk->constants.count - 1;
 }
+
+int clox_chunk_get_line(clox_chunk *chunk, int offset)
+{
+    // Binary search for the last run starting at or before offset.
+    int low = 0;
+    int high = chunk->line_count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return chunk->line_count > 0 ? chunk->lines[low].line : 0;
+}
@@ -8,12 +8,29 @@
 #include "clox/chunk.h"
 #include "clox/debug.h"
 #include "clox/object.h"
+#include "clox/vm.h"
+#include "memory.h"
 
+#define TOKEN_WINDOW 256
+
+// Everything one compilation needs. It lives on the stack of clox_compile()
+// and is passed to every parse function, so compilations in different VMs
+// can run in parallel.
 typedef struct {
+    clox_vm* vm;
+    clox_scanner scanner;
+    struct clox_compiler* compiler;
     clox_token current;
     clox_token previous;
     bool had_error;
     bool panic_mode;
+    // Tokens are scanned TOKEN_WINDOW at a time, so the strings they need
+    // can be interned together into vm->compile_strings.
+    clox_token tokens[TOKEN_WINDOW];
+    int token_count;
+    int next_token;
+    // Where intern() looks for a token in vm->compile_strings first.
+    int next_string;
 } parser_state;
 
 typedef enum {
@@ -30,7 +47,7 @@ typedef enum {
     PREC_PRIMARY
 } precedence_type;
 
-typedef void (*parse_fn)(bool can_assign);
+typedef void (*parse_fn)(parser_state* parser, bool can_assign);
 
 typedef struct {
     parse_fn prefix;
@@ -43,42 +60,76 @@ typedef struct {
     int depth;
 } local;
 
+// The most recently emitted constant load. It is only usable for folding
+// while it is still the tail of the chunk and no jump lands inside it.
+typedef struct {
+    int start;
+    int end;
+    int constant;
+    clox_value value;
+} constant_operand;
+
+typedef struct {
+    clox_op_code fused;
+    int length;
+    clox_op_code sequence[5];
+} superinstruction;
+
 typedef enum {
     FUNCTION_TYPE_FUNCTION,
     FUNCTION_TYPE_SCRIPT
 } function_type;
 
-typedef struct compiler {
-    struct compiler* enclosing;
+typedef struct clox_compiler {
+    struct clox_compiler* enclosing;
     local locals[CLOX_UINT8_COUNT];
     int local_count;
     int scope_depth;
     clox_obj_function* function;
     function_type function_type;
+    constant_operand last_constant;
+    int jump_target;
+    // Offset of the most recent CALL, so a return statement can turn it into
+    // a tail call when nothing was emitted after it.
+    int last_call;
 } compiler;
 
-static void init_compiler(compiler* compiler, function_type type);
-static void grouping(bool can_assign);
-static void unary(bool can_assign);
-static void binary(bool can_assign);
-static void number(bool can_assign);
-static void literal(bool can_assign);
-static void string(bool can_assign);
-static void variable(bool can_assign);
-static void and_(bool can_assign);
-static void or_(bool can_assign);
-static void call(bool can_assign);
-static void advance();
-static bool match(clox_token_type type);
-static void declaration();
-static clox_obj_function* end_compiler();
-static void statement();
-
-parser_state parser;
-compiler* current = NULL;
+static void init_compiler(parser_state* parser, compiler* compiler, function_type type);
+static void grouping(parser_state* parser, bool can_assign);
+static void unary(parser_state* parser, bool can_assign);
+static void binary(parser_state* parser, bool can_assign);
+static void number(parser_state* parser, bool can_assign);
+static void literal(parser_state* parser, bool can_assign);
+static void string(parser_state* parser, bool can_assign);
+static void variable(parser_state* parser, bool can_assign);
+static void and_(parser_state* parser, bool can_assign);
+static void or_(parser_state* parser, bool can_assign);
+static void call(parser_state* parser, bool can_assign);
+static void advance(parser_state* parser);
+static bool match(parser_state* parser, clox_token_type type);
+static void scan_window(parser_state* parser);
+static clox_obj_string* intern(parser_state* parser, const char* chars, int length);
+static void declaration(parser_state* parser);
+static clox_obj_function* end_compiler(parser_state* parser);
+static void statement(parser_state* parser);
+static int emit_jump(parser_state* parser, uint8_t instruction);
+
+// Picked from CLOX_PROFILE_OPCODES runs over bench/*.lox. Longer sequences
+// come first so they win over their own prefixes.
+static const superinstruction superinstructions[] = {
+    {
+        CLOX_OP_LESS_LOCAL_CONSTANT_JUMP, 5,
+        { CLOX_OP_GET_LOCAL, CLOX_OP_CONSTANT, CLOX_OP_LESS, CLOX_OP_JUMP_IF_FALSE, CLOX_OP_POP }
+    },
+    { CLOX_OP_ADD_LOCALS, 3, { CLOX_OP_GET_LOCAL, CLOX_OP_GET_LOCAL, CLOX_OP_ADD } },
+    { CLOX_OP_ADD_LOCAL_CONSTANT, 3, { CLOX_OP_GET_LOCAL, CLOX_OP_CONSTANT, CLOX_OP_ADD } },
+    { CLOX_OP_SUBTRACT_LOCAL_CONSTANT, 3, { CLOX_OP_GET_LOCAL, CLOX_OP_CONSTANT, CLOX_OP_SUBTRACT } },
+    { CLOX_OP_SET_LOCAL_POP, 2, { CLOX_OP_SET_LOCAL, CLOX_OP_POP } },
+    { CLOX_OP_POP_LOOP, 2, { CLOX_OP_POP, CLOX_OP_LOOP } }
+};
 
 parse_rule rules[] = {
-    [CLOX_TOKEN_LEFT_PAREN]     = { grouping, call, PREC_NONE },
+    [CLOX_TOKEN_LEFT_PAREN]     = { grouping, call, PREC_CALL },
     [CLOX_TOKEN_RIGHT_PAREN]    = { NULL, NULL, PREC_NONE },
     [CLOX_TOKEN_LEFT_BRACE]     = { NULL, NULL, PREC_NONE },
     [CLOX_TOKEN_RIGHT_BRACE]    = { NULL, NULL, PREC_NONE },
@@ -120,71 +171,141 @@ parse_rule rules[] = {
     [CLOX_TOKEN_EOF]            = { NULL, NULL, PREC_NONE }
 };
 
-clox_obj_function* clox_compile(const char *source)
+clox_obj_function* clox_compile(clox_vm* vm, const char *source)
 {
-    clox_init_scanner(source);
-    compiler compiler;
-    init_compiler(&compiler, FUNCTION_TYPE_SCRIPT);
+    parser_state state;
+    parser_state* parser = &state;
+    parser->vm = vm;
+    parser->compiler = NULL;
+    parser->had_error = false;
+    parser->panic_mode = false;
+    parser->token_count = 0;
+    parser->next_token = 0;
+    parser->next_string = 0;
+    clox_init_scanner(&parser->scanner, source);
 
-    parser.had_error = false;
-    parser.panic_mode = false;
+    compiler compiler;
+    init_compiler(parser, &compiler, FUNCTION_TYPE_SCRIPT);
 
-    advance();
+    advance(parser);
     
-    while (!match(CLOX_TOKEN_EOF)) {
-        declaration();
+    while (!match(parser, CLOX_TOKEN_EOF)) {
+        declaration(parser);
+    }
+
+    clox_obj_function* function = end_compiler(parser);
+    clox_intern_batch_clear(&vm->compile_strings);
+    return parser->had_error ? NULL : function;
+}
+
+void clox_mark_compiler_roots(clox_vm* vm)
+{
+    compiler* compiler = vm->compiler;
+    while (compiler != NULL) {
+        mark_object(vm, (clox_obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+
+    clox_intern_batch* strings = &vm->compile_strings;
+    for (int i = 0; i < strings->interned; i++) {
+        mark_object(vm, (clox_obj*)strings->strings[i]);
+    }
+}
+
+// Scans the next TOKEN_WINDOW tokens and interns their identifiers and
+// string literals in one batch. Local names get a string too, which the next
+// collection frees; telling them apart from globals would take a parse.
+static void scan_window(parser_state* parser)
+{
+    clox_intern_batch* strings = &parser->vm->compile_strings;
+    clox_intern_batch_clear(strings);
+    parser->next_string = 0;
+    parser->next_token = 0;
+    parser->token_count = 0;
+
+    while (parser->token_count < TOKEN_WINDOW) {
+        clox_token token = clox_scan_token(&parser->scanner);
+        parser->tokens[parser->token_count++] = token;
+
+        if (token.type == CLOX_TOKEN_IDENTIFIER) {
+            clox_intern_batch_push(parser->vm, strings, token.start, token.length);
+        } else if (token.type == CLOX_TOKEN_STRING) {
+            clox_intern_batch_push(parser->vm, strings, token.start + 1, token.length - 2);
+        } else if (token.type == CLOX_TOKEN_EOF) {
+            break;
+        }
+    }
+
+    clox_copy_strings(parser->vm, strings);
+}
+
+// The string interned with the window for the token at chars. Tokens are
+// mostly interned in source order, so the search only moves forward; a token
+// behind it or from the previous window is interned on its own.
+static clox_obj_string* intern(parser_state* parser, const char* chars, int length)
+{
+    clox_intern_batch* strings = &parser->vm->compile_strings;
+    while (parser->next_string < strings->interned && strings->chars[parser->next_string] < chars) {
+        parser->next_string++;
+    }
+    if (parser->next_string < strings->interned && strings->chars[parser->next_string] == chars) {
+        return strings->strings[parser->next_string];
     }
 
-    clox_obj_function* function = end_compiler();
-    return parser.had_error ? NULL : function;
+    return clox_copy_string(parser->vm, chars, length);
 }
 
-static void init_compiler(compiler* compiler, function_type type)
+static void init_compiler(parser_state* parser, compiler* compiler, function_type type)
 {
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
+    compiler->function = NULL;
     compiler->function_type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = clox_new_function();
-    current = compiler;
+    compiler->last_constant.end = -1;
+    compiler->jump_target = 0;
+    compiler->last_call = -1;
+    parser->compiler = compiler;
+    parser->vm->compiler = compiler;
+    compiler->function = clox_new_function(parser->vm);
 
     if (type != FUNCTION_TYPE_SCRIPT) {
-        current->function->name = clox_copy_string(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = intern(parser, parser->previous.start, parser->previous.length);
     }
 
-    local* local = &current->locals[current->local_count++];
+    local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
 }
 
-static bool check(clox_token_type type) 
+static bool check(parser_state* parser, clox_token_type type) 
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static void error_at(clox_token *token, const char *message)
+static void error_at(parser_state* parser, clox_token *token, const char *message)
 {
-    if (parser.panic_mode) return;
-    parser.panic_mode = true;
+    if (parser->panic_mode) return;
+    parser->panic_mode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
 
     if (token->type == CLOX_TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     } else if (token->type == CLOX_TOKEN_ERROR) {
         // Nothing
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    fprintf(parser->vm->err, ": %s\n", message);
+    parser->had_error = true;
 }
 
-static clox_chunk* current_chunk()
+static clox_chunk* current_chunk(parser_state* parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
 static parse_rule *get_rule(clox_token_type type)
@@ -192,264 +313,469 @@ static parse_rule *get_rule(clox_token_type type)
     return &rules[type];
 }
 
-static void mark_initialized()
+static void mark_initialized(parser_state* parser)
 {
-    if (current->scope_depth == 0) return;
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+    if (parser->compiler->scope_depth == 0) return;
+    parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-static void error_at_current(const char *message)
+static void error_at_current(parser_state* parser, const char *message)
 {
-    error_at(&parser.current, message);
+    error_at(parser, &parser->current, message);
 }
 
-static void advance()
+static void advance(parser_state* parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = clox_scan_token();
-        if (parser.current.type != CLOX_TOKEN_ERROR) break;
+        if (parser->next_token == parser->token_count) scan_window(parser);
+        parser->current = parser->tokens[parser->next_token++];
+        if (parser->current.type != CLOX_TOKEN_ERROR) break;
 
-        error_at_current(parser.current.start);
+        error_at_current(parser, parser->current.start);
     }
 }
 
-static void error(const char *message)
+static void error(parser_state* parser, const char *message)
 {
-    error_at(&parser.current, message);
+    error_at(parser, &parser->current, message);
 }
 
-static void consume(clox_token_type type, const char *message) 
+static void consume(parser_state* parser, clox_token_type type, const char *message) 
 {
-    if (parser.current.type == type) {
-        advance();
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    error_at_current(message);
+    error_at_current(parser, message);
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_byte(parser_state* parser, uint8_t byte)
 {
-    clox_write_chunk(current_chunk(), byte, parser.current.line);
+    clox_write_chunk(parser->vm, current_chunk(parser), byte, parser->current.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+static void emit_bytes(parser_state* parser, uint8_t byte1, uint8_t byte2)
 {
-    emit_byte(byte1);
-    emit_byte(byte2);
+    emit_byte(parser, byte1);
+    emit_byte(parser, byte2);
 }
 
-static void emit_return()
+static void emit_short(parser_state* parser, uint16_t value)
 {
-    emit_byte(CLOX_OP_NIL);
-    emit_byte(CLOX_OP_RETURN);
+    emit_byte(parser, (value >> 8) & 0xff);
+    emit_byte(parser, value & 0xff);
 }
 
-static clox_obj_function* end_compiler()
+static void emit_return(parser_state* parser)
 {
-    emit_return();
-    clox_obj_function* function = current->function;
+    emit_byte(parser, CLOX_OP_NIL);
+    emit_byte(parser, CLOX_OP_RETURN);
+}
+
+static int match_sequence(clox_chunk* chunk, int offset, const superinstruction* candidate)
+{
+    int start = offset;
+    for (int i = 0; i < candidate->length; i++) {
+        if (offset >= chunk->count || chunk->code[offset] != candidate->sequence[i]) return 0;
+        offset += clox_instruction_length(candidate->sequence[i]);
+    }
+
+    return offset - start;
+}
+
+// Overwrites the first opcode of every matching sequence. Operands and the
+// trailing opcodes keep their offsets, so jumps into the middle of a fused
+// sequence still land on valid instructions and nothing needs relocating.
+void clox_fuse_superinstructions(clox_chunk* chunk)
+{
+    int count = (int)(sizeof(superinstructions) / sizeof(superinstructions[0]));
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = 0;
+        for (int i = 0; i < count && length == 0; i++) {
+            length = match_sequence(chunk, offset, &superinstructions[i]);
+            if (length > 0) chunk->code[offset] = superinstructions[i].fused;
+        }
+
+        offset += length > 0 ? length : clox_instruction_length(chunk->code[offset]);
+    }
+}
+
+static clox_obj_function* end_compiler(parser_state* parser)
+{
+    emit_return(parser);
+    clox_obj_function* function = parser->compiler->function;
+    clox_fuse_superinstructions(current_chunk(parser));
+    if (!parser->had_error) function->max_slots = clox_max_stack_depth(parser->vm, current_chunk(parser), function->arity);
 
 #ifdef CLOX_DEBUG_PRINT_CODE
-    if (!parser.had_error) {
+    if (!parser->had_error) {
         clox_disassemble_chunk(
-            current_chunk(), 
+            parser->vm,
+            current_chunk(parser),
             function->name != NULL ? function->name->chars : "<script>"
         );
     }
 #endif
 
-    current = current->enclosing;
+#ifdef CLOX_DEBUG_CHUNK_MEMORY
+    if (!parser->had_error) {
+        clox_print_chunk_memory(
+            parser->vm->err,
+            current_chunk(parser),
+            function->name != NULL ? function->name->chars : "<script>"
+        );
+    }
+#endif
+
+    parser->compiler = parser->compiler->enclosing;
+    parser->vm->compiler = parser->compiler;
     return function;
 }
 
-static void parse_precedence(precedence_type precedence)
+static void parse_precedence(parser_state* parser, precedence_type precedence)
 {
-    advance();
+    advance(parser);
 
-    parse_fn prefix_rule = get_rule(parser.previous.type)->prefix;
+    parse_fn prefix_rule = get_rule(parser->previous.type)->prefix;
 
     if (prefix_rule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGMENT;
-    prefix_rule(can_assign);
+    prefix_rule(parser, can_assign);
 
-    while (precedence <= get_rule(parser.current.type)->precedence) {
-        advance();
-        parse_fn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+    while (precedence <= get_rule(parser->current.type)->precedence) {
+        advance(parser);
+        parse_fn infix_rule = get_rule(parser->previous.type)->infix;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && match(CLOX_TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (can_assign && match(parser, CLOX_TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-static void expression()
+static void expression(parser_state* parser)
 {
-    parse_precedence(PREC_ASSIGMENT);
+    parse_precedence(parser, PREC_ASSIGMENT);
 }
 
-static uint8_t make_constant(clox_value value)
+static uint8_t make_constant(parser_state* parser, clox_value value)
 {
-    int constant = clox_chunk_add_constant(current_chunk(), value);
+    int constant = clox_chunk_add_constant(parser->vm, current_chunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-static void emit_constant(clox_value value)
+static void track_constant(parser_state* parser, int start, int constant, clox_value value)
+{
+    parser->compiler->last_constant.start = start;
+    parser->compiler->last_constant.end = current_chunk(parser)->count;
+    parser->compiler->last_constant.constant = constant;
+    parser->compiler->last_constant.value = value;
+}
+
+static bool last_constant(parser_state* parser, constant_operand* operand)
+{
+    constant_operand* last = &parser->compiler->last_constant;
+    if (last->end != current_chunk(parser)->count) return false;
+    if (last->start < parser->compiler->jump_target) return false;
+
+    *operand = *last;
+    return true;
+}
+
+// Rewinds the chunk to the start of a folded operand and gives back the
+// constant pool entries it used, as long as nothing was added after them.
+static void discard_constants(parser_state* parser, constant_operand* first, constant_operand* last)
+{
+    clox_chunk* chunk = current_chunk(parser);
+    chunk->count = first->start;
+
+    if (last->constant != -1 && last->constant == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    if (first != last && first->constant != -1 && first->constant == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+
+    parser->compiler->last_constant.end = -1;
+}
+
+static void emit_constant(parser_state* parser, clox_value value)
+{
+    int start = current_chunk(parser)->count;
+    uint8_t constant = make_constant(parser, value);
+    emit_bytes(parser, CLOX_OP_CONSTANT, constant);
+    track_constant(parser, start, constant, value);
+}
+
+static void emit_literal(parser_state* parser, clox_value value)
+{
+    int start = current_chunk(parser)->count;
+
+    if (CLOX_IS_NIL(value)) {
+        emit_byte(parser, CLOX_OP_NIL);
+    } else if (CLOX_IS_BOOL(value)) {
+        emit_byte(parser, CLOX_AS_BOOL(value) ? CLOX_OP_TRUE : CLOX_OP_FALSE);
+    } else {
+        emit_constant(parser, value);
+        return;
+    }
+
+    track_constant(parser, start, -1, value);
+}
+
+static bool is_falsey(clox_value value)
+{
+    return CLOX_IS_NIL(value) || (CLOX_IS_BOOL(value) && !CLOX_AS_BOOL(value));
+}
+
+static bool fold_unary(clox_token_type operator_type, clox_value operand, clox_value* result)
+{
+    switch (operator_type) {
+        case CLOX_TOKEN_BANG:
+            *result = CLOX_BOOL_VAL(is_falsey(operand));
+            return true;
+        case CLOX_TOKEN_MINUS:
+            if (!CLOX_IS_NUMBER(operand)) return false;
+            *result = CLOX_NUMBER_VAL(-CLOX_AS_NUMBER(operand));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Operands whose types would make the operator fail at runtime are left
+// alone so the error is still reported when the code runs.
+static bool fold_binary(parser_state* parser, clox_token_type operator_type, clox_value a, clox_value b, clox_value* result)
 {
-    emit_bytes(CLOX_OP_CONSTANT, make_constant(value));
+    switch (operator_type) {
+        case CLOX_TOKEN_EQUAL_EQUAL:
+            *result = CLOX_BOOL_VAL(clox_value_equal(a, b));
+            return true;
+        case CLOX_TOKEN_BANG_EQUAL:
+            *result = CLOX_BOOL_VAL(!clox_value_equal(a, b));
+            return true;
+        default:
+            break;
+    }
+
+    if (operator_type == CLOX_TOKEN_PLUS && CLOX_IS_STRING(a) && CLOX_IS_STRING(b)) {
+        clox_obj_string* left = CLOX_AS_STRING(a);
+        clox_obj_string* right = CLOX_AS_STRING(b);
+
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(parser->vm, char, length + 1, CLOX_ALLOC_STRING_CHARS);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+
+        *result = CLOX_OBJ_VAL(clox_take_string(parser->vm, chars, length));
+        return true;
+    }
+
+    if (!CLOX_IS_NUMBER(a) || !CLOX_IS_NUMBER(b)) return false;
+
+    double x = CLOX_AS_NUMBER(a);
+    double y = CLOX_AS_NUMBER(b);
+
+    switch (operator_type) {
+        case CLOX_TOKEN_PLUS: *result = CLOX_NUMBER_VAL(x + y); return true;
+        case CLOX_TOKEN_MINUS: *result = CLOX_NUMBER_VAL(x - y); return true;
+        case CLOX_TOKEN_STAR: *result = CLOX_NUMBER_VAL(x * y); return true;
+        case CLOX_TOKEN_SLASH: *result = CLOX_NUMBER_VAL(x / y); return true;
+        case CLOX_TOKEN_GREATER: *result = CLOX_BOOL_VAL(x > y); return true;
+        case CLOX_TOKEN_GREATER_EQUAL: *result = CLOX_BOOL_VAL(!(x < y)); return true;
+        case CLOX_TOKEN_LESS: *result = CLOX_BOOL_VAL(x < y); return true;
+        case CLOX_TOKEN_LESS_EQUAL: *result = CLOX_BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
 }
 
-static void number(bool can_assign)
+static void number(parser_state* parser, bool can_assign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(CLOX_NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emit_constant(parser, CLOX_NUMBER_VAL(value));
 }
 
-static void grouping(bool can_assign) 
+static void grouping(parser_state* parser, bool can_assign) 
 {
-    expression();
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void unary(bool can_assign)
+static void unary(parser_state* parser, bool can_assign)
 {
-    clox_token_type operator_type = parser.previous.type;
+    clox_token_type operator_type = parser->previous.type;
 
-    parse_precedence(PREC_UNARY);
+    parse_precedence(parser, PREC_UNARY);
+
+    constant_operand operand = { .end = -1, .constant = -1 };
+    clox_value result;
+    if (last_constant(parser, &operand) && fold_unary(operator_type, operand.value, &result)) {
+        discard_constants(parser, &operand, &operand);
+        emit_literal(parser, result);
+        return;
+    }
 
     switch (operator_type) {
-    case CLOX_TOKEN_BANG: emit_byte(CLOX_OP_NOT); break;
-    case CLOX_TOKEN_MINUS: emit_byte(CLOX_OP_NEGATE); break;
+    case CLOX_TOKEN_BANG: emit_byte(parser, CLOX_OP_NOT); break;
+    case CLOX_TOKEN_MINUS: emit_byte(parser, CLOX_OP_NEGATE); break;
     default: return;
     }
 }
 
-static void binary(bool can_assign)
+static void binary(parser_state* parser, bool can_assign)
 {
-    clox_token_type operator_type = parser.previous.type;
+    clox_token_type operator_type = parser->previous.type;
     parse_rule *rule = get_rule(operator_type);
 
-    parse_precedence((precedence_type)(rule->precedence + 1));
+    constant_operand left = { .end = -1, .constant = -1 };
+    bool is_left_constant = last_constant(parser, &left);
+
+    parse_precedence(parser, (precedence_type)(rule->precedence + 1));
+
+    constant_operand right = { .end = -1, .constant = -1 };
+    if (
+        is_left_constant
+        && left.start >= parser->compiler->jump_target
+        && last_constant(parser, &right)
+        && right.start == left.end
+    ) {
+        // Folding happens while both operands are still in the constant
+        // pool, so a concatenated string cannot collect them.
+        clox_value result;
+        if (fold_binary(parser, operator_type, left.value, right.value, &result)) {
+            discard_constants(parser, &left, &right);
+            emit_literal(parser, result);
+            return;
+        }
+    }
 
     switch (operator_type) {
-        case CLOX_TOKEN_BANG_EQUAL: emit_bytes(CLOX_OP_EQUAL, CLOX_OP_NOT); break;
-        case CLOX_TOKEN_EQUAL_EQUAL: emit_byte(CLOX_OP_EQUAL); break;
-        case CLOX_TOKEN_GREATER: emit_byte(CLOX_OP_GREATER); break;
-        case CLOX_TOKEN_GREATER_EQUAL: emit_bytes(CLOX_OP_LESS, CLOX_OP_NOT); break;
-        case CLOX_TOKEN_LESS: emit_byte(CLOX_OP_LESS); break;
-        case CLOX_TOKEN_LESS_EQUAL: emit_bytes(CLOX_OP_GREATER, CLOX_OP_NOT); break;
-        case CLOX_TOKEN_PLUS: emit_byte(CLOX_OP_ADD); break;
-        case CLOX_TOKEN_MINUS: emit_byte(CLOX_OP_SUBTRACT); break;
-        case CLOX_TOKEN_STAR: emit_byte(CLOX_OP_MULTIPLY); break;
-        case CLOX_TOKEN_SLASH: emit_byte(CLOX_OP_DEVIDE); break;
+        case CLOX_TOKEN_BANG_EQUAL: emit_bytes(parser, CLOX_OP_EQUAL, CLOX_OP_NOT); break;
+        case CLOX_TOKEN_EQUAL_EQUAL: emit_byte(parser, CLOX_OP_EQUAL); break;
+        case CLOX_TOKEN_GREATER: emit_byte(parser, CLOX_OP_GREATER); break;
+        case CLOX_TOKEN_GREATER_EQUAL: emit_bytes(parser, CLOX_OP_LESS, CLOX_OP_NOT); break;
+        case CLOX_TOKEN_LESS: emit_byte(parser, CLOX_OP_LESS); break;
+        case CLOX_TOKEN_LESS_EQUAL: emit_bytes(parser, CLOX_OP_GREATER, CLOX_OP_NOT); break;
+        case CLOX_TOKEN_PLUS: emit_byte(parser, CLOX_OP_ADD); break;
+        case CLOX_TOKEN_MINUS: emit_byte(parser, CLOX_OP_SUBTRACT); break;
+        case CLOX_TOKEN_STAR: emit_byte(parser, CLOX_OP_MULTIPLY); break;
+        case CLOX_TOKEN_SLASH: emit_byte(parser, CLOX_OP_DEVIDE); break;
         default: return;
     }
 }
 
-static void literal(bool can_assign)
+static void literal(parser_state* parser, bool can_assign)
 {
-    switch (parser.previous.type) {
-        case CLOX_TOKEN_FALSE: emit_byte(CLOX_OP_FALSE); break;
-        case CLOX_TOKEN_NIL: emit_byte(CLOX_OP_NIL); break;
-        case CLOX_TOKEN_TRUE: emit_byte(CLOX_OP_TRUE); break;
+    switch (parser->previous.type) {
+        case CLOX_TOKEN_FALSE: emit_literal(parser, CLOX_BOOL_VAL(false)); break;
+        case CLOX_TOKEN_NIL: emit_literal(parser, CLOX_NIL_VAL); break;
+        case CLOX_TOKEN_TRUE: emit_literal(parser, CLOX_BOOL_VAL(true)); break;
         default: return;
     }
 }
 
-static void string(bool can_assign)
+static void string(parser_state* parser, bool can_assign)
 {
-    emit_constant(CLOX_OBJ_VAL(clox_copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(parser, CLOX_OBJ_VAL(intern(parser, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void print_statement()
+static void print_statement(parser_state* parser)
 {
-    expression();
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(CLOX_OP_PRINT);
+    expression(parser);
+    consume(parser, CLOX_TOKEN_SEMICOLON, "Expect ';' after value.");
+    emit_byte(parser, CLOX_OP_PRINT);
 }
 
-static void emit_loop(int loop_start)
+static void emit_loop(parser_state* parser, int loop_start)
 {
-    emit_byte(CLOX_OP_LOOP);
+    emit_byte(parser, CLOX_OP_LOOP);
 
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = current_chunk(parser)->count - loop_start + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_byte(parser, (offset >> 8) & 0xff);
+    emit_byte(parser, offset & 0xff);
 }
 
-static void begin_scope()
+static void begin_scope(parser_state* parser)
 {
-    current->scope_depth++;
+    parser->compiler->scope_depth++;
 }
 
-static void end_scope()
+static void end_scope(parser_state* parser)
 {
-    current->scope_depth--;
+    parser->compiler->scope_depth--;
 
-    while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
-        emit_byte(CLOX_OP_POP);
-        current->local_count--;
+    while (parser->compiler->local_count > 0 && parser->compiler->locals[parser->compiler->local_count - 1].depth > parser->compiler->scope_depth) {
+        emit_byte(parser, CLOX_OP_POP);
+        parser->compiler->local_count--;
     }
 }
 
-static void patch_jump(int offset)
+static void patch_jump(parser_state* parser, int offset)
 {
-    int jump = current_chunk()->count - offset - 2;
+    int jump = current_chunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too match code to jump over.");
+        error(parser, "Too match code to jump over.");
     }
 
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+    current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    current_chunk(parser)->code[offset + 1] = jump & 0xff;
+    parser->compiler->jump_target = current_chunk(parser)->count;
 }
 
-static void expression_statement()
+static void expression_statement(parser_state* parser)
 {
-    expression();
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(CLOX_OP_POP);
+    expression(parser);
+    consume(parser, CLOX_TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emit_byte(parser, CLOX_OP_POP);
 }
 
-static uint8_t identifier_constant(clox_token* name)
+static uint16_t global_slot(parser_state* parser, clox_token* name)
 {
-    return make_constant(
-        CLOX_OBJ_VAL(clox_copy_string(name->start, name->length))
-    );
+    int slot = clox_resolve_global(parser->vm, intern(parser, name->start, name->length));
+    if (slot == -1) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(parser_state* parser, uint16_t global)
 {
-    if (current->scope_depth > 0) {
-        mark_initialized();
+    if (parser->compiler->scope_depth > 0) {
+        mark_initialized(parser);
         return;
     }
 
-    emit_bytes(CLOX_OP_DEFINE_GLOBAL, global);
+    emit_byte(parser, CLOX_OP_DEFINE_GLOBAL);
+    emit_short(parser, global);
 }
 
-static void add_local(clox_token name)
+static void add_local(parser_state* parser, clox_token name)
 {
-    if (current->local_count == CLOX_UINT8_COUNT) {
-        error("Too many local variables in function.");
+    if (parser->compiler->local_count == CLOX_UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    local* local = &current->locals[current->local_count++];
+    local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
 }
@@ -460,195 +786,202 @@ static bool identifiers_equal(clox_token* a, clox_token* b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void declare_variable()
+static void declare_variable(parser_state* parser)
 {
-    if (current->scope_depth == 0) return;
+    if (parser->compiler->scope_depth == 0) return;
 
-    clox_token* name = &parser.previous;
+    clox_token* name = &parser->previous;
 
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth) {
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--) {
+        local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth) {
             break;
         }
 
         if (identifiers_equal(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    add_local(*name);
+    add_local(parser, *name);
 }
 
-static uint8_t parse_variable(const char* error_message)
+static uint16_t parse_variable(parser_state* parser, const char* error_message)
 {
-    consume(CLOX_TOKEN_IDENTIFIER, error_message);
+    consume(parser, CLOX_TOKEN_IDENTIFIER, error_message);
 
-    declare_variable();
-    if (current->scope_depth > 0) return 0;
+    declare_variable(parser);
+    if (parser->compiler->scope_depth > 0) return 0;
 
-    return identifier_constant(&parser.previous);
+    return global_slot(parser, &parser->previous);
 }
 
-static void var_declaration()
+static void var_declaration(parser_state* parser)
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    uint16_t global = parse_variable(parser, "Expect variable name.");
 
-    if (match(CLOX_TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, CLOX_TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emit_byte(CLOX_OP_NIL);
+        emit_byte(parser, CLOX_OP_NIL);
     }
 
-    consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, CLOX_TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    define_variable(global);
+    define_variable(parser, global);
 }
 
-static void for_statement()
+static void for_statement(parser_state* parser)
 {
-    begin_scope();
+    begin_scope(parser);
 
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(CLOX_TOKEN_SEMICOLON)) {
-    } else if (match(CLOX_TOKEN_VAR)) {
-        var_declaration();
+    consume(parser, CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, CLOX_TOKEN_SEMICOLON)) {
+    } else if (match(parser, CLOX_TOKEN_VAR)) {
+        var_declaration(parser);
     } else {
-        expression_statement();
+        expression_statement(parser);
     }
 
-    int loop_start = current_chunk()->count;
+    int loop_start = current_chunk(parser)->count;
     int exit_jump = -1;
-    if (!match(CLOX_TOKEN_SEMICOLON)) {
-        expression();
-        consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, CLOX_TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, CLOX_TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exit_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
-        emit_byte(CLOX_OP_POP);
+        exit_jump = emit_jump(parser, CLOX_OP_JUMP_IF_FALSE);
+        emit_byte(parser, CLOX_OP_POP);
     }
 
-    if (!match(CLOX_TOKEN_RIGHT_PAREN)) {
-        int body_jump = emit_jump(CLOX_OP_JUMP);
-        int increment_start = current_chunk()->count;
+    if (!match(parser, CLOX_TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(parser, CLOX_OP_JUMP);
+        int increment_start = current_chunk(parser)->count;
 
-        expression();
-        emit_byte(CLOX_OP_POP);
-        consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        expression(parser);
+        emit_byte(parser, CLOX_OP_POP);
+        consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emit_loop(loop_start);
+        emit_loop(parser, loop_start);
         loop_start = increment_start;
-        patch_jump(body_jump);
+        patch_jump(parser, body_jump);
     }
 
-    statement();
-    emit_loop(loop_start);
+    statement(parser);
+    emit_loop(parser, loop_start);
 
     if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(CLOX_OP_POP);
+        patch_jump(parser, exit_jump);
+        emit_byte(parser, CLOX_OP_POP);
     }
 
-    end_scope();
+    end_scope(parser);
 }
 
-static int emit_jump(uint8_t instruction)
+static int emit_jump(parser_state* parser, uint8_t instruction)
 {
-    emit_byte(instruction);
-    emit_byte(0xff);
-    emit_byte(0xff);
+    emit_byte(parser, instruction);
+    emit_byte(parser, 0xff);
+    emit_byte(parser, 0xff);
 
-    return current_chunk()->count - 2;
+    return current_chunk(parser)->count - 2;
 }
 
-static void if_statement()
+static void if_statement(parser_state* parser)
 {
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume(parser, CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
-    emit_byte(CLOX_OP_POP);
-    statement();
+    int then_jump = emit_jump(parser, CLOX_OP_JUMP_IF_FALSE);
+    emit_byte(parser, CLOX_OP_POP);
+    statement(parser);
 
-    int else_jump = emit_jump(CLOX_OP_JUMP);
+    int else_jump = emit_jump(parser, CLOX_OP_JUMP);
 
-    patch_jump(then_jump);
-    emit_byte(CLOX_OP_POP);
+    patch_jump(parser, then_jump);
+    emit_byte(parser, CLOX_OP_POP);
 
-    if (match(CLOX_TOKEN_ELSE)) statement();
+    if (match(parser, CLOX_TOKEN_ELSE)) statement(parser);
 
-    patch_jump(else_jump);
+    patch_jump(parser, else_jump);
 }
 
-static void while_statement()
+static void while_statement(parser_state* parser)
 {
-    int loop_start = current_chunk()->count;
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int loop_start = current_chunk(parser)->count;
+    consume(parser, CLOX_TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
-    emit_byte(CLOX_OP_POP);
+    int exit_jump = emit_jump(parser, CLOX_OP_JUMP_IF_FALSE);
+    emit_byte(parser, CLOX_OP_POP);
 
-    statement();
-    emit_loop(loop_start);
+    statement(parser);
+    emit_loop(parser, loop_start);
 
-    patch_jump(exit_jump);
-    emit_byte(CLOX_OP_POP);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, CLOX_OP_POP);
 }
 
-static void block()
+static void block(parser_state* parser)
 {
-    while (!check(CLOX_TOKEN_RIGHT_BRACE) && !check(CLOX_TOKEN_EOF)) {
-        declaration();
+    while (!check(parser, CLOX_TOKEN_RIGHT_BRACE) && !check(parser, CLOX_TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, CLOX_TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void return_statement()
+static void return_statement(parser_state* parser)
 {
-    if (current->function_type == FUNCTION_TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+    if (parser->compiler->function_type == FUNCTION_TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(CLOX_TOKEN_SEMICOLON)) {
-        emit_return();
+    if (match(parser, CLOX_TOKEN_SEMICOLON)) {
+        emit_return(parser);
     } else {
-        expression();
-        consume(CLOX_TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(CLOX_OP_RETURN);
-    }
-}
-
-static void statement()
-{
-    if (match(CLOX_TOKEN_PRINT)) {
-        print_statement();
-    } else if (match(CLOX_TOKEN_FOR)) {
-        for_statement();
-    } else if (match(CLOX_TOKEN_IF)) {
-        if_statement();
-    } else if (match(CLOX_TOKEN_RETURN)) {
-        return_statement();
-    } else if (match(CLOX_TOKEN_WHILE)) {
-        while_statement();
-    } else if (match(CLOX_TOKEN_LEFT_BRACE)) {
-        begin_scope();
-        block();
-        end_scope();
+        expression(parser);
+        consume(parser, CLOX_TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // A jump that lands on the RETURN skips the call, so it is safe even
+        // when the call is only one arm of an and/or.
+        clox_chunk* chunk = current_chunk(parser);
+        if (parser->compiler->last_call == chunk->count - 2) {
+            chunk->code[parser->compiler->last_call] = CLOX_OP_TAIL_CALL;
+        }
+        emit_byte(parser, CLOX_OP_RETURN);
+    }
+}
+
+static void statement(parser_state* parser)
+{
+    if (match(parser, CLOX_TOKEN_PRINT)) {
+        print_statement(parser);
+    } else if (match(parser, CLOX_TOKEN_FOR)) {
+        for_statement(parser);
+    } else if (match(parser, CLOX_TOKEN_IF)) {
+        if_statement(parser);
+    } else if (match(parser, CLOX_TOKEN_RETURN)) {
+        return_statement(parser);
+    } else if (match(parser, CLOX_TOKEN_WHILE)) {
+        while_statement(parser);
+    } else if (match(parser, CLOX_TOKEN_LEFT_BRACE)) {
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     } else {
-        expression_statement();
+        expression_statement(parser);
     }
 }
 
-static void synchronize()
+static void synchronize(parser_state* parser)
 {
-    parser.panic_mode = false;
+    parser->panic_mode = false;
 
-    while (parser.current.type != CLOX_TOKEN_EOF) {
-        if (parser.previous.type == CLOX_TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != CLOX_TOKEN_EOF) {
+        if (parser->previous.type == CLOX_TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case CLOX_TOKEN_CLASS:
             case CLOX_TOKEN_FUN:
             case CLOX_TOKEN_VAR:
@@ -662,74 +995,74 @@ static void synchronize()
                 ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void function(function_type type)
+static void function(parser_state* parser, function_type type)
 {
     compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
+    init_compiler(parser, &compiler, type);
+    begin_scope(parser);
 
-    consume(CLOX_TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    consume(parser, CLOX_TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
-    if (!check(CLOX_TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, CLOX_TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                error_at_current("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                error_at_current(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
-            define_variable(constant);
-        } while (match(CLOX_TOKEN_COMMA));
+            uint16_t parameter = parse_variable(parser, "Expect parameter name.");
+            define_variable(parser, parameter);
+        } while (match(parser, CLOX_TOKEN_COMMA));
     }
 
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(CLOX_TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, CLOX_TOKEN_LEFT_BRACE, "Expect '{' before function body.");
 
 
-    block();
+    block(parser);
 
-    clox_obj_function* function = end_compiler();
-    emit_bytes(CLOX_OP_CONSTANT, make_constant(CLOX_OBJ_VAL(function)));
+    clox_obj_function* function = end_compiler(parser);
+    emit_bytes(parser, CLOX_OP_CONSTANT, make_constant(parser, CLOX_OBJ_VAL(function)));
 }
 
-static void fun_declaration()
+static void fun_declaration(parser_state* parser)
 {
-    uint8_t global = parse_variable("Expect function name.");
-    mark_initialized();
-    function(FUNCTION_TYPE_FUNCTION);
-    define_variable(global);
+    uint16_t global = parse_variable(parser, "Expect function name.");
+    mark_initialized(parser);
+    function(parser, FUNCTION_TYPE_FUNCTION);
+    define_variable(parser, global);
 }
 
-static void declaration()
+static void declaration(parser_state* parser)
 {
-    if (match(CLOX_TOKEN_FUN)) {
-        fun_declaration();
-    } else if (match(CLOX_TOKEN_VAR)) {
-        var_declaration();
+    if (match(parser, CLOX_TOKEN_FUN)) {
+        fun_declaration(parser);
+    } else if (match(parser, CLOX_TOKEN_VAR)) {
+        var_declaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panic_mode) synchronize();
+    if (parser->panic_mode) synchronize(parser);
 }
 
-static bool match(clox_token_type type)
+static bool match(parser_state* parser, clox_token_type type)
 {
-    if (!check(type)) return false;
-    advance();
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
-static int resolve_local(compiler* compiler, clox_token* name)
+static int resolve_local(parser_state* parser, compiler* compiler, clox_token* name)
 {
     for (int i = compiler->local_count - 1; i >= 0; i--) {
         local* local = &compiler->locals[i];
         if (identifiers_equal(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -738,76 +1071,84 @@ static int resolve_local(compiler* compiler, clox_token* name)
     return -1;
 }
 
-static void named_variable(clox_token name, bool can_assign)
+static void named_variable(parser_state* parser, clox_token name, bool can_assign)
 {
     uint8_t get_op, set_op;
-    uint8_t arg = resolve_local(current, &name);
+    int arg = resolve_local(parser, parser->compiler, &name);
+    bool is_global = arg == -1;
 
-    if (arg != -1) {
+    if (!is_global) {
         get_op = CLOX_OP_GET_LOCAL;
         set_op = CLOX_OP_SET_LOCAL;
     } else {
-        arg = identifier_constant(&name);
+        arg = global_slot(parser, &name);
         get_op = CLOX_OP_GET_GLOBAL;
         set_op = CLOX_OP_SET_GLOBAL;
     }
 
-    if (can_assign && match(CLOX_TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(set_op, arg);
+    uint8_t op = get_op;
+    if (can_assign && match(parser, CLOX_TOKEN_EQUAL)) {
+        expression(parser);
+        op = set_op;
+    }
+
+    emit_byte(parser, op);
+    if (is_global) {
+        emit_short(parser, (uint16_t)arg);
     } else {
-        emit_bytes(get_op, arg);
+        emit_byte(parser, (uint8_t)arg);
     }
 }
 
-static void variable(bool can_assign)
+static void variable(parser_state* parser, bool can_assign)
 {
-    named_variable(parser.previous, can_assign);
+    named_variable(parser, parser->previous, can_assign);
 }
 
-static void and_(bool can_assign)
+static void and_(parser_state* parser, bool can_assign)
 {
-    int end_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(parser, CLOX_OP_JUMP_IF_FALSE);
 
-    emit_byte(CLOX_OP_POP);
-    parse_precedence(PREC_AND);
+    emit_byte(parser, CLOX_OP_POP);
+    parse_precedence(parser, PREC_AND);
 
-    patch_jump(end_jump);
+    patch_jump(parser, end_jump);
 }
 
-static void or_(bool can_assign)
+static void or_(parser_state* parser, bool can_assign)
 {
-    int else_jump = emit_jump(CLOX_OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(CLOX_OP_JUMP);
+    int else_jump = emit_jump(parser, CLOX_OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(parser, CLOX_OP_JUMP);
 
-    patch_jump(else_jump);
-    emit_byte(CLOX_OP_POP);
+    patch_jump(parser, else_jump);
+    emit_byte(parser, CLOX_OP_POP);
 
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, end_jump);
 }
 
-static uint8_t argument_list()
+static uint8_t argument_list(parser_state* parser)
 {
     uint8_t arg_count = 0;
-    if (!check(CLOX_TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, CLOX_TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             if (arg_count == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             arg_count++;
-        } while (match(CLOX_TOKEN_COMMA));
+        } while (match(parser, CLOX_TOKEN_COMMA));
     }
 
-    consume(CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, CLOX_TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return arg_count;
 }
 
-static void call(bool can_assign)
+static void call(parser_state* parser, bool can_assign)
 {
-    uint8_t arg_count = argument_list();
-    emit_bytes(CLOX_OP_CALL, arg_count);
+    uint8_t arg_count = argument_list(parser);
+    parser->compiler->last_call = current_chunk(parser)->count;
+    emit_bytes(parser, CLOX_OP_CALL, arg_count);
 }
 
 
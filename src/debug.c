@@ -3,115 +3,228 @@
 
 #include "clox/debug.h"
 #include "clox/value.h"
+#include "clox/vm.h"
 
-static int simple_instruction(const char* name, int offset);
-static int constant_instruction(const char* name, clox_chunk* chunk, int offset);
-static int byte_instruction(const char* name, clox_chunk* chunk, int offset);
-static int jump_instruction(const char* name, int sign, clox_chunk* chunk, int offset);
+static const char* opcode_names[CLOX_OP_COUNT] = {
+    [CLOX_OP_RETURN] = "opReturn",
+    [CLOX_OP_CONSTANT] = "opConstant",
+    [CLOX_OP_ADD] = "opAdd",
+    [CLOX_OP_SUBTRACT] = "opSubtract",
+    [CLOX_OP_MULTIPLY] = "opMultiply",
+    [CLOX_OP_DEVIDE] = "opDevide",
+    [CLOX_OP_NEGATE] = "opNegate",
+    [CLOX_OP_NIL] = "opNil",
+    [CLOX_OP_TRUE] = "opTrue",
+    [CLOX_OP_FALSE] = "opFalse",
+    [CLOX_OP_NOT] = "opNot",
+    [CLOX_OP_EQUAL] = "opEqual",
+    [CLOX_OP_GREATER] = "opGreater",
+    [CLOX_OP_LESS] = "opLess",
+    [CLOX_OP_PRINT] = "opPrint",
+    [CLOX_OP_POP] = "opPop",
+    [CLOX_OP_DEFINE_GLOBAL] = "opDefineGlobal",
+    [CLOX_OP_GET_GLOBAL] = "opGetGlobal",
+    [CLOX_OP_SET_GLOBAL] = "opSetGlobal",
+    [CLOX_OP_GET_LOCAL] = "opGetLocal",
+    [CLOX_OP_SET_LOCAL] = "opSetLocal",
+    [CLOX_OP_JUMP_IF_FALSE] = "opJumpIfFalse",
+    [CLOX_OP_JUMP] = "opJump",
+    [CLOX_OP_LOOP] = "opLoop",
+    [CLOX_OP_CALL] = "opCall",
+    [CLOX_OP_TAIL_CALL] = "opTailCall",
+    [CLOX_OP_ADD_LOCALS] = "opAddLocals",
+    [CLOX_OP_ADD_LOCAL_CONSTANT] = "opAddLocalConstant",
+    [CLOX_OP_SUBTRACT_LOCAL_CONSTANT] = "opSubtractLocalConstant",
+    [CLOX_OP_LESS_LOCAL_CONSTANT_JUMP] = "opLessLocalConstantJump",
+    [CLOX_OP_SET_LOCAL_POP] = "opSetLocalPop",
+    [CLOX_OP_POP_LOOP] = "opPopLoop",
+    [CLOX_OP_ADD_NUM] = "opAddNum",
+    [CLOX_OP_SUBTRACT_NUM] = "opSubtractNum",
+    [CLOX_OP_MULTIPLY_NUM] = "opMultiplyNum",
+    [CLOX_OP_DEVIDE_NUM] = "opDevideNum",
+    [CLOX_OP_GREATER_NUM] = "opGreaterNum",
+    [CLOX_OP_LESS_NUM] = "opLessNum"
+};
 
-void clox_disassemble_chunk(clox_chunk *chunk, const char *name)
+static int simple_instruction(FILE* out, const char* name, int offset);
+static int constant_instruction(FILE* out, const char* name, clox_chunk* chunk, int offset);
+static int byte_instruction(FILE* out, const char* name, clox_chunk* chunk, int offset);
+static int jump_instruction(FILE* out, const char* name, int sign, clox_chunk* chunk, int offset);
+static int global_instruction(FILE* out, clox_vm* vm, const char* name, clox_chunk* chunk, int offset);
+static int local_constant_instruction(FILE* out, const char* name, clox_chunk* chunk, int offset);
+
+const char* clox_opcode_name(uint8_t instruction)
 {
-    printf("== %s ==\n", name);
+    if (instruction >= CLOX_OP_COUNT || opcode_names[instruction] == NULL) return "opUnknown";
+    return opcode_names[instruction];
+}
+
+void clox_disassemble_chunk(clox_vm* vm, clox_chunk *chunk, const char *name)
+{
+    FILE* out = vm->out;
+    fprintf(out, "== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = clox_disassemble_instruction(chunk, offset);
+        offset = clox_disassemble_instruction(vm, chunk, offset);
     }
 }
 
-int clox_disassemble_instruction(clox_chunk *chunk, int offset)
+void clox_print_chunk_memory(FILE *out, clox_chunk *chunk, const char *name)
 {
-    printf("%04d ", offset);
+    size_t code = (size_t)chunk->capacity * sizeof(uint8_t);
+    size_t constants = (size_t)chunk->constants.capacity * sizeof(clox_value);
+    size_t lines = (size_t)chunk->line_capacity * sizeof(clox_line_run);
+    size_t unencoded = (size_t)chunk->capacity * sizeof(int);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
-        printf("   | ");
+    fprintf(out, "== %s memory ==\n", name);
+    fprintf(out, "code       %8zu bytes (%d used)\n", code, chunk->count);
+    fprintf(out, "constants  %8zu bytes (%d used)\n", constants, chunk->constants.count);
+    fprintf(out, "lines      %8zu bytes (%d runs, %zu bytes as int per byte)\n",
+            lines, chunk->line_count, unencoded);
+}
+
+int clox_disassemble_instruction(clox_vm* vm, clox_chunk *chunk, int offset)
+{
+    FILE* out = vm->out;
+    fprintf(out, "%04d ", offset);
+
+    int line = clox_chunk_get_line(chunk, offset);
+    if (offset > 0 && line == clox_chunk_get_line(chunk, offset - 1)) {
+        fprintf(out, "   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        fprintf(out, "%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char* name = clox_opcode_name(instruction);
     switch (instruction) {
     case CLOX_OP_RETURN:
-        return simple_instruction("opReturn", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_CONSTANT:
-        return constant_instruction("opConstant", chunk, offset);
+        return constant_instruction(out, name, chunk, offset);
     case CLOX_OP_ADD:
-        return simple_instruction("opAdd", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_SUBTRACT:
-        return simple_instruction("opSubtract", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_MULTIPLY:
-        return simple_instruction("opMultiply", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_DEVIDE:
-        return simple_instruction("opDevide", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_NEGATE:
-        return simple_instruction("opNegate", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_NIL:
-        return simple_instruction("opNil", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_TRUE:
-        return simple_instruction("opTrue", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_FALSE:
-        return simple_instruction("opFalse", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_NOT:
-        return simple_instruction("opNot", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_EQUAL:
-        return simple_instruction("opEqual", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_GREATER:
-        return simple_instruction("opGreater", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_LESS:
-        return simple_instruction("opLess", offset);
+        return simple_instruction(out, name, offset);
+    case CLOX_OP_ADD_NUM:
+    case CLOX_OP_SUBTRACT_NUM:
+    case CLOX_OP_MULTIPLY_NUM:
+    case CLOX_OP_DEVIDE_NUM:
+    case CLOX_OP_GREATER_NUM:
+    case CLOX_OP_LESS_NUM:
+        return simple_instruction(out, name, offset);
     case CLOX_OP_PRINT:
-        return simple_instruction("opPrint", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_POP:
-        return simple_instruction("opPop", offset);
+        return simple_instruction(out, name, offset);
     case CLOX_OP_DEFINE_GLOBAL:
-        return constant_instruction("opDefineGlobal", chunk, offset);
+        return global_instruction(out, vm, name, chunk, offset);
     case CLOX_OP_GET_GLOBAL:
-        return constant_instruction("opGetGlobal", chunk, offset);
+        return global_instruction(out, vm, name, chunk, offset);
     case CLOX_OP_SET_GLOBAL:
-        return constant_instruction("opSetGlobal", chunk, offset);
+        return global_instruction(out, vm, name, chunk, offset);
     case CLOX_OP_GET_LOCAL:
-        return byte_instruction("opGetLocal", chunk, offset);
+        return byte_instruction(out, name, chunk, offset);
     case CLOX_OP_SET_LOCAL:
-        return byte_instruction("opSetLocal", chunk, offset);
+        return byte_instruction(out, name, chunk, offset);
     case CLOX_OP_JUMP_IF_FALSE:
-        return jump_instruction("opJumpIfFalse", 1, chunk, offset);
+        return jump_instruction(out, name, 1, chunk, offset);
     case CLOX_OP_JUMP:
-        return jump_instruction("opJump", 1, chunk, offset);
+        return jump_instruction(out, name, 1, chunk, offset);
     case CLOX_OP_LOOP:
-        return jump_instruction("opLoop", -1, chunk, offset);
+        return jump_instruction(out, name, -1, chunk, offset);
     case CLOX_OP_CALL:
-        return byte_instruction("opCall", chunk, offset);
+    case CLOX_OP_TAIL_CALL:
+        return byte_instruction(out, name, chunk, offset);
+    case CLOX_OP_ADD_LOCALS:
+        fprintf(out, "%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 3]);
+        return offset + 5;
+    case CLOX_OP_ADD_LOCAL_CONSTANT:
+    case CLOX_OP_SUBTRACT_LOCAL_CONSTANT:
+        return local_constant_instruction(out, name, chunk, offset);
+    case CLOX_OP_LESS_LOCAL_CONSTANT_JUMP: {
+        uint16_t jump = (uint16_t)((chunk->code[offset + 6] << 8) | chunk->code[offset + 7]);
+        fprintf(out, "%-16s %4d '", name, chunk->code[offset + 1]);
+        clox_print_value(out, chunk->constants.values[chunk->code[offset + 3]]);
+        fprintf(out, "' -> %d\n", offset + 8 + jump);
+        return offset + 9;
+    }
+    case CLOX_OP_SET_LOCAL_POP:
+        return byte_instruction(out, name, chunk, offset) + 1;
+    case CLOX_OP_POP_LOOP:
+        return jump_instruction(out, name, -1, chunk, offset + 1);
     default:
-        printf("Unknown opcode %d\n", instruction);
+        fprintf(out, "Unknown opcode %d\n", instruction);
         return offset + 1;
     }
 }
 
-static int simple_instruction(const char *name, int offset)
+static int simple_instruction(FILE* out, const char *name, int offset)
 {
-    printf("%s\n", name);
+    fprintf(out, "%s\n", name);
     return offset + 1;
 }
 
-static int constant_instruction(const char *name, clox_chunk *chunk, int offset)
+static int constant_instruction(FILE* out, const char *name, clox_chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %04d '", name, constant);
-    clox_print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s %04d '", name, constant);
+    clox_print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
     return offset + 2;
 }
 
-static int byte_instruction(const char* name, clox_chunk* chunk, int offset)
+static int byte_instruction(FILE* out, const char* name, clox_chunk* chunk, int offset)
 {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    fprintf(out, "%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
-static int jump_instruction(const char* name, int sign, clox_chunk* chunk, int offset)
+static int jump_instruction(FILE* out, const char* name, int sign, clox_chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    fprintf(out, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
+
+static int global_instruction(FILE* out, clox_vm* vm, const char* name, clox_chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    fprintf(out, "%-16s %4d '", name, slot);
+    clox_print_value(out, vm->global_names.values[slot]);
+    fprintf(out, "'\n");
+    return offset + 3;
+}
+
+static int local_constant_instruction(FILE* out, const char* name, clox_chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    fprintf(out, "%-16s %4d '", name, slot);
+    clox_print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
+    return offset + 5;
+}
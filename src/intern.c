@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "clox/intern.h"
+#include "clox/object.h"
+
+#define MIN_CAPACITY 16
+#define MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+// Old slots copied per add or lookup while an incremental set resizes. A
+// resize leaves room for at least old capacity / 2 more strings, and copying
+// everything takes old capacity / MIGRATE_SLOTS of them.
+#define MIGRATE_SLOTS 8
+
+static clox_obj_string* find(clox_intern_slot* slots, int capacity, const char* chars, int length, uint32_t hash);
+static void insert(clox_intern_slot* slots, int capacity, clox_intern_slot* slot);
+static void remove_slot(clox_intern_set* set, int index);
+static void resize(clox_vm* vm, clox_intern_set* set, int capacity);
+static void migrate(clox_intern_set* set, int slots);
+static void finish_migration(clox_vm* vm, clox_intern_set* set);
+static void set_batch_arrays(clox_intern_batch* batch, void* block, int capacity);
+static size_t batch_size(int capacity);
+
+void clox_init_intern_set(clox_intern_set* set)
+{
+    set->count = 0;
+    set->capacity = 0;
+    set->slots = NULL;
+    set->old_count = 0;
+    set->old_capacity = 0;
+    set->migrated = 0;
+    set->old_slots = NULL;
+    set->incremental = true;
+}
+
+void clox_free_intern_set(clox_vm* vm, clox_intern_set* set)
+{
+    bool incremental = set->incremental;
+    FREE_ARRAY(vm, clox_intern_slot, set->old_slots, set->old_capacity, CLOX_ALLOC_INTERN);
+    FREE_ARRAY(vm, clox_intern_slot, set->slots, set->capacity, CLOX_ALLOC_INTERN);
+    clox_init_intern_set(set);
+    set->incremental = incremental;
+}
+
+clox_obj_string* clox_intern_set_find(clox_intern_set* set, const char* chars, int length, uint32_t hash)
+{
+    if (set->count == 0) return NULL;
+    if (set->old_count > 0) migrate(set, MIGRATE_SLOTS);
+
+    clox_obj_string* string = find(set->slots, set->capacity, chars, length, hash);
+    if (string == NULL && set->old_count > 0) {
+        string = find(set->old_slots, set->old_capacity, chars, length, hash);
+    }
+
+    return string;
+}
+
+void clox_intern_set_add(clox_vm* vm, clox_intern_set* set, clox_obj_string* string)
+{
+    if (set->old_capacity > 0) {
+        migrate(set, MIGRATE_SLOTS);
+        if (set->old_count == 0) finish_migration(vm, set);
+    }
+
+    if (set->count + 1 > MAX_LOAD(set->capacity)) {
+        finish_migration(vm, set);
+        resize(vm, set, set->capacity == 0 ? MIN_CAPACITY : set->capacity * 2);
+        if (!set->incremental) finish_migration(vm, set);
+    }
+
+    clox_intern_slot slot = { string->hash, string->length, string };
+    insert(set->slots, set->capacity, &slot);
+    set->count++;
+}
+
+void clox_intern_set_prefetch(clox_intern_set* set, uint32_t hash)
+{
+#ifdef __GNUC__
+    if (set->capacity > 0) __builtin_prefetch(&set->slots[hash & (set->capacity - 1)]);
+#else
+    (void)set;
+    (void)hash;
+#endif
+}
+
+// Copies whatever is left first, so removing only has to deal with the new
+// slots. A string moved back into the hole at i is looked at again.
+void clox_intern_set_remove_white(clox_vm* vm, clox_intern_set* set)
+{
+    finish_migration(vm, set);
+
+    for (int i = 0; i < set->capacity;) {
+        clox_obj_string* string = set->slots[i].string;
+        if (string != NULL && !string->obj.is_marked) {
+            remove_slot(set, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void clox_init_intern_batch(clox_intern_batch* batch)
+{
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->interned = 0;
+    batch->chars = NULL;
+    batch->lengths = NULL;
+    batch->hashes = NULL;
+    batch->strings = NULL;
+}
+
+void clox_free_intern_batch(clox_vm* vm, clox_intern_batch* batch)
+{
+    if (batch->capacity > 0) {
+        FREE_ARRAY(vm, uint8_t, batch->chars, batch_size(batch->capacity), CLOX_ALLOC_INTERN);
+    }
+    clox_init_intern_batch(batch);
+}
+
+// Only grows before anything was interned, so a collection during the
+// allocation has no strings to mark.
+void clox_intern_batch_push(clox_vm* vm, clox_intern_batch* batch, const char* chars, int length)
+{
+    if (batch->count == batch->capacity) {
+        int capacity = GROW_CAPACITY(batch->capacity);
+        clox_intern_batch grown;
+        set_batch_arrays(&grown, ALLOCATE(vm, uint8_t, batch_size(capacity), CLOX_ALLOC_INTERN), capacity);
+        if (batch->count > 0) {
+            memcpy(grown.chars, batch->chars, sizeof(const char*) * batch->count);
+            memcpy(grown.lengths, batch->lengths, sizeof(int) * batch->count);
+        }
+        int count = batch->count;
+        clox_free_intern_batch(vm, batch);
+        set_batch_arrays(batch, grown.chars, capacity);
+        batch->count = count;
+    }
+
+    batch->chars[batch->count] = chars;
+    batch->lengths[batch->count] = length;
+    batch->count++;
+}
+
+void clox_intern_batch_clear(clox_intern_batch* batch)
+{
+    batch->count = 0;
+    batch->interned = 0;
+}
+
+static clox_obj_string* find(clox_intern_slot* slots, int capacity, const char* chars, int length, uint32_t hash)
+{
+    if (capacity == 0) return NULL;
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        clox_intern_slot* slot = &slots[index];
+        if (slot->string == NULL) return NULL;
+        if (
+            slot->hash == hash
+            && slot->length == length
+            && memcmp(slot->string->chars, chars, length) == 0
+        ) {
+            return slot->string;
+        }
+    }
+}
+
+static void insert(clox_intern_slot* slots, int capacity, clox_intern_slot* slot)
+{
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = slot->hash & mask;
+    while (slots[index].string != NULL) index = (index + 1) & mask;
+
+    slots[index] = *slot;
+}
+
+// Backward-shift deletion: every later string of the run whose home slot is
+// not between the hole and itself moves into the hole.
+static void remove_slot(clox_intern_set* set, int index)
+{
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    uint32_t hole = (uint32_t)index;
+
+    for (uint32_t next = (hole + 1) & mask; set->slots[next].string != NULL; next = (next + 1) & mask) {
+        uint32_t home = set->slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            set->slots[hole] = set->slots[next];
+            hole = next;
+        }
+    }
+
+    set->slots[hole].string = NULL;
+    set->count--;
+}
+
+// Turns the current slots into the old ones behind a cleared array. The
+// set is only touched once ALLOCATE returns: a collection it starts sweeps
+// the set with clox_intern_set_remove_white(), which has to find the slots
+// it already had.
+static void resize(clox_vm* vm, clox_intern_set* set, int capacity)
+{
+    clox_intern_slot* slots = ALLOCATE(vm, clox_intern_slot, capacity, CLOX_ALLOC_INTERN);
+    for (int i = 0; i < capacity; i++) {
+        slots[i].string = NULL;
+    }
+
+    set->old_count = set->count;
+    set->old_capacity = set->capacity;
+    set->migrated = 0;
+    set->old_slots = set->slots;
+
+    set->capacity = capacity;
+    set->slots = slots;
+}
+
+// Copies the strings of the next old slots. Their old slots are left as
+// they are, since there are no tombstones to write, and old_count alone
+// tells lookups whether the old slots still need searching.
+static void migrate(clox_intern_set* set, int slots)
+{
+    int end = set->migrated + slots;
+    if (end > set->old_capacity) end = set->old_capacity;
+
+    for (int i = set->migrated; i < end && set->old_count > 0; i++) {
+        if (set->old_slots[i].string == NULL) continue;
+
+        insert(set->slots, set->capacity, &set->old_slots[i]);
+        set->old_count--;
+    }
+    set->migrated = end;
+}
+
+// Copies whatever is left and frees the old slots. clox_intern_set_find()
+// only copies, so the old slots it empties are freed by the next add or
+// sweep.
+static void finish_migration(clox_vm* vm, clox_intern_set* set)
+{
+    if (set->old_capacity == 0) return;
+
+    migrate(set, set->old_capacity);
+    FREE_ARRAY(vm, clox_intern_slot, set->old_slots, set->old_capacity, CLOX_ALLOC_INTERN);
+
+    set->old_count = 0;
+    set->old_capacity = 0;
+    set->migrated = 0;
+    set->old_slots = NULL;
+}
+
+// The four arrays of a batch share one block, pointers first.
+static void set_batch_arrays(clox_intern_batch* batch, void* block, int capacity)
+{
+    batch->chars = (const char**)block;
+    batch->strings = (clox_obj_string**)(batch->chars + capacity);
+    batch->lengths = (int*)(batch->strings + capacity);
+    batch->hashes = (uint32_t*)(batch->lengths + capacity);
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->interned = 0;
+}
+
+static size_t batch_size(int capacity)
+{
+    return (sizeof(const char*) + sizeof(clox_obj_string*) + sizeof(int) + sizeof(uint32_t)) * capacity;
+}
@@ -0,0 +1,894 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox/jit.h"
+#include "clox/chunk.h"
+#include "clox/object.h"
+#include "clox/value.h"
+#include "clox/vm.h"
+
+#ifdef CLOX_HAVE_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Generated code keeps the interpreter state in callee-saved registers for
+// the whole frame:
+//
+//   rbx  clox_vm*            r12  stack top
+//   r13  frame slots         r14  clox_call_frame*
+//   r15  constant values
+//
+// Values always live in memory (the VM stack, locals and globals), so the
+// collector and the interpreter see a consistent stack at every instruction
+// boundary. Before calling into the runtime the stack top is written back
+// to the VM, and the frame's ip is set whenever the call can raise an error,
+// so stack traces report the same lines as the interpreter.
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(clox_value))
+
+#ifdef CLOX_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t)offsetof(clox_value, as.number))
+#define TYPE_OFFSET ((int32_t)offsetof(clox_value, type))
+#endif
+
+// Jump targets that are not bytecode offsets.
+#define LABEL_ERROR -1
+#define LABEL_EXIT -2
+
+typedef struct {
+    size_t at;
+    int target;
+} fixup;
+
+typedef struct {
+    uint8_t* code;
+    size_t count;
+    size_t capacity;
+    fixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    bool ok;
+} assembler;
+
+struct clox_jit_code {
+    uint8_t* memory;
+    size_t size;
+    // Native offset of every bytecode offset that starts an instruction,
+    // -1 everywhere else.
+    int32_t* entries;
+};
+
+typedef clox_interpret_result (*native_frame)(clox_vm* vm, clox_call_frame* frame, void* start);
+
+static void emit_byte(assembler* as, uint8_t byte)
+{
+    if (as->count == as->capacity) {
+        size_t capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        uint8_t* code = (uint8_t*)realloc(as->code, capacity);
+        if (code == NULL) {
+            as->ok = false;
+            as->count = 0;
+            return;
+        }
+        as->code = code;
+        as->capacity = capacity;
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit_u32(assembler* as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emit_byte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit_u64(assembler* as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emit_byte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch_u32(assembler* as, size_t at, uint32_t value)
+{
+    if (!as->ok) return;
+    for (int i = 0; i < 4; i++) as->code[at + i] = (uint8_t)(value >> (8 * i));
+}
+
+// REX prefix, left out when it would carry no bits.
+static void emit_rex(assembler* as, bool wide, int reg, int base)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+    if (rex != 0x40) emit_byte(as, rex);
+}
+
+// ModRM (and SIB) for [base + disp].
+static void emit_mem(assembler* as, int reg, int base, int32_t disp)
+{
+    uint8_t mod;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0x00;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 0x40;
+    } else {
+        mod = 0x80;
+    }
+
+    emit_byte(as, mod | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit_byte(as, 0x24);
+
+    if (mod == 0x40) {
+        emit_byte(as, (uint8_t)(int8_t)disp);
+    } else if (mod == 0x80) {
+        emit_u32(as, (uint32_t)disp);
+    }
+}
+
+static void emit_reg(assembler* as, int reg, int rm)
+{
+    emit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + disp] or op [base + disp], reg depending on the opcode.
+static void emit_op_mem(assembler* as, bool wide, uint8_t op, int reg, int base, int32_t disp)
+{
+    emit_rex(as, wide, reg, base);
+    emit_byte(as, op);
+    emit_mem(as, reg, base, disp);
+}
+
+static void emit_load(assembler* as, int reg, int base, int32_t disp)
+{
+    emit_op_mem(as, true, 0x8b, reg, base, disp);
+}
+
+static void emit_store(assembler* as, int base, int32_t disp, int reg)
+{
+    emit_op_mem(as, true, 0x89, reg, base, disp);
+}
+
+static void emit_mov(assembler* as, int dst, int src)
+{
+    emit_rex(as, true, src, dst);
+    emit_byte(as, 0x89);
+    emit_reg(as, src, dst);
+}
+
+static void emit_mov_imm64(assembler* as, int reg, uint64_t value)
+{
+    emit_rex(as, true, 0, reg);
+    emit_byte(as, 0xb8 + (reg & 7));
+    emit_u64(as, value);
+}
+
+static void emit_mov_imm32(assembler* as, int reg, uint32_t value)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0xb8 + (reg & 7));
+    emit_u32(as, value);
+}
+
+// add/sub/cmp reg, imm (extension 0, 5 and 7 of opcode 0x81).
+static void emit_alu_imm(assembler* as, int extension, int reg, int32_t value)
+{
+    emit_rex(as, true, 0, reg);
+    if (value >= -128 && value <= 127) {
+        emit_byte(as, 0x83);
+        emit_reg(as, extension, reg);
+        emit_byte(as, (uint8_t)(int8_t)value);
+    } else {
+        emit_byte(as, 0x81);
+        emit_reg(as, extension, reg);
+        emit_u32(as, (uint32_t)value);
+    }
+}
+
+static void emit_add_imm(assembler* as, int reg, int32_t value)
+{
+    emit_alu_imm(as, 0, reg, value);
+}
+
+static void emit_sub_imm(assembler* as, int reg, int32_t value)
+{
+    emit_alu_imm(as, 5, reg, value);
+}
+
+#ifdef CLOX_NAN_BOXING
+// Only NaN-boxed values fit a register, so only their templates compare
+// whole registers.
+static void emit_cmp(assembler* as, int a, int b)
+{
+    emit_rex(as, true, b, a);
+    emit_byte(as, 0x39);
+    emit_reg(as, b, a);
+}
+#endif
+
+static void emit_lea(assembler* as, int reg, int base, int32_t disp)
+{
+    emit_op_mem(as, true, 0x8d, reg, base, disp);
+}
+
+// SSE2 scalar double op: prefix 0F op xmm, [base + disp] or xmm, xmm.
+static void emit_sse_mem(assembler* as, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp)
+{
+    if (prefix != 0) emit_byte(as, prefix);
+    emit_rex(as, false, xmm, base);
+    emit_byte(as, 0x0f);
+    emit_byte(as, op);
+    emit_mem(as, xmm, base, disp);
+}
+
+static void emit_sse_reg(assembler* as, uint8_t prefix, uint8_t op, int a, int b)
+{
+    if (prefix != 0) emit_byte(as, prefix);
+    emit_byte(as, 0x0f);
+    emit_byte(as, op);
+    emit_reg(as, a, b);
+}
+
+static void emit_call(assembler* as, void* function)
+{
+    emit_mov_imm64(as, RAX, (uint64_t)(uintptr_t)function);
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xd0);
+}
+
+static void emit_push(assembler* as, int reg)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0x50 + (reg & 7));
+}
+
+static void emit_pop(assembler* as, int reg)
+{
+    emit_rex(as, false, 0, reg);
+    emit_byte(as, 0x58 + (reg & 7));
+}
+
+// Emits a rel32 jump with an empty displacement and returns where it goes.
+static size_t emit_jump(assembler* as)
+{
+    emit_byte(as, 0xe9);
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+static size_t emit_jump_if(assembler* as, int condition)
+{
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x80 | condition);
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+// Points a jump emitted inside the current template at the next byte.
+static void patch_here(assembler* as, size_t at)
+{
+    patch_u32(as, at, (uint32_t)(as->count - (at + 4)));
+}
+
+// Records a jump to a bytecode offset or one of the shared labels. They are
+// resolved once the whole chunk has been emitted.
+static void add_fixup(assembler* as, size_t at, int target)
+{
+    if (as->fixup_count == as->fixup_capacity) {
+        int capacity = as->fixup_capacity < 16 ? 16 : as->fixup_capacity * 2;
+        fixup* fixups = (fixup*)realloc(as->fixups, sizeof(fixup) * capacity);
+        if (fixups == NULL) {
+            as->ok = false;
+            return;
+        }
+        as->fixups = fixups;
+        as->fixup_capacity = capacity;
+    }
+    as->fixups[as->fixup_count++] = (fixup){ at, target };
+}
+
+static void jump_to(assembler* as, int target)
+{
+    add_fixup(as, emit_jump(as), target);
+}
+
+static void jump_to_if(assembler* as, int condition, int target)
+{
+    add_fixup(as, emit_jump_if(as, condition), target);
+}
+
+// Value templates. Both value layouts are supported: a NaN-boxed value is a
+// single quadword, the tagged union is a type word plus an 8 byte payload.
+
+static void emit_copy_value(assembler* as, int dst, int32_t dst_disp, int src, int32_t src_disp)
+{
+    emit_load(as, RDX, src, src_disp);
+    emit_store(as, dst, dst_disp, RDX);
+#ifndef CLOX_NAN_BOXING
+    // Two quadwords rather than one 16 byte move: the templates write the
+    // type and the payload separately, and a wider load right after those
+    // stores would miss store forwarding.
+    emit_load(as, RCX, src, src_disp + NUMBER_OFFSET);
+    emit_store(as, dst, dst_disp + NUMBER_OFFSET, RCX);
+#endif
+}
+
+static void emit_push_immediate(assembler* as, clox_value value)
+{
+#ifdef CLOX_NAN_BOXING
+    emit_mov_imm64(as, RAX, value);
+    emit_store(as, R12, 0, RAX);
+#else
+    // mov qword [r12 + type], type; mov qword [r12 + payload], payload
+    emit_op_mem(as, true, 0xc7, 0, R12, TYPE_OFFSET);
+    emit_u32(as, (uint32_t)value.type);
+    emit_op_mem(as, true, 0xc7, 0, R12, NUMBER_OFFSET);
+    emit_u32(as, value.type == CLOX_VAL_BOOL && value.as.boolean ? 1 : 0);
+#endif
+    emit_add_imm(as, R12, VALUE_SIZE);
+}
+
+// Returns the jump taken when the value at [base + disp] is not a number.
+static size_t emit_jump_if_not_number(assembler* as, int base, int32_t disp)
+{
+#ifdef CLOX_NAN_BOXING
+    // A number has at least one of the quiet NaN bits clear.
+    emit_load(as, RAX, base, disp);
+    emit_rex(as, true, 0, RAX);
+    emit_byte(as, 0xf7);
+    emit_reg(as, 2, RAX);
+    emit_mov_imm64(as, RCX, CLOX_QNAN);
+    emit_rex(as, true, RCX, RAX);
+    emit_byte(as, 0x85);
+    emit_reg(as, RCX, RAX);
+    return emit_jump_if(as, CC_E);
+#else
+    emit_op_mem(as, false, 0x83, 7, base, disp + TYPE_OFFSET);
+    emit_byte(as, CLOX_VAL_NUMBER);
+    return emit_jump_if(as, CC_NE);
+#endif
+}
+
+static void emit_store_number(assembler* as, int xmm, int base, int32_t disp)
+{
+#ifndef CLOX_NAN_BOXING
+    emit_op_mem(as, true, 0xc7, 0, base, disp + TYPE_OFFSET);
+    emit_u32(as, CLOX_VAL_NUMBER);
+#endif
+    emit_sse_mem(as, 0xf2, 0x11, xmm, base, disp + NUMBER_OFFSET);
+}
+
+// Stores the boolean in al.
+static void emit_store_bool(assembler* as, int base, int32_t disp)
+{
+    // movzx eax, al
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0xb6);
+    emit_reg(as, RAX, RAX);
+#ifdef CLOX_NAN_BOXING
+    emit_mov_imm64(as, RCX, CLOX_FALSE_VAL);
+    emit_rex(as, true, RCX, RAX);
+    emit_byte(as, 0x01);
+    emit_reg(as, RCX, RAX);
+    emit_store(as, base, disp, RAX);
+#else
+    emit_op_mem(as, true, 0xc7, 0, base, disp + TYPE_OFFSET);
+    emit_u32(as, CLOX_VAL_BOOL);
+    emit_store(as, base, disp + NUMBER_OFFSET, RAX);
+#endif
+}
+
+// Adds the jumps taken when the value at [base + disp] is nil or false.
+static int emit_jumps_if_falsey(assembler* as, int base, int32_t disp, size_t* jumps)
+{
+#ifdef CLOX_NAN_BOXING
+    emit_load(as, RAX, base, disp);
+    emit_mov_imm64(as, RCX, CLOX_NIL_VAL);
+    emit_cmp(as, RAX, RCX);
+    jumps[0] = emit_jump_if(as, CC_E);
+    emit_mov_imm64(as, RCX, CLOX_FALSE_VAL);
+    emit_cmp(as, RAX, RCX);
+    jumps[1] = emit_jump_if(as, CC_E);
+    return 2;
+#else
+    emit_op_mem(as, false, 0x83, 7, base, disp + TYPE_OFFSET);
+    emit_byte(as, CLOX_VAL_NIL);
+    jumps[0] = emit_jump_if(as, CC_E);
+    emit_op_mem(as, false, 0x83, 7, base, disp + TYPE_OFFSET);
+    emit_byte(as, CLOX_VAL_BOOL);
+    size_t not_bool = emit_jump_if(as, CC_NE);
+    // cmp byte [base + payload], 0
+    emit_op_mem(as, false, 0x80, 7, base, disp + NUMBER_OFFSET);
+    emit_byte(as, 0);
+    jumps[1] = emit_jump_if(as, CC_E);
+    patch_here(as, not_bool);
+    return 2;
+#endif
+}
+
+// Runtime calls.
+
+static void emit_sync_stack(assembler* as)
+{
+    emit_store(as, RBX, (int32_t)offsetof(clox_vm, stack_top), R12);
+}
+
+static void emit_reload_stack(assembler* as)
+{
+    emit_load(as, R12, RBX, (int32_t)offsetof(clox_vm, stack_top));
+}
+
+static void emit_set_ip(assembler* as, uint8_t* ip)
+{
+    emit_mov_imm64(as, RAX, (uint64_t)(uintptr_t)ip);
+    emit_store(as, R14, (int32_t)offsetof(clox_call_frame, ip), RAX);
+}
+
+static void emit_error(assembler* as, uint8_t* ip, const char* message)
+{
+    emit_set_ip(as, ip);
+    emit_mov(as, RDI, RBX);
+    emit_mov_imm64(as, RSI, (uint64_t)(uintptr_t)message);
+    emit_call(as, (void*)clox_runtime_error);
+    jump_to(as, LABEL_ERROR);
+}
+
+static void jit_print(clox_vm* vm)
+{
+    clox_print_value(vm->out, *--vm->stack_top);
+    fputc('\n', vm->out);
+}
+
+static void jit_equal(clox_value* top)
+{
+    top[-2] = CLOX_BOOL_VAL(clox_value_equal(top[-2], top[-1]));
+}
+
+// Strings that are not interned may have to be flattened or interned
+// first, which allocates.
+static void jit_equal_strings(clox_vm* vm, clox_value* top)
+{
+    if (!CLOX_IS_UNINTERNED(top[-2]) && !CLOX_IS_UNINTERNED(top[-1])) {
+        jit_equal(top);
+        return;
+    }
+    vm->stack_top = top;
+    clox_runtime_equal(vm);
+}
+
+// Opcode templates.
+
+static void emit_binary(assembler* as, uint8_t instruction, uint8_t* next)
+{
+    size_t b_not_number = emit_jump_if_not_number(as, R12, -VALUE_SIZE);
+    size_t a_not_number = emit_jump_if_not_number(as, R12, -2 * VALUE_SIZE);
+
+    emit_sse_mem(as, 0xf2, 0x10, 0, R12, -2 * VALUE_SIZE + NUMBER_OFFSET);
+    emit_sse_mem(as, 0xf2, 0x10, 1, R12, -VALUE_SIZE + NUMBER_OFFSET);
+    emit_sub_imm(as, R12, VALUE_SIZE);
+
+    switch (instruction) {
+        case CLOX_OP_ADD: emit_sse_reg(as, 0xf2, 0x58, 0, 1); break;
+        case CLOX_OP_SUBTRACT: emit_sse_reg(as, 0xf2, 0x5c, 0, 1); break;
+        case CLOX_OP_MULTIPLY: emit_sse_reg(as, 0xf2, 0x59, 0, 1); break;
+        case CLOX_OP_DEVIDE: emit_sse_reg(as, 0xf2, 0x5e, 0, 1); break;
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+            // a > b is seta after comisd a, b and a < b is b > a. Both are
+            // false for NaN, which sets every flag seta looks at.
+            if (instruction == CLOX_OP_GREATER) {
+                emit_sse_reg(as, 0x66, 0x2f, 0, 1);
+            } else {
+                emit_sse_reg(as, 0x66, 0x2f, 1, 0);
+            }
+            emit_byte(as, 0x0f);
+            emit_byte(as, 0x90 | CC_A);
+            emit_reg(as, 0, RAX);
+            emit_store_bool(as, R12, -VALUE_SIZE);
+            break;
+    }
+    if (instruction != CLOX_OP_GREATER && instruction != CLOX_OP_LESS) {
+        emit_store_number(as, 0, R12, -VALUE_SIZE);
+    }
+    size_t done = emit_jump(as);
+
+    patch_here(as, b_not_number);
+    patch_here(as, a_not_number);
+    if (instruction == CLOX_OP_ADD) {
+        emit_sync_stack(as);
+        emit_set_ip(as, next);
+        emit_mov(as, RDI, RBX);
+        emit_call(as, (void*)clox_runtime_add);
+        // test al, al
+        emit_byte(as, 0x84);
+        emit_reg(as, RAX, RAX);
+        jump_to_if(as, CC_E, LABEL_ERROR);
+        emit_reload_stack(as);
+    } else {
+        emit_error(as, next, "Operands must be numbers.");
+    }
+
+    patch_here(as, done);
+}
+
+static void emit_negate(assembler* as, uint8_t* next)
+{
+    size_t not_number = emit_jump_if_not_number(as, R12, -VALUE_SIZE);
+#ifdef CLOX_NAN_BOXING
+    emit_load(as, RAX, R12, -VALUE_SIZE);
+    // btc rax, 63
+    emit_rex(as, true, 0, RAX);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0xba);
+    emit_reg(as, 7, RAX);
+    emit_byte(as, 63);
+    emit_store(as, R12, -VALUE_SIZE, RAX);
+#else
+    // xor byte [sign byte of the double], 0x80
+    emit_op_mem(as, false, 0x80, 6, R12, -VALUE_SIZE + NUMBER_OFFSET + 7);
+    emit_byte(as, 0x80);
+#endif
+    size_t done = emit_jump(as);
+    patch_here(as, not_number);
+    emit_error(as, next, "Operand must be number.");
+    patch_here(as, done);
+}
+
+static void emit_not(assembler* as)
+{
+    size_t falsey[2];
+    int count = emit_jumps_if_falsey(as, R12, -VALUE_SIZE, falsey);
+
+    // xor eax, eax
+    emit_byte(as, 0x31);
+    emit_reg(as, RAX, RAX);
+    size_t store = emit_jump(as);
+    for (int i = 0; i < count; i++) patch_here(as, falsey[i]);
+    emit_mov_imm32(as, RAX, 1);
+    patch_here(as, store);
+    emit_store_bool(as, R12, -VALUE_SIZE);
+}
+
+static int32_t global_offset(uint16_t slot)
+{
+    return (int32_t)slot * VALUE_SIZE;
+}
+
+// Leaves the address of the global values in rax and jumps to an error
+// when the global has not been defined yet.
+static void emit_check_global(assembler* as, uint16_t slot, uint8_t* next)
+{
+    emit_load(as, RAX, RBX, (int32_t)offsetof(clox_vm, global_values.values));
+#ifdef CLOX_NAN_BOXING
+    emit_load(as, RCX, RAX, global_offset(slot));
+    emit_mov_imm64(as, RDX, CLOX_UNDEFINED_VAL);
+    emit_cmp(as, RCX, RDX);
+#else
+    emit_op_mem(as, false, 0x83, 7, RAX, global_offset(slot) + TYPE_OFFSET);
+    emit_byte(as, CLOX_VAL_UNDEFINED);
+#endif
+    size_t defined = emit_jump_if(as, CC_NE);
+    emit_set_ip(as, next);
+    emit_mov(as, RDI, RBX);
+    emit_mov_imm32(as, RSI, slot);
+    emit_call(as, (void*)clox_runtime_undefined_global);
+    jump_to(as, LABEL_ERROR);
+    patch_here(as, defined);
+}
+
+static void emit_return(assembler* as)
+{
+    // xor eax, eax: CLOX_INTERPRET_OK
+    emit_byte(as, 0x31);
+    emit_reg(as, RAX, RAX);
+    emit_sub_imm(as, R12, VALUE_SIZE);
+    // dec dword [rbx + frame_count]
+    emit_op_mem(as, false, 0xff, 1, RBX, (int32_t)offsetof(clox_vm, frame_count));
+    size_t nested = emit_jump_if(as, CC_NE);
+
+    // The script itself returned: drop the result and the script function.
+    emit_store(as, RBX, (int32_t)offsetof(clox_vm, stack_top), R13);
+    jump_to(as, LABEL_EXIT);
+
+    patch_here(as, nested);
+    emit_copy_value(as, R13, 0, R12, 0);
+    emit_lea(as, R12, R13, VALUE_SIZE);
+    emit_sync_stack(as);
+    jump_to(as, LABEL_EXIT);
+}
+
+// Emits one instruction and returns its length, or 0 for an opcode the JIT
+// does not know.
+static int emit_instruction(assembler* as, clox_chunk* chunk, int offset)
+{
+    uint8_t* code = chunk->code + offset;
+    uint8_t instruction = clox_base_opcode(code[0]);
+
+    switch (instruction) {
+        case CLOX_OP_CONSTANT:
+            emit_copy_value(as, R12, 0, R15, code[1] * VALUE_SIZE);
+            emit_add_imm(as, R12, VALUE_SIZE);
+            return 2;
+        case CLOX_OP_NIL: emit_push_immediate(as, CLOX_NIL_VAL); return 1;
+        case CLOX_OP_TRUE: emit_push_immediate(as, CLOX_BOOL_VAL(true)); return 1;
+        case CLOX_OP_FALSE: emit_push_immediate(as, CLOX_BOOL_VAL(false)); return 1;
+        case CLOX_OP_POP: emit_sub_imm(as, R12, VALUE_SIZE); return 1;
+        case CLOX_OP_GET_LOCAL:
+            emit_copy_value(as, R12, 0, R13, code[1] * VALUE_SIZE);
+            emit_add_imm(as, R12, VALUE_SIZE);
+            return 2;
+        case CLOX_OP_SET_LOCAL:
+            emit_copy_value(as, R13, code[1] * VALUE_SIZE, R12, -VALUE_SIZE);
+            return 2;
+        case CLOX_OP_GET_GLOBAL: {
+            uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+            emit_check_global(as, slot, code + 3);
+            emit_copy_value(as, R12, 0, RAX, global_offset(slot));
+            emit_add_imm(as, R12, VALUE_SIZE);
+            return 3;
+        }
+        case CLOX_OP_SET_GLOBAL: {
+            uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+            emit_check_global(as, slot, code + 3);
+            emit_copy_value(as, RAX, global_offset(slot), R12, -VALUE_SIZE);
+            return 3;
+        }
+        case CLOX_OP_DEFINE_GLOBAL: {
+            uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+            emit_load(as, RAX, RBX, (int32_t)offsetof(clox_vm, global_values.values));
+            emit_copy_value(as, RAX, global_offset(slot), R12, -VALUE_SIZE);
+            emit_sub_imm(as, R12, VALUE_SIZE);
+            return 3;
+        }
+        case CLOX_OP_ADD:
+        case CLOX_OP_SUBTRACT:
+        case CLOX_OP_MULTIPLY:
+        case CLOX_OP_DEVIDE:
+        case CLOX_OP_GREATER:
+        case CLOX_OP_LESS:
+            emit_binary(as, instruction, code + 1);
+            return 1;
+        case CLOX_OP_NEGATE: emit_negate(as, code + 1); return 1;
+        case CLOX_OP_NOT: emit_not(as); return 1;
+        case CLOX_OP_EQUAL:
+            emit_set_ip(as, code + 1);
+            emit_mov(as, RDI, RBX);
+            emit_mov(as, RSI, R12);
+            emit_call(as, (void*)jit_equal_strings);
+            emit_sub_imm(as, R12, VALUE_SIZE);
+            return 1;
+        case CLOX_OP_PRINT:
+            emit_sync_stack(as);
+            emit_mov(as, RDI, RBX);
+            emit_call(as, (void*)jit_print);
+            emit_reload_stack(as);
+            return 1;
+        case CLOX_OP_JUMP: {
+            uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+            jump_to(as, offset + 3 + jump);
+            return 3;
+        }
+        case CLOX_OP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+            size_t falsey[2];
+            int count = emit_jumps_if_falsey(as, R12, -VALUE_SIZE, falsey);
+            for (int i = 0; i < count; i++) add_fixup(as, falsey[i], offset + 3 + jump);
+            return 3;
+        }
+        case CLOX_OP_LOOP: {
+            uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+            jump_to(as, offset + 3 - jump);
+            return 3;
+        }
+        case CLOX_OP_CALL:
+            emit_sync_stack(as);
+            emit_set_ip(as, code + 2);
+            emit_mov(as, RDI, RBX);
+            emit_mov_imm32(as, RSI, code[1]);
+            emit_call(as, (void*)clox_runtime_call);
+            // test eax, eax
+            emit_byte(as, 0x85);
+            emit_reg(as, RAX, RAX);
+            jump_to_if(as, CC_NE, LABEL_EXIT);
+            emit_reload_stack(as);
+            return 2;
+        case CLOX_OP_TAIL_CALL:
+            emit_sync_stack(as);
+            emit_set_ip(as, code + 2);
+            emit_mov(as, RDI, RBX);
+            emit_mov_imm32(as, RSI, code[1]);
+            emit_call(as, (void*)clox_runtime_tail_call);
+            // A replaced frame leaves with CLOX_TAIL_CALL_REPLACED for
+            // clox_jit_run() to continue; a native falls through to RETURN.
+            emit_byte(as, 0x85);
+            emit_reg(as, RAX, RAX);
+            jump_to_if(as, CC_NE, LABEL_EXIT);
+            emit_reload_stack(as);
+            return 2;
+        case CLOX_OP_RETURN: emit_return(as); return 1;
+        default:
+            return 0;
+    }
+}
+
+static void emit_prologue(assembler* as)
+{
+    emit_push(as, RBP);
+    emit_mov(as, RBP, RSP);
+    emit_push(as, RBX);
+    emit_push(as, R12);
+    emit_push(as, R13);
+    emit_push(as, R14);
+    emit_push(as, R15);
+    // Keep rsp 16-byte aligned for the runtime calls.
+    emit_sub_imm(as, RSP, 8);
+
+    emit_mov(as, RBX, RDI);
+    emit_mov(as, R14, RSI);
+    emit_load(as, R13, R14, (int32_t)offsetof(clox_call_frame, slots));
+    emit_reload_stack(as);
+    emit_load(as, RAX, R14, (int32_t)offsetof(clox_call_frame, function));
+    emit_load(as, R15, RAX, (int32_t)offsetof(clox_obj_function, chunk.constants.values));
+
+    // jmp rdx
+    emit_byte(as, 0xff);
+    emit_reg(as, 4, RDX);
+}
+
+// The error label sets the result; the exit label expects it in eax.
+static void emit_epilogue(assembler* as, size_t* error, size_t* exit)
+{
+    *error = as->count;
+    emit_mov_imm32(as, RAX, CLOX_INTERPRET_RUNTIME_ERROR);
+    *exit = as->count;
+    emit_add_imm(as, RSP, 8);
+    emit_pop(as, R15);
+    emit_pop(as, R14);
+    emit_pop(as, R13);
+    emit_pop(as, R12);
+    emit_pop(as, RBX);
+    emit_pop(as, RBP);
+    emit_byte(as, 0xc3);
+}
+
+bool clox_has_jit()
+{
+    return true;
+}
+
+bool clox_jit_compile(clox_vm* vm, clox_obj_function* function)
+{
+    clox_chunk* chunk = &function->chunk;
+    assembler as = { NULL, 0, 0, NULL, 0, 0, true };
+    int32_t* entries = (int32_t*)malloc(sizeof(int32_t) * (chunk->count + 1));
+    if (entries == NULL) {
+        function->hotness = -1;
+        return false;
+    }
+    for (int i = 0; i <= chunk->count; i++) entries[i] = -1;
+
+    emit_prologue(&as);
+
+    for (int offset = 0; offset < chunk->count && as.ok;) {
+        entries[offset] = (int32_t)as.count;
+        int length = emit_instruction(&as, chunk, offset);
+        if (length == 0) as.ok = false;
+        offset += length;
+    }
+
+    size_t error, exit;
+    emit_epilogue(&as, &error, &exit);
+
+    for (int i = 0; i < as.fixup_count && as.ok; i++) {
+        fixup* jump = &as.fixups[i];
+        size_t target;
+        if (jump->target == LABEL_ERROR) {
+            target = error;
+        } else if (jump->target == LABEL_EXIT) {
+            target = exit;
+        } else if (jump->target >= 0 && jump->target < chunk->count && entries[jump->target] >= 0) {
+            target = (size_t)entries[jump->target];
+        } else {
+            as.ok = false;
+            break;
+        }
+        patch_u32(&as, jump->at, (uint32_t)(target - (jump->at + 4)));
+    }
+
+    // Code is written while the pages are writable and only then made
+    // executable; they are never both at once.
+    clox_jit_code* native = NULL;
+    if (as.ok) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t size = (as.count + page - 1) / page * page;
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        native = (clox_jit_code*)malloc(sizeof(clox_jit_code));
+
+        if (memory != MAP_FAILED && native != NULL) {
+            memcpy(memory, as.code, as.count);
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+                native->memory = (uint8_t*)memory;
+                native->size = size;
+                native->entries = entries;
+                entries = NULL;
+            } else {
+                munmap(memory, size);
+                free(native);
+                native = NULL;
+            }
+        } else {
+            if (memory != MAP_FAILED) munmap(memory, size);
+            free(native);
+            native = NULL;
+        }
+    }
+
+    free(as.code);
+    free(as.fixups);
+    free(entries);
+
+    if (native == NULL) {
+        function->hotness = -1;
+        return false;
+    }
+
+    function->jit = native;
+    return true;
+}
+
+clox_interpret_result clox_jit_run(clox_vm* vm, clox_call_frame* frame, uint8_t* ip)
+{
+    for (;;) {
+        clox_jit_code* native = frame->function->jit;
+        int32_t entry = native->entries[ip - frame->function->chunk.code];
+        native_frame run = (native_frame)(void*)native->memory;
+        int result = run(vm, frame, native->memory + entry);
+        if (result != CLOX_TAIL_CALL_REPLACED) return (clox_interpret_result)result;
+
+        // Tail calls loop here instead of nesting native frames on the C
+        // stack. A callee that is not hot yet finishes in the interpreter.
+        if (!clox_jit_is_hot(vm, frame->function)) return clox_runtime_resume(vm);
+        ip = frame->ip;
+    }
+}
+
+void clox_free_jit_code(clox_jit_code* code)
+{
+    if (code == NULL) return;
+    munmap(code->memory, code->size);
+    free(code->entries);
+    free(code);
+}
+
+#else
+
+bool clox_has_jit()
+{
+    return false;
+}
+
+bool clox_jit_compile(clox_vm* vm, clox_obj_function* function)
+{
+    function->hotness = -1;
+    return false;
+}
+
+clox_interpret_result clox_jit_run(clox_vm* vm, clox_call_frame* frame, uint8_t* ip)
+{
+    return CLOX_INTERPRET_RUNTIME_ERROR;
+}
+
+void clox_free_jit_code(clox_jit_code* code)
+{
+}
+
+#endif
@@ -1,33 +1,182 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "clox/common.h"
 #include "clox/chunk.h"
 #include "clox/vm.h"
 #include "clox/debug.h"
+#include "clox/compiler.h"
+#include "clox/bytecode.h"
+#include "clox/jit.h"
+#include "clox/aot.h"
+#include "clox/sampler.h"
+#include "clox/stats.h"
 
-static void repl();
-static void run_file(const char *path);
-static char *read_file(const char *path);
+// Set by --no-jit, --max-frames and --max-heap for every VM the driver
+// creates.
+static bool use_jit = true;
+static int frame_max = CLOX_FRAME_MAX;
+static size_t heap_limit = 0;
+
+#define PROFILE_HZ 99
+
+static clox_vm *new_vm();
+static void repl(clox_vm* vm);
+static int run_file(clox_vm* vm, const char *path, bool use_cache);
+static int profile_file(clox_vm* vm, const char *path, bool use_cache, int hz);
+static void write_stats(clox_vm* vm, const char *path);
+static int run_batch(const char **paths, int path_count, int jobs, bool use_cache);
+static int compare_tiers(const char **paths, int path_count);
+static int emit_c(const char *path);
+static int exit_status(clox_interpret_result result);
+static clox_interpret_result interpret_cached(clox_vm* vm, const char *path, const char *source);
+static char *cache_path(const char *path);
+static char *read_file(const char *path, FILE *err);
+static char *read_manifest(const char *path, const char ***paths, int *path_count);
+static size_t parse_size(const char *program, const char *text);
+static void usage(const char *program);
 
 int main(int argc, const char *argv[])
 {
-    clox_init_vm();
+    bool use_cache = true;
+    bool compare = false;
+    bool emit = false;
+    int profile_hz = 0;
+    const char *stats_path = NULL;
+    int jobs = -1;
+    const char *manifest = NULL;
+    int arg = 1;
+
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            use_jit = false;
+        } else if (strcmp(argv[arg], "--compare-tiers") == 0) {
+            compare = true;
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            emit = true;
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile_hz = PROFILE_HZ;
+        } else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+            char *end;
+            long value = strtol(argv[arg] + 10, &end, 10);
+            if (*end != '\0' || value < 1 || value > 10000) usage(argv[0]);
+            profile_hz = (int)value;
+        } else if (strncmp(argv[arg], "--stats=", 8) == 0 && argv[arg][8] != '\0') {
+            if (!clox_has_stats()) {
+                fprintf(stderr, "--stats needs a build with CLOX_STATS on.\n");
+                exit(64);
+            }
+            stats_path = argv[arg] + 8;
+        } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            char *end;
+            long value = strtol(argv[++arg], &end, 10);
+            if (*end != '\0' || value < 0 || value > 1024) usage(argv[0]);
+            jobs = (int)value;
+        } else if (strcmp(argv[arg], "--max-frames") == 0 && arg + 1 < argc) {
+            char *end;
+            long value = strtol(argv[++arg], &end, 10);
+            if (*end != '\0' || value < 1 || value > CLOX_FRAME_LIMIT) usage(argv[0]);
+            frame_max = (int)value;
+        } else if (strcmp(argv[arg], "--max-heap") == 0 && arg + 1 < argc) {
+            heap_limit = parse_size(argv[0], argv[++arg]);
+        } else if (strcmp(argv[arg], "--manifest") == 0 && arg + 1 < argc) {
+            manifest = argv[++arg];
+        } else {
+            usage(argv[0]);
+        }
+        arg++;
+    }
+
+    if (compare || jobs >= 0 || manifest != NULL) {
+        if (profile_hz > 0 || stats_path != NULL) usage(argv[0]);
+        int path_count = argc - arg;
+        const char **paths = (const char **)malloc(sizeof(const char *) * (path_count + 1));
+        if (paths == NULL) {
+            fprintf(stderr, "Not enough memory for the batch.\n");
+            exit(74);
+        }
+        memcpy(paths, argv + arg, sizeof(const char *) * path_count);
+        char *manifest_text = NULL;
+        if (manifest != NULL) manifest_text = read_manifest(manifest, &paths, &path_count);
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+        int status = compare
+            ? compare_tiers(paths, path_count)
+            : run_batch(paths, path_count, jobs, use_cache);
+        free(paths);
+        free(manifest_text);
+        return status;
+    }
+
+    if (arg < argc - 1) usage(argv[0]);
+    if (emit) {
+        if (arg == argc || profile_hz > 0 || stats_path != NULL) usage(argv[0]);
+        return emit_c(argv[arg]);
+    }
+
+    int status = 0;
+    clox_vm *vm = new_vm();
+
+    if (arg == argc) {
+        if (profile_hz > 0) usage(argv[0]);
+        repl(vm);
+    } else if (profile_hz > 0) {
+        status = profile_file(vm, argv[arg], use_cache, profile_hz);
     } else {
-        fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-        exit(64);
+        status = run_file(vm, argv[arg], use_cache);
     }
 
-    return 0;
+    if (stats_path != NULL) write_stats(vm, stats_path);
+    clox_free_vm(vm);
+    return status;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--no-cache] [--no-jit] [--max-frames N] [--max-heap N] [--stats=file] [path]\n", program);
+    fprintf(stderr, "       %s [--no-cache] [--no-jit] [--max-frames N] [--max-heap N] [--stats=file] --profile[=hz] path\n", program);
+    fprintf(stderr, "       %s [--no-cache] [--no-jit] [--max-frames N] [--max-heap N] [--jobs N] [--manifest list] [path...]\n", program);
+    fprintf(stderr, "       %s --compare-tiers [--manifest list] [path...]\n", program);
+    fprintf(stderr, "       %s --emit-c path > program.c\n", program);
+    exit(64);
+}
+
+// A byte count with an optional k, m or g suffix.
+static size_t parse_size(const char *program, const char *text)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (end == text || *end != '\0' || text[0] == '-' || value > (SIZE_MAX >> shift)) usage(program);
+    return (size_t)value << shift;
+}
+
+static clox_vm *new_vm()
+{
+    clox_vm *vm = clox_new_vm();
+    if (vm == NULL || (frame_max != vm->frame_max && !clox_set_frame_max(vm, frame_max))) {
+        fprintf(stderr, "Not enough memory to create the VM.\n");
+        exit(74);
+    }
+
+    vm->jit_enabled = use_jit;
+    clox_set_heap_limit(vm, heap_limit);
+    return vm;
 }
 
-static void repl()
+static void repl(clox_vm* vm)
 {
     char line[1024];
     for (;;) {
@@ -38,26 +187,547 @@ static void repl()
             break;
         }
 
-        clox_interpret(line);
+        clox_interpret(vm, line);
     }
 }
 
-static void run_file(const char *path)
+static int run_file(clox_vm* vm, const char *path, bool use_cache)
 {
-    char *source = read_file(path);
-    clox_interpret_result result = clox_interpret(source);
+    char *source = read_file(path, stderr);
+    if (source == NULL) exit(74);
+
+    clox_interpret_result result = use_cache
+        ? interpret_cached(vm, path, source)
+        : clox_interpret(vm, source);
     free(source);
 
-    if (result == CLOX_INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == CLOX_INTERPRET_RUNTIME_ERROR) exit(70);
+    return exit_status(result);
+}
+
+// Samples the script while it runs, then writes its folded stacks next to
+// it as path.folded and a summary of where the time went to stderr.
+static int profile_file(clox_vm* vm, const char *path, bool use_cache, int hz)
+{
+    if (!clox_start_sampler(vm, hz)) {
+        fprintf(stderr, "Could not start the sampling profiler.\n");
+        exit(70);
+    }
+    int status = run_file(vm, path, use_cache);
+    clox_stop_sampler(vm);
+
+    size_t length = strlen(path);
+    char *folded_path = (char *)malloc(length + sizeof(".folded"));
+    if (folded_path == NULL) {
+        fprintf(stderr, "Not enough memory for the profile of \"%s\".\n", path);
+        exit(74);
+    }
+    memcpy(folded_path, path, length);
+    memcpy(folded_path + length, ".folded", sizeof(".folded"));
+
+    FILE *folded = fopen(folded_path, "w");
+    if (folded == NULL) {
+        fprintf(stderr, "Could not write \"%s\".\n", folded_path);
+    } else {
+        clox_write_folded_stacks(vm, folded);
+        fclose(folded);
+    }
+
+    clox_print_sampler_summary(vm, stderr, 20);
+    free(folded_path);
+    return status;
+}
+
+static void write_stats(clox_vm* vm, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL || !clox_write_stats(vm, out)) {
+        fprintf(stderr, "Could not write \"%s\".\n", path);
+    }
+    if (out != NULL) fclose(out);
+}
+
+// Writes the script as a C program to stdout. The listing debug builds print
+// while compiling goes to stderr so it does not end up in the C.
+static int emit_c(const char *path)
+{
+    char *source = read_file(path, stderr);
+    if (source == NULL) exit(74);
+
+    clox_vm *vm = new_vm();
+    vm->out = stderr;
+    clox_obj_function *script = clox_compile(vm, source);
+    free(source);
+
+    int status = 0;
+    if (script == NULL) {
+        status = 65;
+    } else if (!clox_emit_c(vm, stdout, script)) {
+        fprintf(stderr, "Could not translate \"%s\" to C.\n", path);
+        status = 70;
+    }
+
+    clox_free_vm(vm);
+    return status;
 }
 
-static char *read_file(const char *path)
+static int exit_status(clox_interpret_result result)
+{
+    if (result == CLOX_INTERPRET_COMPILE_ERROR) return 65;
+    if (result == CLOX_INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+// Batch mode runs every script on a pool of worker threads, one warmed VM
+// per worker, reset between scripts. Scripts are dealt out in contiguous
+// blocks, one deque per worker: the owner pops from the bottom and idle
+// workers steal from the top (Chase and Lev). No work is added once the
+// workers start, so the deques never grow and a worker that finds every
+// deque empty is done.
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    int *tasks;
+} work_deque;
+
+typedef struct {
+    const char *path;
+    char *output;
+    size_t output_length;
+    char *errors;
+    size_t errors_length;
+    int status;
+    double seconds;
+    bool done;
+} batch_script;
+
+typedef struct {
+    batch_script *scripts;
+    int script_count;
+    work_deque *deques;
+    int worker_count;
+    bool use_cache;
+
+    // Output is written in script order as soon as every earlier script
+    // has finished, so it never interleaves and does not depend on timing.
+    pthread_mutex_t output_lock;
+    int next_output;
+} batch;
+
+typedef struct {
+    batch *batch;
+    int index;
+    clox_vm *vm;
+    uint32_t seed;
+    int steals;
+} batch_worker;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Owner only. Returns -1 once the deque is empty.
+static int pop_task(work_deque *deque)
+{
+    // The store to bottom has to be ordered before the load of top, hence
+    // seq_cst rather than a fence, which ThreadSanitizer cannot follow.
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    int task = deque->tasks[bottom];
+    if (top == bottom) {
+        // Last task: race the thieves for it.
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = -1;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// Any thread. Sets *contended when it lost a race for a task that may still
+// be followed by others, so the caller knows the deque was not empty.
+static int steal_task(work_deque *deque, bool *contended)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_seq_cst);
+    if (top >= bottom) return -1;
+
+    int task = deque->tasks[top];
+    if (!atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        *contended = true;
+        return -1;
+    }
+    return task;
+}
+
+static int next_task(batch_worker *worker)
+{
+    batch *batch = worker->batch;
+    int task = pop_task(&batch->deques[worker->index]);
+    if (task >= 0) return task;
+
+    for (;;) {
+        bool contended = false;
+
+        // xorshift32 picks where the scan starts so idle workers spread out
+        // over the victims instead of all hitting the first one.
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        int start = (int)(worker->seed % (uint32_t)batch->worker_count);
+
+        for (int i = 0; i < batch->worker_count; i++) {
+            int victim = (start + i) % batch->worker_count;
+            if (victim == worker->index) continue;
+
+            task = steal_task(&batch->deques[victim], &contended);
+            if (task >= 0) {
+                worker->steals++;
+                return task;
+            }
+        }
+
+        if (!contended) return -1;
+    }
+}
+
+static void write_finished_scripts(batch *batch, batch_script *script)
+{
+    pthread_mutex_lock(&batch->output_lock);
+    script->done = true;
+
+    while (batch->next_output < batch->script_count && batch->scripts[batch->next_output].done) {
+        batch_script *ready = &batch->scripts[batch->next_output++];
+        fwrite(ready->output, sizeof(char), ready->output_length, stdout);
+        fflush(stdout);
+        fwrite(ready->errors, sizeof(char), ready->errors_length, stderr);
+        free(ready->output);
+        free(ready->errors);
+        ready->output = NULL;
+        ready->errors = NULL;
+    }
+
+    pthread_mutex_unlock(&batch->output_lock);
+}
+
+static void run_batch_script(batch_worker *worker, batch_script *script)
+{
+    clox_vm *vm = worker->vm;
+    double start = now();
+
+    FILE *out = open_memstream(&script->output, &script->output_length);
+    FILE *err = open_memstream(&script->errors, &script->errors_length);
+    if (out == NULL || err == NULL) {
+        fprintf(stderr, "Not enough memory to buffer \"%s\".\n", script->path);
+        exit(74);
+    }
+
+    vm->out = out;
+    vm->err = err;
+
+    char *source = read_file(script->path, err);
+    if (source == NULL) {
+        script->status = 74;
+    } else {
+        clox_interpret_result result = worker->batch->use_cache
+            ? interpret_cached(vm, script->path, source)
+            : clox_interpret(vm, source);
+        script->status = exit_status(result);
+        free(source);
+    }
+
+    clox_reset_vm(vm);
+    vm->out = stdout;
+    vm->err = stderr;
+    fclose(out);
+    fclose(err);
+
+    script->seconds = now() - start;
+    write_finished_scripts(worker->batch, script);
+}
+
+static void *run_batch_worker(void *arg)
+{
+    batch_worker *worker = (batch_worker *)arg;
+
+    for (int task = next_task(worker); task >= 0; task = next_task(worker)) {
+        run_batch_script(worker, &worker->batch->scripts[task]);
+    }
+
+    return NULL;
+}
+
+static int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an ascending array.
+static double percentile(const double *sorted, int count, double p)
+{
+    int rank = (int)(p * count + 0.999999);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static void report_batch(batch *batch, batch_worker *workers, double elapsed)
+{
+    int count = batch->script_count;
+    double *seconds = (double *)malloc(sizeof(double) * (count > 0 ? count : 1));
+    if (seconds == NULL) return;
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        seconds[i] = batch->scripts[i].seconds;
+        if (batch->scripts[i].status != 0) failed++;
+    }
+    qsort(seconds, count, sizeof(double), compare_seconds);
+
+    int steals = 0;
+    for (int i = 0; i < batch->worker_count; i++) steals += workers[i].steals;
+
+    fprintf(
+        stderr,
+        "batch: %d scripts, %d failed, %d workers, %d steals, %.3f s, %.1f scripts/s\n",
+        count, failed, batch->worker_count, steals, elapsed, elapsed > 0 ? count / elapsed : 0.0
+    );
+    if (count > 0) {
+        fprintf(
+            stderr,
+            "latency ms: min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+            seconds[0] * 1e3,
+            percentile(seconds, count, 0.50) * 1e3,
+            percentile(seconds, count, 0.90) * 1e3,
+            percentile(seconds, count, 0.99) * 1e3,
+            seconds[count - 1] * 1e3
+        );
+    }
+
+    free(seconds);
+}
+
+// jobs == 0 means one worker per online CPU. The exit status is the worst
+// of the per-script statuses.
+static int run_batch(const char **paths, int path_count, int jobs, bool use_cache)
+{
+    if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > path_count) jobs = path_count;
+    if (jobs < 1) jobs = 1;
+
+    batch batch;
+    batch.script_count = path_count;
+    batch.worker_count = jobs;
+    batch.use_cache = use_cache;
+    batch.next_output = 0;
+    batch.scripts = (batch_script *)calloc(path_count > 0 ? path_count : 1, sizeof(batch_script));
+    batch.deques = (work_deque *)calloc(jobs, sizeof(work_deque));
+    int *tasks = (int *)malloc(sizeof(int) * (path_count > 0 ? path_count : 1));
+    batch_worker *workers = (batch_worker *)calloc(jobs, sizeof(batch_worker));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * jobs);
+    if (batch.scripts == NULL || batch.deques == NULL || tasks == NULL || workers == NULL || threads == NULL) {
+        fprintf(stderr, "Not enough memory for the batch.\n");
+        exit(74);
+    }
+    pthread_mutex_init(&batch.output_lock, NULL);
+
+    for (int i = 0; i < path_count; i++) {
+        batch.scripts[i].path = paths[i];
+    }
+
+    // Each worker owns one contiguous block of scripts. The block is stored
+    // reversed so the owner pops its scripts in order, keeping output
+    // flowing, while thieves take the latest ones from the other end.
+    for (int i = 0; i < jobs; i++) {
+        int first = (int)((long)path_count * i / jobs);
+        int last = (int)((long)path_count * (i + 1) / jobs);
+        for (int j = first; j < last; j++) tasks[j] = last - 1 - (j - first);
+        batch.deques[i].tasks = tasks + first;
+        atomic_init(&batch.deques[i].top, 0);
+        atomic_init(&batch.deques[i].bottom, last - first);
+
+        workers[i].batch = &batch;
+        workers[i].index = i;
+        workers[i].seed = 2463534242u + (uint32_t)i * 2654435761u;
+        workers[i].vm = new_vm();
+    }
+
+    double start = now();
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, run_batch_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start batch worker %d.\n", i);
+            exit(71);
+        }
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    report_batch(&batch, workers, elapsed);
+
+    int status = 0;
+    for (int i = 0; i < path_count; i++) {
+        if (batch.scripts[i].status > status) status = batch.scripts[i].status;
+    }
+
+    for (int i = 0; i < jobs; i++) clox_free_vm(workers[i].vm);
+    pthread_mutex_destroy(&batch.output_lock);
+    free(threads);
+    free(workers);
+    free(tasks);
+    free(batch.deques);
+    free(batch.scripts);
+    return status;
+}
+
+typedef struct {
+    int status;
+    char *output;
+    size_t output_length;
+    char *errors;
+    size_t errors_length;
+} tier_run;
+
+// Interprets source in a fresh VM. With the JIT on, every function is
+// compiled the first time it runs so the interpreter never gets a say.
+static tier_run run_tier(const char *source, bool jit)
+{
+    tier_run run = { 0, NULL, 0, NULL, 0 };
+    FILE *out = open_memstream(&run.output, &run.output_length);
+    FILE *err = open_memstream(&run.errors, &run.errors_length);
+    if (out == NULL || err == NULL) {
+        fprintf(stderr, "Not enough memory to buffer the output.\n");
+        exit(74);
+    }
+
+    clox_vm *vm = new_vm();
+    vm->out = out;
+    vm->err = err;
+    vm->jit_enabled = jit;
+    vm->jit_threshold = 0;
+    run.status = exit_status(clox_interpret(vm, source));
+    clox_free_vm(vm);
+
+    fclose(out);
+    fclose(err);
+    return run;
+}
+
+static bool same_text(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    return a_length == b_length && memcmp(a, b, a_length) == 0;
+}
+
+// Runs every script once on the interpreter and once in native code and
+// reports the scripts whose output, errors or exit status differ.
+static int compare_tiers(const char **paths, int path_count)
+{
+    if (!clox_has_jit()) {
+        fprintf(stderr, "This build has no JIT to compare against.\n");
+        return 64;
+    }
+
+    int differ = 0;
+    for (int i = 0; i < path_count; i++) {
+        char *source = read_file(paths[i], stderr);
+        if (source == NULL) {
+            differ++;
+            continue;
+        }
+
+        tier_run interpreted = run_tier(source, false);
+        tier_run compiled = run_tier(source, true);
+        free(source);
+
+        bool same = interpreted.status == compiled.status
+            && same_text(interpreted.output, interpreted.output_length, compiled.output, compiled.output_length)
+            && same_text(interpreted.errors, interpreted.errors_length, compiled.errors, compiled.errors_length);
+        printf("%s %s\n", same ? "ok  " : "FAIL", paths[i]);
+        if (!same) {
+            differ++;
+            printf("-- interpreter (exit %d)\n%s%s", interpreted.status, interpreted.output, interpreted.errors);
+            printf("-- jit (exit %d)\n%s%s", compiled.status, compiled.output, compiled.errors);
+        }
+
+        free(interpreted.output);
+        free(interpreted.errors);
+        free(compiled.output);
+        free(compiled.errors);
+    }
+
+    printf("%d of %d scripts differ between the tiers\n", differ, path_count);
+    return differ > 0 ? 1 : 0;
+}
+
+// Loads the compiled script from its .loxc file when the cache matches the
+// source, otherwise compiles it and refreshes the cache. Failing to write the
+// cache is not an error.
+static clox_interpret_result interpret_cached(clox_vm* vm, const char *path, const char *source)
+{
+    char *bytecode_path = cache_path(path);
+    clox_interpret_result result = clox_interpret_cached(vm, source, bytecode_path);
+    free(bytecode_path);
+    return result;
+}
+
+// script.lox caches to script.loxc next to the source. Inside
+// $CLOX_CACHE_DIR the name is prefixed with a hash of the absolute path, so
+// scripts with the same name in different directories keep separate files.
+static char *cache_path(const char *path)
+{
+    const char *dir = getenv("CLOX_CACHE_DIR");
+    char *result = NULL;
+
+    if (dir != NULL && dir[0] != '\0') {
+        const char *slash = strrchr(path, '/');
+        const char *name = slash != NULL ? slash + 1 : path;
+        char *absolute = realpath(path, NULL);
+        const char *key = absolute != NULL ? absolute : path;
+        uint64_t hash = clox_hash_source(key, strlen(key));
+        free(absolute);
+
+        size_t length = strlen(dir) + strlen(name) + 20;
+        result = (char *)malloc(length);
+        if (result != NULL) {
+            snprintf(result, length, "%s/%016llx-%sc", dir, (unsigned long long)hash, name);
+        }
+    } else {
+        size_t length = strlen(path);
+        result = (char *)malloc(length + 2);
+        if (result != NULL) {
+            memcpy(result, path, length);
+            result[length] = 'c';
+            result[length + 1] = '\0';
+        }
+    }
+
+    if (result == NULL) {
+        fprintf(stderr, "Not enough memory to cache \"%s\".\n", path);
+        exit(74);
+    }
+    return result;
+}
+
+// Reports failures to err and returns NULL, so batch runs can keep going.
+static char *read_file(const char *path, FILE *err)
 {
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
     }
 
     fseek(file, 0L, SEEK_END);
@@ -66,18 +736,51 @@ static char *read_file(const char *path)
 
     char *buffer = (char *)malloc(file_size + 1);
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough mamory to read \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Not enough mamory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
     }
 
     size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+    fclose(file);
     if (bytes_read < file_size) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        return NULL;
     }
     
     buffer[bytes_read] = '\0';
-
-    fclose(file);
     return buffer;
-}
\ No newline at end of file
+}
+
+// Appends one path per line to *paths. Blank lines and lines starting with
+// '#' are skipped. The paths point into the returned text.
+static char *read_manifest(const char *path, const char ***paths, int *path_count)
+{
+    char *text = read_file(path, stderr);
+    if (text == NULL) exit(74);
+
+    int capacity = *path_count + 1;
+    for (char *line = text; *line != '\0';) {
+        char *end = strchr(line, '\n');
+        char *next = end != NULL ? end + 1 : line + strlen(line);
+        if (end == NULL) end = next;
+        while (end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+        *end = '\0';
+
+        if (line[0] != '\0' && line[0] != '#') {
+            if (*path_count == capacity) {
+                capacity *= 2;
+                *paths = (const char **)realloc(*paths, sizeof(const char *) * capacity);
+                if (*paths == NULL) {
+                    fprintf(stderr, "Not enough memory for the batch.\n");
+                    exit(74);
+                }
+            }
+            (*paths)[(*path_count)++] = line;
+        }
+        line = next;
+    }
+
+    return text;
+}
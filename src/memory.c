@@ -1,50 +1,440 @@
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
+#include "clox/compiler.h"
+#include "clox/sampler.h"
+#include "clox/stats.h"
 #include "clox/vm.h"
+#include "clox/jit.h"
 
-static void free_object(clox_obj* object);
+static const char* kind_names[CLOX_ALLOC_KIND_COUNT] = {
+    [CLOX_ALLOC_STRING] = "string",
+    [CLOX_ALLOC_FUNCTION] = "function",
+    [CLOX_ALLOC_NATIVE_FUNCTION] = "native_function",
+    [CLOX_ALLOC_STRING_CHARS] = "string_chars",
+    [CLOX_ALLOC_CODE] = "code",
+    [CLOX_ALLOC_CONSTANTS] = "constants",
+    [CLOX_ALLOC_GLOBALS] = "globals",
+    [CLOX_ALLOC_TABLE] = "table",
+    [CLOX_ALLOC_INTERN] = "intern",
+    [CLOX_ALLOC_STATS] = "stats",
+};
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size)
+static void account(clox_vm* vm, clox_alloc_kind kind, size_t old_size, size_t new_size);
+static void out_of_memory(clox_vm* vm, size_t old_size, size_t new_size, clox_alloc_kind kind, bool over_limit);
+static void raise_out_of_memory(clox_vm* vm, const char* message);
+static void abandon_collection(clox_vm* vm);
+#ifdef CLOX_POOL_ALLOCATOR
+static void* reallocate_pooled(clox_vm* vm, void* pointer, size_t old_size, size_t new_size);
+#endif
+static void free_object(clox_vm* vm, clox_obj* object);
+static void mark_roots(clox_vm* vm);
+static void mark_array(clox_vm* vm, clox_value_array* array);
+static void trace_references(clox_vm* vm);
+static void blacken_object(clox_vm* vm, clox_obj* object);
+static void sweep(clox_vm* vm);
+
+void *reallocate(clox_vm* vm, void *pointer, size_t old_size, size_t new_size, clox_alloc_kind kind)
 {
+    account(vm, kind, old_size, new_size);
+
+    if (new_size > old_size) {
+#ifdef CLOX_STATS
+        // Creating a function's counters allocates, so they are not counted
+        // themselves.
+        if (kind != CLOX_ALLOC_STATS) clox_stats_allocation(vm, new_size - old_size);
+#endif
+#ifdef CLOX_DEBUG_STRESS_GC
+        collect_garbage(vm);
+#endif
+        if (vm->bytes_allocated > vm->next_gc) {
+            collect_garbage(vm);
+        }
+
+        if (vm->heap_limit > 0 && vm->bytes_allocated > vm->heap_limit && vm->out_of_memory != NULL) {
+            collect_garbage(vm);
+            if (vm->bytes_allocated > vm->heap_limit) {
+                out_of_memory(vm, old_size, new_size, kind, true);
+            }
+        }
+
+        if (vm->bytes_allocated > vm->peak_bytes) vm->peak_bytes = vm->bytes_allocated;
+    }
+
+    void *result;
+#ifdef CLOX_POOL_ALLOCATOR
+    if (clox_pool_fits(old_size) || clox_pool_fits(new_size)) {
+        result = reallocate_pooled(vm, pointer, old_size, new_size);
+        if (new_size > 0 && result == NULL) out_of_memory(vm, old_size, new_size, kind, false);
+        return result;
+    }
+#endif
+
     if (new_size == 0) {
         free(pointer);
         return NULL;
     }
 
-    void *result = realloc(pointer, new_size);
-    if (result == NULL) exit(1);
+    vm->pool.system_allocations++;
+    result = realloc(pointer, new_size);
+    if (result == NULL) out_of_memory(vm, old_size, new_size, kind, false);
     return result;
 }
 
-void free_objects()
+void clox_get_heap_stats(clox_vm* vm, clox_heap_stats* stats)
+{
+    stats->bytes_allocated = vm->bytes_allocated;
+    stats->peak_bytes = vm->peak_bytes;
+    stats->heap_limit = vm->heap_limit;
+    stats->next_gc = vm->next_gc;
+    stats->collections = vm->collections;
+    memcpy(stats->kinds, vm->allocations, sizeof(stats->kinds));
+}
+
+const char* clox_alloc_kind_name(clox_alloc_kind kind)
+{
+    if ((int)kind < 0 || kind >= CLOX_ALLOC_KIND_COUNT) return "unknown";
+    return kind_names[kind];
+}
+
+bool clox_write_heap_stats(clox_vm* vm, FILE* out)
+{
+    clox_heap_stats stats;
+    clox_get_heap_stats(vm, &stats);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"bytes_allocated\": %zu,\n", stats.bytes_allocated);
+    fprintf(out, "  \"peak_bytes\": %zu,\n", stats.peak_bytes);
+    fprintf(out, "  \"heap_limit\": %zu,\n", stats.heap_limit);
+    fprintf(out, "  \"next_gc\": %zu,\n", stats.next_gc);
+    fprintf(out, "  \"collections\": %llu,\n", (unsigned long long)stats.collections);
+    fprintf(out, "  \"kinds\": {");
+    for (int kind = 0; kind < CLOX_ALLOC_KIND_COUNT; kind++) {
+        fprintf(
+            out,
+            "%s\n    \"%s\": {\"bytes\": %zu, \"count\": %zu}",
+            kind > 0 ? "," : "",
+            kind_names[kind],
+            stats.kinds[kind].bytes,
+            stats.kinds[kind].count
+        );
+    }
+    fprintf(out, "\n  }\n}\n");
+    return !ferror(out);
+}
+
+void clox_set_heap_limit(clox_vm* vm, size_t limit)
+{
+    vm->heap_limit = limit;
+}
+
+// Sizes wrap around like bytes_allocated does, so a shrink is an addition
+// of the difference as well.
+static void account(clox_vm* vm, clox_alloc_kind kind, size_t old_size, size_t new_size)
+{
+    clox_heap_usage* usage = &vm->allocations[kind];
+    vm->bytes_allocated += new_size - old_size;
+    usage->bytes += new_size - old_size;
+    if (old_size == 0 && new_size > 0) usage->count++;
+    if (old_size > 0 && new_size == 0) usage->count--;
+}
+
+// The allocation did not happen, so it is taken back out of the counters
+// before the script is stopped.
+static void out_of_memory(clox_vm* vm, size_t old_size, size_t new_size, clox_alloc_kind kind, bool over_limit)
+{
+    account(vm, kind, new_size, old_size);
+
+    if (over_limit) {
+        char message[96];
+        snprintf(message, sizeof(message), "Heap limit of %zu bytes exceeded.", vm->heap_limit);
+        raise_out_of_memory(vm, message);
+    }
+    raise_out_of_memory(vm, "Out of memory.");
+}
+
+// Stops the script with a runtime error. Outside clox_interpret() there is
+// no script to stop and no caller expecting NULL, so the message goes to the
+// error stream and the process aborts.
+static void raise_out_of_memory(clox_vm* vm, const char* message)
+{
+    if (vm->out_of_memory == NULL) {
+        fprintf(vm->err, "%s\n", message);
+        abort();
+    }
+
+    clox_runtime_error(vm, message);
+    longjmp(*vm->out_of_memory, 1);
+}
+
+// Unmarks everything before the script is stopped in the middle of marking.
+// A mark left behind would keep the next collection from tracing through
+// that object, and what only it reaches would be freed.
+static void abandon_collection(clox_vm* vm)
+{
+    for (clox_obj* object = vm->objects; object != NULL; object = object->next) {
+        object->is_marked = false;
+    }
+    vm->gray_count = 0;
+    raise_out_of_memory(vm, "Out of memory.");
+}
+
+void mark_object(clox_vm* vm, clox_obj* object)
 {
-    clox_obj* object = clox_vm_instance.objects;
+    if (object == NULL) return;
+    if (object->is_marked) return;
+
+#ifdef CLOX_DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    clox_print_value(stdout, CLOX_OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->is_marked = true;
+
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        int capacity = GROW_CAPACITY(vm->gray_capacity);
+        // The gray stack is owned by the collector itself, so it bypasses
+        // reallocate() to avoid triggering a nested collection.
+        clox_obj** gray_stack = (clox_obj**)realloc(vm->gray_stack, sizeof(clox_obj*) * capacity);
+        if (gray_stack == NULL) abandon_collection(vm);
+        vm->gray_stack = gray_stack;
+        vm->gray_capacity = capacity;
+    }
+
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+void mark_value(clox_vm* vm, clox_value value)
+{
+    if (CLOX_IS_OBJ(value)) mark_object(vm, CLOX_AS_OBJ(value));
+}
+
+void mark_table(clox_vm* vm, clox_table* table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        if (!CLOX_TABLE_IS_LIVE(table->control[i])) continue;
+
+        clox_entry* entry = &table->entries[i];
+        mark_object(vm, (clox_obj*)entry->key);
+        mark_value(vm, entry->value);
+    }
+    // Entries a resize has not moved yet.
+    for (int i = 0; i < table->old_capacity; i++) {
+        if (!CLOX_TABLE_IS_LIVE(table->old_control[i])) continue;
+
+        clox_entry* entry = &table->old_entries[i];
+        mark_object(vm, (clox_obj*)entry->key);
+        mark_value(vm, entry->value);
+    }
+}
+
+void collect_garbage(clox_vm* vm)
+{
+#ifdef CLOX_DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytes_allocated;
+#endif
+
+    vm->collections++;
+    mark_roots(vm);
+    trace_references(vm);
+    clox_intern_set_remove_white(vm, &vm->strings);
+    sweep(vm);
+
+    vm->next_gc = (size_t)(
+        vm->bytes_allocated * vm->gc_heap_grow_factor
+    );
+    if (vm->next_gc < CLOX_GC_INITIAL_HEAP) {
+        vm->next_gc = CLOX_GC_INITIAL_HEAP;
+    }
+
+#ifdef CLOX_DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf(
+        "   collected %zu bytes (from %zu to %zu) next at %zu\n",
+        before - vm->bytes_allocated,
+        before,
+        vm->bytes_allocated,
+        vm->next_gc
+    );
+#endif
+}
+
+void free_objects(clox_vm* vm)
+{
+    clox_obj* object = vm->objects;
     while (object != NULL) {
         clox_obj* next = object->next;
-        free_object(object);
+        free_object(vm, object);
         object = next;
     }
+
+    free(vm->gray_stack);
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
 }
 
-static void free_object(clox_obj* object)
+#ifdef CLOX_POOL_ALLOCATOR
+// Moves a block between the pool and the system allocator whenever either
+// side of the resize is small enough to live in a size class.
+static void* reallocate_pooled(clox_vm* vm, void* pointer, size_t old_size, size_t new_size)
 {
+    clox_pool* pool = &vm->pool;
+
+    if (
+        clox_pool_fits(old_size)
+        && clox_pool_fits(new_size)
+        && (old_size - 1) / CLOX_POOL_GRANULARITY == (new_size - 1) / CLOX_POOL_GRANULARITY
+    ) {
+        return pointer;
+    }
+
+    void* result = NULL;
+    if (clox_pool_fits(new_size)) {
+        result = clox_pool_allocate(pool, new_size);
+    } else if (new_size > 0) {
+        pool->system_allocations++;
+        result = malloc(new_size);
+    }
+
+    if (new_size > 0 && result == NULL) return NULL;
+
+    if (pointer != NULL) {
+        if (result != NULL) {
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        }
+
+        if (clox_pool_fits(old_size)) {
+            clox_pool_release(pool, pointer, old_size);
+        } else {
+            free(pointer);
+        }
+    }
+
+    return result;
+}
+#endif
+
+static void free_object(clox_vm* vm, clox_obj* object)
+{
+#ifdef CLOX_DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type) {
         case CLOX_OBJ_STRING: {
             clox_obj_string* string = (clox_obj_string*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(clox_obj_string, object);
+            if (string->chars != NULL) {
+                FREE_ARRAY(vm, char, string->chars, string->length + 1, CLOX_ALLOC_STRING_CHARS);
+            }
+            if (string->is_rope) {
+                FREE(vm, clox_obj_rope, object, CLOX_ALLOC_STRING);
+            } else {
+                FREE(vm, clox_obj_string, object, CLOX_ALLOC_STRING);
+            }
             break;
         }
         case CLOX_OBJ_FUNCTION: {
             clox_obj_function* function = (clox_obj_function*)object;
-            clox_free_chunk(&function->chunk);
-            FREE(clox_obj_function, object);
+            clox_free_chunk(vm, &function->chunk);
+            clox_free_jit_code(function->jit);
+            FREE(vm, clox_obj_function, object, CLOX_ALLOC_FUNCTION);
             break;
         }
         case CLOX_OBJ_NATIVE_FUNCTION: {
-            FREE(clox_obj_native_function, object);
+            FREE(vm, clox_obj_native_function, object, CLOX_ALLOC_NATIVE_FUNCTION);
             break;
         }
     }
 }
+
+static void mark_roots(clox_vm* vm)
+{
+    for (clox_value* slot = vm->stack; slot < vm->stack_top; slot++) {
+        mark_value(vm, *slot);
+    }
+
+    for (int i = 0; i < vm->frame_count; i++) {
+        mark_object(vm, (clox_obj*)vm->frames[i].function);
+    }
+
+    mark_table(vm, &vm->global_slots);
+    mark_array(vm, &vm->global_names);
+    mark_array(vm, &vm->global_values);
+    clox_mark_compiler_roots(vm);
+    clox_mark_sampler_roots(vm);
+}
+
+static void mark_array(clox_vm* vm, clox_value_array* array)
+{
+    for (int i = 0; i < array->count; i++) {
+        mark_value(vm, array->values[i]);
+    }
+}
+
+static void trace_references(clox_vm* vm)
+{
+    while (vm->gray_count > 0) {
+        clox_obj* object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object);
+    }
+}
+
+static void blacken_object(clox_vm* vm, clox_obj* object)
+{
+#ifdef CLOX_DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    clox_print_value(stdout, CLOX_OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type) {
+        case CLOX_OBJ_FUNCTION: {
+            clox_obj_function* function = (clox_obj_function*)object;
+            mark_object(vm, (clox_obj*)function->name);
+            mark_array(vm, &function->chunk.constants);
+            break;
+        }
+        case CLOX_OBJ_STRING: {
+            clox_obj_string* string = (clox_obj_string*)object;
+            if (string->is_rope) {
+                clox_obj_rope* rope = (clox_obj_rope*)string;
+                mark_object(vm, (clox_obj*)rope->left);
+                mark_object(vm, (clox_obj*)rope->right);
+            }
+            break;
+        }
+        case CLOX_OBJ_NATIVE_FUNCTION:
+            break;
+    }
+}
+
+static void sweep(clox_vm* vm)
+{
+    clox_obj* previous = NULL;
+    clox_obj* object = vm->objects;
+
+    while (object != NULL) {
+        if (object->is_marked) {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        clox_obj* unreached = object;
+        object = object->next;
+        if (previous != NULL) {
+            previous->next = object;
+        } else {
+            vm->objects = object;
+        }
+
+        free_object(vm, unreached);
+    }
+}
@@ -3,22 +3,32 @@
 
 #include "clox/common.h"
 #include "clox/object.h"
+#include "clox/table.h"
+#include "clox/heap.h"
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-    ((type*)reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count)))
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count, kind) \
+    ((type*)reallocate(vm, pointer, sizeof(type) * (old_count), sizeof(type) * (new_count), kind))
 
-#define FREE_ARRAY(type, pointer, count) \
-    reallocate(pointer, sizeof(type) * count, 0)
+#define FREE_ARRAY(vm, type, pointer, count, kind) \
+    reallocate(vm, pointer, sizeof(type) * (count), 0, kind)
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count, kind) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count), kind)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer, kind) reallocate(vm, pointer, sizeof(type), 0, kind)
 
-void* reallocate(void *pointer, size_t old_size, size_t new_size);
-void free_objects();
+// Allocations that grow the heap can collect garbage, and inside
+// clox_interpret() they can stop the script with a runtime error when the
+// heap limit or the system's memory runs out. Callers update their own
+// pointers and sizes only after the call returns.
+void* reallocate(clox_vm* vm, void *pointer, size_t old_size, size_t new_size, clox_alloc_kind kind);
+void mark_object(clox_vm* vm, clox_obj* object);
+void mark_value(clox_vm* vm, clox_value value);
+void mark_table(clox_vm* vm, clox_table* table);
+void collect_garbage(clox_vm* vm);
+void free_objects(clox_vm* vm);
 
 #endif // __MEMORY_H__
@@ -1,119 +1,371 @@
+#include <limits.h>
+#include <setjmp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
 #include "clox/object.h"
 #include "clox/value.h"
 #include "clox/vm.h"
-#include "clox/table.h"
+#include "clox/hash.h"
+#include "clox/intern.h"
 
-#define ALLOCATE_OBJ(type, obj_type) \
-    (type*)allocate_object(sizeof(type), obj_type)
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_HAVE_MEMSTREAM
+#endif
 
-static clox_obj_string* allocate_string(char* chars, int length, uint32_t hash);
-static clox_obj* allocate_object(size_t size, clox_obj_type type);
-static uint32_t hash_string(const char* chars, int length);
-static void print_function(clox_obj_function* function);
+// How many lookups ahead clox_copy_strings() prefetches slots.
+#define PREFETCH_DISTANCE 8
 
-clox_obj_native_function* clox_new_native_function(clox_native_fn function)
+#define ALLOCATE_OBJ(vm, type, obj_type, kind) \
+    (type*)allocate_object(vm, sizeof(type), obj_type, kind)
+
+static clox_obj_string* copy_string(clox_vm* vm, const char* chars, int length, uint32_t hash);
+static clox_obj_string* allocate_string(clox_vm* vm, char* chars, int length, uint32_t hash);
+static clox_obj_string* new_string(clox_vm* vm, char* chars, int length);
+static clox_obj* allocate_object(clox_vm* vm, size_t size, clox_obj_type type, clox_alloc_kind kind);
+static void print_string(FILE* out, clox_obj_string* string);
+static void print_function(FILE* out, clox_obj_function* function);
+
+clox_obj_native_function* clox_new_native_function(clox_vm* vm, clox_native_fn function)
 {
-    clox_obj_native_function* native_fn = ALLOCATE_OBJ(clox_obj_native_function, CLOX_OBJ_NATIVE_FUNCTION);
+    clox_obj_native_function* native_fn = ALLOCATE_OBJ(vm, clox_obj_native_function, CLOX_OBJ_NATIVE_FUNCTION, CLOX_ALLOC_NATIVE_FUNCTION);
     native_fn->function = function;
     return native_fn;
 }
 
-clox_obj_function* clox_new_function()
+clox_obj_function* clox_new_function(clox_vm* vm)
 {
-    clox_obj_function* function = ALLOCATE_OBJ(clox_obj_function, CLOX_OBJ_FUNCTION);
+    clox_obj_function* function = ALLOCATE_OBJ(vm, clox_obj_function, CLOX_OBJ_FUNCTION, CLOX_ALLOC_FUNCTION);
     function->arity = 0;
+    function->max_slots = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->aot = NULL;
+#ifdef CLOX_STATS
+    function->stats = NULL;
+#endif
 
     clox_init_chunk(&function->chunk);
 
     return function;
 }
 
-clox_obj_string* clox_copy_string(const char* chars, int length)
+clox_obj_string* clox_copy_string(clox_vm* vm, const char* chars, int length)
 {
-    uint32_t hash = hash_string(chars, length);
+    return copy_string(vm, chars, length, clox_hash_string(chars, length));
+}
 
-    clox_obj_string* interned = clox_table_find_string(&clox_vm_instance.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+void clox_copy_strings(clox_vm* vm, clox_intern_batch* batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        batch->hashes[i] = clox_hash_string(batch->chars[i], batch->lengths[i]);
+    }
 
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    // Nothing allocates in here, so the strings found need no root yet.
+    for (int i = 0; i < batch->count; i++) {
+        if (i + PREFETCH_DISTANCE < batch->count) {
+            clox_intern_set_prefetch(&vm->strings, batch->hashes[i + PREFETCH_DISTANCE]);
+        }
+        batch->strings[i] = clox_intern_set_find(&vm->strings, batch->chars[i], batch->lengths[i], batch->hashes[i]);
+    }
+    batch->interned = batch->count;
+
+    // Looked up again, since an earlier entry may have added the same string.
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->strings[i] != NULL) continue;
+        batch->strings[i] = copy_string(vm, batch->chars[i], batch->lengths[i], batch->hashes[i]);
+    }
 }
 
-clox_obj_string* clox_take_string(char* chars, int length)
+clox_obj_string* clox_take_string(clox_vm* vm, char* chars, int length)
 {
-    uint32_t hash = hash_string(chars, length);
-    clox_obj_string* interned = clox_table_find_string(&clox_vm_instance.strings, chars, length, hash);
+    uint32_t hash = clox_hash_string(chars, length);
+    clox_obj_string* interned = clox_intern_set_find(&vm->strings, chars, length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1, CLOX_ALLOC_STRING_CHARS);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    return allocate_string(vm, chars, length, hash);
+}
+
+clox_obj_string* clox_concatenate(clox_vm* vm, clox_obj_string* a, clox_obj_string* b)
+{
+    if (a->length > INT_MAX - 1 - b->length) return NULL;
+    int length = a->length + b->length;
+
+    if (length < CLOX_ROPE_MIN_LENGTH) {
+        char* chars = ALLOCATE(vm, char, length + 1, CLOX_ALLOC_STRING_CHARS);
+        clox_copy_chars(a, chars);
+        clox_copy_chars(b, chars + a->length);
+        chars[length] = '\0';
+        return new_string(vm, chars, length);
+    }
+
+    clox_obj_rope* rope = ALLOCATE_OBJ(vm, clox_obj_rope, CLOX_OBJ_STRING, CLOX_ALLOC_STRING);
+    rope->string.length = length;
+    rope->string.chars = NULL;
+    rope->string.hash = 0;
+    rope->string.is_rope = true;
+    rope->string.is_interned = false;
+    rope->string.compares = 0;
+    rope->left = a;
+    rope->right = b;
+    return &rope->string;
+}
+
+void clox_flatten_string(clox_vm* vm, clox_obj_string* string)
+{
+    if (string->chars != NULL) return;
+
+    // The rope still holds its operands while this allocates.
+    char* chars = ALLOCATE(vm, char, string->length + 1, CLOX_ALLOC_STRING_CHARS);
+    clox_copy_chars(string, chars);
+    chars[string->length] = '\0';
+
+    clox_obj_rope* rope = (clox_obj_rope*)string;
+    string->chars = chars;
+    rope->left = NULL;
+    rope->right = NULL;
 }
 
-void clox_print_object(clox_value value)
+clox_obj_string* clox_intern_string(clox_vm* vm, clox_obj_string* string)
+{
+    if (string->is_interned) return string;
+
+    clox_flatten_string(vm, string);
+    if (string->hash == 0) string->hash = clox_hash_string(string->chars, string->length);
+    clox_obj_string* interned = clox_intern_set_find(&vm->strings, string->chars, string->length, string->hash);
+    if (interned != NULL) return interned;
+
+    clox_stack_push(vm, CLOX_OBJ_VAL(string));
+    clox_intern_set_add(vm, &vm->strings, string);
+    clox_stack_pop(vm);
+    string->is_interned = true;
+    return string;
+}
+
+bool clox_open_memory_stream(clox_memory_stream* stream)
+{
+    stream->chars = NULL;
+    stream->length = 0;
+#ifdef CLOX_HAVE_MEMSTREAM
+    stream->file = open_memstream(&stream->chars, &stream->length);
+#else
+    stream->file = tmpfile();
+#endif
+    return stream->file != NULL;
+}
+
+bool clox_close_memory_stream(clox_memory_stream* stream)
+{
+#ifdef CLOX_HAVE_MEMSTREAM
+    bool ok = !ferror(stream->file);
+    ok = fclose(stream->file) == 0 && ok;
+#else
+    // Read back from the temporary file.
+    bool ok = fflush(stream->file) == 0 && !ferror(stream->file);
+    long length = ok ? ftell(stream->file) : -1;
+    stream->chars = length >= 0 ? (char*)malloc(length + 1) : NULL;
+    rewind(stream->file);
+    ok = stream->chars != NULL && fread(stream->chars, 1, length, stream->file) == (size_t)length;
+    if (ok) {
+        stream->chars[length] = '\0';
+        stream->length = (size_t)length;
+    }
+    fclose(stream->file);
+#endif
+    stream->file = NULL;
+    if (!ok) {
+        free(stream->chars);
+        stream->chars = NULL;
+        stream->length = 0;
+    }
+    return ok;
+}
+
+clox_obj_string* clox_string_from_report(clox_vm* vm, bool (*write)(clox_vm* vm, FILE* out))
+{
+    clox_memory_stream report;
+    if (!clox_open_memory_stream(&report)) return NULL;
+
+    bool ok = write(vm, report.file);
+    if (!clox_close_memory_stream(&report)) return NULL;
+    if (!ok || report.length > INT_MAX - 1) {
+        free(report.chars);
+        return NULL;
+    }
+
+    // The stream's buffer is outside the heap, and the copy belongs to no
+    // object until the string exists. A jump out of either allocation is
+    // caught to free both before it is passed on.
+    int length = (int)report.length;
+    char* volatile chars = NULL;
+    jmp_buf out_of_memory;
+    jmp_buf* enclosing = vm->out_of_memory;
+    if (enclosing != NULL) {
+        if (setjmp(out_of_memory) != 0) {
+            vm->out_of_memory = enclosing;
+            free(report.chars);
+            if (chars != NULL) FREE_ARRAY(vm, char, chars, length + 1, CLOX_ALLOC_STRING_CHARS);
+            longjmp(*enclosing, 1);
+        }
+        vm->out_of_memory = &out_of_memory;
+    }
+
+    chars = ALLOCATE(vm, char, length + 1, CLOX_ALLOC_STRING_CHARS);
+    memcpy(chars, report.chars, length + 1);
+    // Reports are printed, not compared, so they are not interned.
+    clox_obj_string* string = new_string(vm, chars, length);
+    vm->out_of_memory = enclosing;
+    free(report.chars);
+    return string;
+}
+
+void clox_print_object(FILE* out, clox_value value)
 {
     switch (CLOX_OBJ_TYPE(value)) {
         case CLOX_OBJ_STRING: {
-            printf("%s", CLOX_AS_CSTRING(value));
+            print_string(out, CLOX_AS_STRING(value));
             break;
         }
         case CLOX_OBJ_FUNCTION: {
-            print_function(CLOX_AS_FUNCTION(value));
+            print_function(out, CLOX_AS_FUNCTION(value));
             break;
         }
         case CLOX_OBJ_NATIVE_FUNCTION: {
-            printf("<native fn>");
+            fputs("<native fn>", out);
             break;
         }
     }
 }
 
-static clox_obj_string *allocate_string(char *chars, int length, uint32_t hash)
+static clox_obj_string* copy_string(clox_vm* vm, const char* chars, int length, uint32_t hash)
 {
-    clox_obj_string *string = ALLOCATE_OBJ(clox_obj_string, CLOX_OBJ_STRING);
+    clox_obj_string* interned = clox_intern_set_find(&vm->strings, chars, length, hash);
+    if (interned != NULL) return interned;
+
+    char *heap_chars = ALLOCATE(vm, char, length + 1, CLOX_ALLOC_STRING_CHARS);
+    memcpy(heap_chars, chars, length);
+    heap_chars[length] = '\0';
+    return allocate_string(vm, heap_chars, length, hash);
+}
+
+static clox_obj_string *allocate_string(clox_vm* vm, char *chars, int length, uint32_t hash)
+{
+    clox_obj_string *string = ALLOCATE_OBJ(vm, clox_obj_string, CLOX_OBJ_STRING, CLOX_ALLOC_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    clox_table_set(&clox_vm_instance.strings, string, CLOX_NIL_VAL);
+    string->is_rope = false;
+    string->is_interned = false;
+    string->compares = 0;
+
+    clox_stack_push(vm, CLOX_OBJ_VAL(string));
+    clox_intern_set_add(vm, &vm->strings, string);
+    clox_stack_pop(vm);
+    string->is_interned = true;
+
     return string;
 }
 
-static clox_obj *allocate_object(size_t size, clox_obj_type type)
+static clox_obj *allocate_object(clox_vm* vm, size_t size, clox_obj_type type, clox_alloc_kind kind)
 {
-    clox_obj *object = (clox_obj*)reallocate(NULL, 0, size);
+    clox_obj *object = (clox_obj*)reallocate(vm, NULL, 0, size, kind);
     object->type = type;
-    object->next = clox_vm_instance.objects;
-    clox_vm_instance.objects = object;
+    object->is_marked = false;
+    object->next = vm->objects;
+    vm->objects = object;
 
     return object;
 }
 
-static uint32_t hash_string(const char* chars, int length)
+// Recurses into the shorter operand only, so the depth stays logarithmic
+// however lopsided the rope is.
+void clox_copy_chars(const clox_obj_string* string, char* dest)
+{
+    while (string->chars == NULL) {
+        const clox_obj_rope* rope = (const clox_obj_rope*)string;
+        if (rope->left->length <= rope->right->length) {
+            clox_copy_chars(rope->left, dest);
+            dest += rope->left->length;
+            string = rope->right;
+        } else {
+            clox_copy_chars(rope->right, dest + rope->left->length);
+            string = rope->left;
+        }
+    }
+    memcpy(dest, string->chars, string->length);
+}
+
+// A range that lies in one operand narrows to it, and one that spans both
+// is split there, recursing into the shorter part.
+void clox_copy_range(const clox_obj_string* string, int start, int length, char* dest)
+{
+    while (length > 0 && string->chars == NULL) {
+        const clox_obj_rope* rope = (const clox_obj_rope*)string;
+        int split = rope->left->length;
+        if (start + length <= split) {
+            string = rope->left;
+        } else if (start >= split) {
+            string = rope->right;
+            start -= split;
+        } else {
+            int head = split - start;
+            if (head <= length - head) {
+                clox_copy_range(rope->left, start, head, dest);
+                string = rope->right;
+                start = 0;
+                dest += head;
+                length -= head;
+            } else {
+                clox_copy_range(rope->right, 0, length - head, dest + head);
+                string = rope->left;
+                length = head;
+            }
+        }
+    }
+    if (length > 0) memcpy(dest, string->chars + start, length);
+}
+
+// Printing may happen in the middle of a collection and has no VM to
+// allocate with, so a rope is printed a window at a time.
+static void print_string(FILE* out, clox_obj_string* string)
 {
-    uint32_t hash = 2166136261l;
+    if (string->chars != NULL) {
+        fputs(string->chars, out);
+        return;
+    }
 
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)chars[i];
-        hash *= 16777619;
+    char window[CLOX_ROPE_WINDOW];
+    for (int start = 0; start < string->length; start += CLOX_ROPE_WINDOW) {
+        int length = string->length - start < CLOX_ROPE_WINDOW ? string->length - start : CLOX_ROPE_WINDOW;
+        clox_copy_range(string, start, length, window);
+        fwrite(window, 1, length, out);
     }
+}
 
-    return hash;
+static clox_obj_string* new_string(clox_vm* vm, char* chars, int length)
+{
+    clox_obj_string* string = ALLOCATE_OBJ(vm, clox_obj_string, CLOX_OBJ_STRING, CLOX_ALLOC_STRING);
+    string->length = length;
+    string->chars = chars;
+    string->hash = 0;
+    string->is_rope = false;
+    string->is_interned = false;
+    string->compares = 0;
+    return string;
 }
 
-static void print_function(clox_obj_function* function)
+static void print_function(FILE* out, clox_obj_function* function)
 {
     if (function->name == NULL) {
-        printf("<script>");
+        fputs("<script>", out);
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(out, "<fn %s>", function->name->chars);
 }
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+
+#include "clox/pool.h"
+
+// Each page starts with its header, rounded up so blocks stay aligned for
+// any object the VM stores in them.
+#define PAGE_HEADER_SIZE \
+    ((sizeof(clox_pool_page) + CLOX_POOL_GRANULARITY * 2 - 1) & ~(size_t)(CLOX_POOL_GRANULARITY * 2 - 1))
+
+static int size_class(size_t size);
+static void refill(clox_pool* pool, int index);
+
+void clox_init_pool(clox_pool* pool)
+{
+    for (int i = 0; i < CLOX_POOL_CLASS_COUNT; i++) {
+        pool->free_lists[i] = NULL;
+    }
+
+    pool->pages = NULL;
+    pool->page_count = 0;
+    pool->pool_allocations = 0;
+    pool->system_allocations = 0;
+}
+
+void clox_free_pool(clox_pool* pool)
+{
+    clox_pool_page* page = pool->pages;
+    while (page != NULL) {
+        clox_pool_page* next = page->next;
+        free(page);
+        page = next;
+    }
+
+    clox_init_pool(pool);
+}
+
+void* clox_pool_allocate(clox_pool* pool, size_t size)
+{
+    int index = size_class(size);
+    if (pool->free_lists[index] == NULL) {
+        refill(pool, index);
+        if (pool->free_lists[index] == NULL) return NULL;
+    }
+
+    clox_pool_block* block = pool->free_lists[index];
+    pool->free_lists[index] = block->next;
+    pool->pool_allocations++;
+    return block;
+}
+
+void clox_pool_release(clox_pool* pool, void* pointer, size_t size)
+{
+    if (pointer == NULL) return;
+
+    int index = size_class(size);
+    clox_pool_block* block = (clox_pool_block*)pointer;
+    block->next = pool->free_lists[index];
+    pool->free_lists[index] = block;
+}
+
+static int size_class(size_t size)
+{
+    return (int)((size + CLOX_POOL_GRANULARITY - 1) / CLOX_POOL_GRANULARITY) - 1;
+}
+
+static void refill(clox_pool* pool, int index)
+{
+    clox_pool_page* page = (clox_pool_page*)malloc(CLOX_POOL_PAGE_SIZE);
+    if (page == NULL) return;
+
+    pool->system_allocations++;
+    page->next = pool->pages;
+    pool->pages = page;
+    pool->page_count++;
+
+    size_t block_size = (size_t)(index + 1) * CLOX_POOL_GRANULARITY;
+    if (block_size < sizeof(clox_pool_block)) block_size = sizeof(clox_pool_block);
+
+    // Carve the page back to front so the free list hands out ascending
+    // addresses.
+    char* start = (char*)page + PAGE_HEADER_SIZE;
+    size_t block_count = (CLOX_POOL_PAGE_SIZE - PAGE_HEADER_SIZE) / block_size;
+    for (size_t i = block_count; i > 0; i--) {
+        clox_pool_block* block = (clox_pool_block*)(start + (i - 1) * block_size);
+        block->next = pool->free_lists[index];
+        pool->free_lists[index] = block;
+    }
+}
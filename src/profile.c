@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clox/profile.h"
+#include "clox/debug.h"
+
+#define NO_OPCODE CLOX_OP_COUNT
+
+typedef struct {
+    uint64_t count;
+    uint8_t ops[3];
+} sequence_count;
+
+struct clox_opcode_profile {
+    uint64_t total;
+    uint64_t singles[CLOX_OP_COUNT];
+    uint64_t pairs[CLOX_OP_COUNT][CLOX_OP_COUNT];
+    uint64_t triples[CLOX_OP_COUNT][CLOX_OP_COUNT][CLOX_OP_COUNT];
+    int previous[2];
+};
+
+static int compare_counts(const void* a, const void* b);
+static void print_sequences(FILE* out, const char* title, uint64_t total, sequence_count* counts, int count, int length, int limit);
+
+clox_opcode_profile* clox_new_opcode_profile()
+{
+    clox_opcode_profile* profile = (clox_opcode_profile*)calloc(1, sizeof(clox_opcode_profile));
+    if (profile == NULL) return NULL;
+
+    profile->previous[0] = NO_OPCODE;
+    profile->previous[1] = NO_OPCODE;
+    return profile;
+}
+
+void clox_free_opcode_profile(clox_opcode_profile* profile)
+{
+    free(profile);
+}
+
+void clox_profile_opcode(clox_opcode_profile* profile, uint8_t instruction)
+{
+    if (profile == NULL || instruction >= CLOX_OP_COUNT) return;
+
+    int* previous = profile->previous;
+    profile->total++;
+    profile->singles[instruction]++;
+
+    if (previous[1] != NO_OPCODE) {
+        profile->pairs[previous[1]][instruction]++;
+        if (previous[0] != NO_OPCODE) {
+            profile->triples[previous[0]][previous[1]][instruction]++;
+        }
+    }
+
+    previous[0] = previous[1];
+    previous[1] = instruction;
+}
+
+void clox_print_opcode_profile(clox_opcode_profile* profile, FILE* out, int limit)
+{
+    if (profile == NULL) return;
+
+
+    int capacity = CLOX_OP_COUNT * CLOX_OP_COUNT * CLOX_OP_COUNT;
+    sequence_count* counts = (sequence_count*)malloc(sizeof(sequence_count) * capacity);
+    if (counts == NULL) return;
+
+    fprintf(out, "== opcode profile: %llu dispatches ==\n", (unsigned long long)profile->total);
+
+    int count = 0;
+    for (int a = 0; a < CLOX_OP_COUNT; a++) {
+        if (profile->singles[a] == 0) continue;
+        counts[count++] = (sequence_count){ profile->singles[a], { (uint8_t)a } };
+    }
+    print_sequences(out, "opcodes", profile->total, counts, count, 1, limit);
+
+    count = 0;
+    for (int a = 0; a < CLOX_OP_COUNT; a++) {
+        for (int b = 0; b < CLOX_OP_COUNT; b++) {
+            if (profile->pairs[a][b] == 0) continue;
+            counts[count++] = (sequence_count){ profile->pairs[a][b], { (uint8_t)a, (uint8_t)b } };
+        }
+    }
+    print_sequences(out, "pairs", profile->total, counts, count, 2, limit);
+
+    count = 0;
+    for (int a = 0; a < CLOX_OP_COUNT; a++) {
+        for (int b = 0; b < CLOX_OP_COUNT; b++) {
+            for (int c = 0; c < CLOX_OP_COUNT; c++) {
+                if (profile->triples[a][b][c] == 0) continue;
+                counts[count++] = (sequence_count){ profile->triples[a][b][c], { (uint8_t)a, (uint8_t)b, (uint8_t)c } };
+            }
+        }
+    }
+    print_sequences(out, "triples", profile->total, counts, count, 3, limit);
+
+    free(counts);
+}
+
+static int compare_counts(const void* a, const void* b)
+{
+    uint64_t x = ((const sequence_count*)a)->count;
+    uint64_t y = ((const sequence_count*)b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void print_sequences(FILE* out, const char* title, uint64_t total, sequence_count* counts, int count, int length, int limit)
+{
+    qsort(counts, count, sizeof(sequence_count), compare_counts);
+
+    fprintf(out, "-- %s --\n", title);
+    for (int i = 0; i < count && i < limit; i++) {
+        fprintf(
+            out,
+            "%12llu %6.2f%% ",
+            (unsigned long long)counts[i].count,
+            total > 0 ? 100.0 * counts[i].count / total : 0.0
+        );
+        for (int j = 0; j < length; j++) {
+            fprintf(out, " %s", clox_opcode_name(counts[i].ops[j]));
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_HAVE_SAMPLER
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#include "clox/sampler.h"
+#include "clox/vm.h"
+#include "memory.h"
+
+#define MAX_HZ 10000
+// Deeper stacks keep their innermost frames under a "[truncated]" root.
+#define MAX_DEPTH 128
+// Open-addressed, so the table is kept at most half full.
+#define STACK_SLOTS 8192
+#define MAX_STACKS (STACK_SLOTS / 2)
+#define FRAME_CAPACITY (1 << 16)
+
+typedef struct {
+    clox_obj_function* function;
+    int line;
+} sampled_frame;
+
+typedef struct {
+    // Zero marks an empty slot.
+    uint64_t count;
+    uint32_t hash;
+    uint32_t start;
+    uint16_t depth;
+    bool truncated;
+} sampled_stack;
+
+typedef struct {
+    clox_obj_function* function;
+    uint64_t self;
+    uint64_t total;
+    // Last stack that counted towards total, so recursion counts once.
+    int seen;
+} function_time;
+
+struct clox_sampler {
+    clox_vm* vm;
+    int hz;
+    bool running;
+    uint64_t samples;
+    // Taken while the VM had no frames, mostly while compiling.
+    uint64_t outside;
+    uint64_t dropped;
+    int stack_count;
+    int frame_count;
+#ifdef CLOX_HAVE_SAMPLER
+    struct sigaction previous;
+#endif
+    sampled_stack stacks[STACK_SLOTS];
+    sampled_frame frames[FRAME_CAPACITY];
+    sampled_frame scratch[MAX_DEPTH];
+};
+
+#ifdef CLOX_HAVE_SAMPLER
+// The one sampler that owns SIGPROF, claimed before its handler is
+// installed so two VMs starting at once cannot both take the signal.
+static _Atomic(clox_sampler*) active_sampler = NULL;
+
+static void handle_sigprof(int signal);
+static void record_sample(clox_sampler* sampler);
+#endif
+static const char* function_name(clox_obj_function* function);
+static function_time* find_function(function_time* times, int capacity, clox_obj_function* function);
+static int compare_times(const void* a, const void* b);
+
+bool clox_start_sampler(clox_vm* vm, int hz)
+{
+#ifdef CLOX_HAVE_SAMPLER
+    if (hz < 1 || hz > MAX_HZ || atomic_load(&active_sampler) != NULL) return false;
+
+    if (vm->sampler == NULL) {
+        vm->sampler = (clox_sampler*)calloc(1, sizeof(clox_sampler));
+        if (vm->sampler == NULL) return false;
+        vm->sampler->vm = vm;
+    }
+
+    clox_sampler* sampler = vm->sampler;
+    clox_sampler* none = NULL;
+    if (!atomic_compare_exchange_strong(&active_sampler, &none, sampler)) return false;
+    sampler->hz = hz;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigprof;
+    sigemptyset(&action.sa_mask);
+    // Samples land in the middle of reads and writes the driver makes.
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &action, &sampler->previous) != 0) {
+        atomic_store(&active_sampler, NULL);
+        return false;
+    }
+    sampler->running = true;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        clox_stop_sampler(vm);
+        return false;
+    }
+    return true;
+#else
+    (void)vm;
+    (void)hz;
+    return false;
+#endif
+}
+
+void clox_stop_sampler(clox_vm* vm)
+{
+#ifdef CLOX_HAVE_SAMPLER
+    clox_sampler* sampler = vm->sampler;
+    if (sampler == NULL || !sampler->running) return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    // A signal already pending when the timer stopped records nothing.
+    sampler->running = false;
+    atomic_signal_fence(memory_order_seq_cst);
+    sigaction(SIGPROF, &sampler->previous, NULL);
+    // Given up only once the previous handler is back, so the next VM to
+    // start saves that one and not ours.
+    atomic_store(&active_sampler, NULL);
+#else
+    (void)vm;
+#endif
+}
+
+void clox_free_sampler(clox_vm* vm)
+{
+    clox_stop_sampler(vm);
+    free(vm->sampler);
+    vm->sampler = NULL;
+}
+
+// Stacks hold on to their functions until the reports are written, even if
+// the script dropped them long before.
+void clox_mark_sampler_roots(clox_vm* vm)
+{
+    clox_sampler* sampler = vm->sampler;
+    if (sampler == NULL) return;
+
+    for (int i = 0; i < sampler->frame_count; i++) {
+        mark_object(vm, (clox_obj*)sampler->frames[i].function);
+    }
+}
+
+void clox_write_folded_stacks(clox_vm* vm, FILE* out)
+{
+    clox_sampler* sampler = vm->sampler;
+    if (sampler == NULL) return;
+
+    for (int i = 0; i < STACK_SLOTS; i++) {
+        sampled_stack* stack = &sampler->stacks[i];
+        if (stack->count == 0) continue;
+
+        if (stack->truncated) fprintf(out, "[truncated];");
+        for (int j = 0; j < stack->depth; j++) {
+            sampled_frame* frame = &sampler->frames[stack->start + j];
+            fprintf(out, "%s%s:%d", j > 0 ? ";" : "", function_name(frame->function), frame->line);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)stack->count);
+    }
+}
+
+void clox_print_sampler_summary(clox_vm* vm, FILE* out, int limit)
+{
+    clox_sampler* sampler = vm->sampler;
+    if (sampler == NULL) return;
+
+    fprintf(
+        out,
+        "== sampling profile: %llu samples at %d Hz, %llu outside Lox code, %llu dropped ==\n",
+        (unsigned long long)sampler->samples,
+        sampler->hz,
+        (unsigned long long)sampler->outside,
+        (unsigned long long)sampler->dropped
+    );
+
+    // There are no more functions than stored frames.
+    int capacity = 8;
+    while (capacity < sampler->frame_count * 2) capacity *= 2;
+    function_time* times = (function_time*)calloc(capacity, sizeof(function_time));
+    if (times == NULL) return;
+
+    for (int i = 0; i < STACK_SLOTS; i++) {
+        sampled_stack* stack = &sampler->stacks[i];
+        if (stack->count == 0) continue;
+
+        for (int j = 0; j < stack->depth; j++) {
+            function_time* time = find_function(times, capacity, sampler->frames[stack->start + j].function);
+            if (time->function == NULL) {
+                time->function = sampler->frames[stack->start + j].function;
+                time->seen = -1;
+            }
+            if (time->seen != i) {
+                time->seen = i;
+                time->total += stack->count;
+            }
+            if (j == stack->depth - 1) time->self += stack->count;
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < capacity; i++) {
+        if (times[i].function != NULL) times[count++] = times[i];
+    }
+    qsort(times, count, sizeof(function_time), compare_times);
+
+    uint64_t total = sampler->samples;
+    fprintf(out, "%12s %7s %7s  %s\n", "samples", "self", "total", "function");
+    for (int i = 0; i < count && i < limit; i++) {
+        fprintf(
+            out,
+            "%12llu %6.2f%% %6.2f%%  %s\n",
+            (unsigned long long)times[i].self,
+            total > 0 ? 100.0 * times[i].self / total : 0.0,
+            total > 0 ? 100.0 * times[i].total / total : 0.0,
+            function_name(times[i].function)
+        );
+    }
+
+    free(times);
+}
+
+#ifdef CLOX_HAVE_SAMPLER
+static void handle_sigprof(int signal)
+{
+    (void)signal;
+    int saved_errno = errno;
+    clox_sampler* sampler = atomic_load(&active_sampler);
+    if (sampler != NULL && sampler->running) record_sample(sampler);
+    errno = saved_errno;
+}
+
+// Runs in the signal handler, on the thread the VM runs on, so the frames
+// below frame_count are complete: call() fills a frame in before it counts
+// it. Only reads the VM and writes to memory allocated up front.
+static void record_sample(clox_sampler* sampler)
+{
+    clox_vm* vm = sampler->vm;
+    int frame_count = vm->frame_count;
+    sampler->samples++;
+    if (frame_count <= 0) {
+        sampler->outside++;
+        return;
+    }
+
+    int first = frame_count > MAX_DEPTH ? frame_count - MAX_DEPTH : 0;
+    int depth = frame_count - first;
+    bool truncated = first > 0;
+
+    // FNV-1a over the frames.
+    uint32_t hash = 2166136261u ^ (uint32_t)truncated;
+    for (int i = 0; i < depth; i++) {
+        clox_call_frame* frame = &vm->frames[first + i];
+        clox_obj_function* function = frame->function;
+
+        // Callers' ips point past their CALL. A tail call may have swapped
+        // the function in before the ip, so a stray offset maps to line 0.
+        ptrdiff_t offset = frame->ip - function->chunk.code - 1;
+        if (offset < 0) offset = 0;
+        int line = offset < function->chunk.count ? clox_chunk_get_line(&function->chunk, (int)offset) : 0;
+
+        sampler->scratch[i].function = function;
+        sampler->scratch[i].line = line;
+
+        uintptr_t key = (uintptr_t)function ^ ((uintptr_t)line << 1);
+        for (size_t byte = 0; byte < sizeof(key); byte++) {
+            hash ^= (uint8_t)(key >> (byte * 8));
+            hash *= 16777619u;
+        }
+    }
+
+    uint32_t index = hash & (STACK_SLOTS - 1);
+    for (;;) {
+        sampled_stack* stack = &sampler->stacks[index];
+        if (stack->count == 0) break;
+
+        if (stack->hash == hash && stack->depth == depth && stack->truncated == truncated) {
+            sampled_frame* frames = &sampler->frames[stack->start];
+            bool same = true;
+            for (int i = 0; i < depth && same; i++) {
+                same = frames[i].function == sampler->scratch[i].function
+                    && frames[i].line == sampler->scratch[i].line;
+            }
+            if (same) {
+                stack->count++;
+                return;
+            }
+        }
+        index = (index + 1) & (STACK_SLOTS - 1);
+    }
+
+    if (sampler->stack_count == MAX_STACKS || sampler->frame_count + depth > FRAME_CAPACITY) {
+        sampler->dropped++;
+        return;
+    }
+
+    sampled_stack* stack = &sampler->stacks[index];
+    memcpy(&sampler->frames[sampler->frame_count], sampler->scratch, sizeof(sampled_frame) * depth);
+    stack->hash = hash;
+    stack->start = (uint32_t)sampler->frame_count;
+    stack->depth = (uint16_t)depth;
+    stack->truncated = truncated;
+    stack->count = 1;
+    sampler->frame_count += depth;
+    sampler->stack_count++;
+}
+#endif
+
+static const char* function_name(clox_obj_function* function)
+{
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+static function_time* find_function(function_time* times, int capacity, clox_obj_function* function)
+{
+    uint32_t index = (uint32_t)(((uintptr_t)function >> 4) * 2654435761u) & (capacity - 1);
+    while (times[index].function != NULL && times[index].function != function) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &times[index];
+}
+
+static int compare_times(const void* a, const void* b)
+{
+    const function_time* x = (const function_time*)a;
+    const function_time* y = (const function_time*)b;
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    return x->total < y->total ? 1 : (x->total > y->total ? -1 : 0);
+}
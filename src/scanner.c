@@ -4,132 +4,124 @@
 #include "clox/common.h"
 #include "clox/scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} _scanner;
-
-_scanner scanner;
-
-static bool is_at_end();
-static clox_token make_token(clox_token_type type);
-static clox_token error_token(const char *message);
-static char advance();
-static bool match(char expected);
-static void skip_whitespace();
-static char peek();
-static char peek_next();
-static clox_token string();
+static bool is_at_end(clox_scanner* scanner);
+static clox_token make_token(clox_scanner* scanner, clox_token_type type);
+static clox_token error_token(clox_scanner* scanner, const char *message);
+static char advance(clox_scanner* scanner);
+static bool match(clox_scanner* scanner, char expected);
+static void skip_whitespace(clox_scanner* scanner);
+static char peek(clox_scanner* scanner);
+static char peek_next(clox_scanner* scanner);
+static clox_token string(clox_scanner* scanner);
 static bool is_digit(char c);
-static clox_token number();
+static clox_token number(clox_scanner* scanner);
 static bool is_alpha(char c);
-static clox_token identifier();
-static clox_token_type identifier_type();
-static clox_token_type check_keyword(int start, int length, const char *rest, clox_token_type type);
+static clox_token identifier(clox_scanner* scanner);
+static clox_token_type identifier_type(clox_scanner* scanner);
+static clox_token_type check_keyword(clox_scanner* scanner, int start, int length, const char *rest, clox_token_type type);
 
-void clox_init_scanner(const char *source)
+void clox_init_scanner(clox_scanner* scanner, const char *source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
-clox_token clox_scan_token()
+clox_token clox_scan_token(clox_scanner* scanner)
 {
-    skip_whitespace();
+    skip_whitespace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (is_at_end()) return make_token(CLOX_TOKEN_EOF);
+    if (is_at_end(scanner)) return make_token(scanner, CLOX_TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if (is_alpha(c)) return identifier();
-    if (is_digit(c)) return number();
+    if (is_alpha(c)) return identifier(scanner);
+    if (is_digit(c)) return number(scanner);
 
     switch (c) {
-        case '(': return make_token(CLOX_TOKEN_LEFT_PAREN);
-        case ')': return make_token(CLOX_TOKEN_RIGHT_PAREN);
-        case '{': return make_token(CLOX_TOKEN_LEFT_BRACE);
-        case '}': return make_token(CLOX_TOKEN_RIGHT_BRACE);
-        case ';': return make_token(CLOX_TOKEN_SEMICOLON);
-        case ',': return make_token(CLOX_TOKEN_COMMA);
-        case '.': return make_token(CLOX_TOKEN_DOT);
-        case '-': return make_token(CLOX_TOKEN_MINUS);
-        case '+': return make_token(CLOX_TOKEN_PLUS);
-        case '/': return make_token(CLOX_TOKEN_SLASH);
-        case '*': return make_token(CLOX_TOKEN_STAR);
+        case '(': return make_token(scanner, CLOX_TOKEN_LEFT_PAREN);
+        case ')': return make_token(scanner, CLOX_TOKEN_RIGHT_PAREN);
+        case '{': return make_token(scanner, CLOX_TOKEN_LEFT_BRACE);
+        case '}': return make_token(scanner, CLOX_TOKEN_RIGHT_BRACE);
+        case ';': return make_token(scanner, CLOX_TOKEN_SEMICOLON);
+        case ',': return make_token(scanner, CLOX_TOKEN_COMMA);
+        case '.': return make_token(scanner, CLOX_TOKEN_DOT);
+        case '-': return make_token(scanner, CLOX_TOKEN_MINUS);
+        case '+': return make_token(scanner, CLOX_TOKEN_PLUS);
+        case '/': return make_token(scanner, CLOX_TOKEN_SLASH);
+        case '*': return make_token(scanner, CLOX_TOKEN_STAR);
         case '!':
-            return make_token(match('=') ? CLOX_TOKEN_BANG_EQUAL : CLOX_TOKEN_BANG);
+            return make_token(scanner, match(scanner, '=') ? CLOX_TOKEN_BANG_EQUAL : CLOX_TOKEN_BANG);
         case '=':
-            return make_token(match('=') ? CLOX_TOKEN_EQUAL_EQUAL : CLOX_TOKEN_EQUAL);
+            return make_token(scanner, match(scanner, '=') ? CLOX_TOKEN_EQUAL_EQUAL : CLOX_TOKEN_EQUAL);
         case '<':
-            return make_token(match('=') ? CLOX_TOKEN_LESS_EQUAL : CLOX_TOKEN_LESS);
+            return make_token(scanner, match(scanner, '=') ? CLOX_TOKEN_LESS_EQUAL : CLOX_TOKEN_LESS);
         case '>':
-            return make_token(match('=') ? CLOX_TOKEN_GREATER_EQUAL : CLOX_TOKEN_GREATER);
-        case '"': return string();
+            return make_token(scanner, match(scanner, '=') ? CLOX_TOKEN_GREATER_EQUAL : CLOX_TOKEN_GREATER);
+        case '"': return string(scanner);
     }
 
-    return error_token("Unexpected character.");
+    return error_token(scanner, "Unexpected character.");
 }
 
-static bool is_at_end()
+static bool is_at_end(clox_scanner* scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-static clox_token make_token(clox_token_type type)
+static clox_token make_token(clox_scanner* scanner, clox_token_type type)
 {
     clox_token result;
     result.type = type;
-    result.start = scanner.start;
-    result.length = (int)(scanner.current - scanner.start);
-    result.line = scanner.line;
+    result.start = scanner->start;
+    result.length = (int)(scanner->current - scanner->start);
+    result.line = scanner->line;
     return result;
 }
 
-static clox_token error_token(const char *message)
+static clox_token error_token(clox_scanner* scanner, const char *message)
 {
     clox_token result;
     result.type = CLOX_TOKEN_ERROR;
     result.start = message;
     result.length = (int)strlen(message);
-    result.line = scanner.line;
+    result.line = scanner->line;
     return result;
 }
 
-static char advance()
+static char advance(clox_scanner* scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static bool match(char expected)
+static bool match(clox_scanner* scanner, char expected)
 {
-    if (is_at_end()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+    if (is_at_end(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
-static void skip_whitespace()
+static void skip_whitespace(clox_scanner* scanner)
 {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             case '/':
-                if (peek_next()) {
-                    while (peek() != '\n' && !is_at_end()) advance();
+                if (peek_next(scanner) == '/') {
+                    while (peek(scanner) != '\n' && !is_at_end(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -140,28 +132,28 @@ static void skip_whitespace()
     }
 }
 
-static char peek()
+static char peek(clox_scanner* scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peek_next()
+static char peek_next(clox_scanner* scanner)
 {
-    if (is_at_end()) return '\0';
-    return scanner.current[1];
+    if (is_at_end(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static clox_token string()
+static clox_token string(clox_scanner* scanner)
 {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+    while (peek(scanner) != '"' && !is_at_end(scanner)) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (is_at_end()) return error_token("Unterminated string.");
+    if (is_at_end(scanner)) return error_token(scanner, "Unterminated string.");
 
-    advance();
-    return make_token(CLOX_TOKEN_STRING);
+    advance(scanner);
+    return make_token(scanner, CLOX_TOKEN_STRING);
 }
 
 static bool is_digit(char c)
@@ -169,16 +161,16 @@ static bool is_digit(char c)
     return c >= '0' && c <= '9';
 }
 
-static clox_token number()
+static clox_token number(clox_scanner* scanner)
 {
-    while (is_digit(peek())) advance();
+    while (is_digit(peek(scanner))) advance(scanner);
 
-    if (peek() == '.' && is_digit(peek_next())) {
-        advance();
-        while (is_digit(peek())) advance();
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
+        advance(scanner);
+        while (is_digit(peek(scanner))) advance(scanner);
     }
 
-    return make_token(CLOX_TOKEN_NUMBER);
+    return make_token(scanner, CLOX_TOKEN_NUMBER);
 }
 
 static bool is_alpha(char c)
@@ -188,40 +180,40 @@ static bool is_alpha(char c)
             c == '_';
 }
 
-static clox_token identifier()
+static clox_token identifier(clox_scanner* scanner)
 {
-    while (is_alpha(peek()) || is_digit(peek())) advance();
-    return make_token(identifier_type());
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner))) advance(scanner);
+    return make_token(scanner, identifier_type(scanner));
 }
 
-static clox_token_type identifier_type()
+static clox_token_type identifier_type(clox_scanner* scanner)
 {
-    switch (scanner.start[0]) {
-        case 'a': return check_keyword(1, 2, "nd", CLOX_TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass", CLOX_TOKEN_CLASS);
-        case 'e': return check_keyword(1, 3, "lse", CLOX_TOKEN_ELSE);
-        case 'i': return check_keyword(1, 1, "f", CLOX_TOKEN_IF);
-        case 'n': return check_keyword(1, 2, "il", CLOX_TOKEN_NIL);
-        case 'o': return check_keyword(1, 1, "r", CLOX_TOKEN_OR);
-        case 'p': return check_keyword(1, 4, "rint", CLOX_TOKEN_PRINT);
-        case 'r': return check_keyword(1, 5, "eturn", CLOX_TOKEN_RETURN);
-        case 's': return check_keyword(1, 4, "uper", CLOX_TOKEN_SUPER);
-        case 'v': return check_keyword(1, 2, "ar", CLOX_TOKEN_VAR);
-        case 'w': return check_keyword(1, 4, "hile", CLOX_TOKEN_WHILE);
+    switch (scanner->start[0]) {
+        case 'a': return check_keyword(scanner, 1, 2, "nd", CLOX_TOKEN_AND);
+        case 'c': return check_keyword(scanner, 1, 4, "lass", CLOX_TOKEN_CLASS);
+        case 'e': return check_keyword(scanner, 1, 3, "lse", CLOX_TOKEN_ELSE);
+        case 'i': return check_keyword(scanner, 1, 1, "f", CLOX_TOKEN_IF);
+        case 'n': return check_keyword(scanner, 1, 2, "il", CLOX_TOKEN_NIL);
+        case 'o': return check_keyword(scanner, 1, 1, "r", CLOX_TOKEN_OR);
+        case 'p': return check_keyword(scanner, 1, 4, "rint", CLOX_TOKEN_PRINT);
+        case 'r': return check_keyword(scanner, 1, 5, "eturn", CLOX_TOKEN_RETURN);
+        case 's': return check_keyword(scanner, 1, 4, "uper", CLOX_TOKEN_SUPER);
+        case 'v': return check_keyword(scanner, 1, 2, "ar", CLOX_TOKEN_VAR);
+        case 'w': return check_keyword(scanner, 1, 4, "hile", CLOX_TOKEN_WHILE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return check_keyword(2, 3, "lse", CLOX_TOKEN_FALSE);
-                    case 'o': return check_keyword(2, 1, "r", CLOX_TOKEN_FOR);
-                    case 'u': return check_keyword(2, 1, "n", CLOX_TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return check_keyword(scanner, 2, 3, "lse", CLOX_TOKEN_FALSE);
+                    case 'o': return check_keyword(scanner, 2, 1, "r", CLOX_TOKEN_FOR);
+                    case 'u': return check_keyword(scanner, 2, 1, "n", CLOX_TOKEN_FUN);
                 }
             }
             break;
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'r': return check_keyword(2, 2, "ue", CLOX_TOKEN_TRUE);
-                    case 'h': return check_keyword(2, 2, "is", CLOX_TOKEN_THIS);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'r': return check_keyword(scanner, 2, 2, "ue", CLOX_TOKEN_TRUE);
+                    case 'h': return check_keyword(scanner, 2, 2, "is", CLOX_TOKEN_THIS);
                 }
             }
             break;
@@ -230,9 +222,9 @@ static clox_token_type identifier_type()
     return CLOX_TOKEN_IDENTIFIER;
 }
 
-static clox_token_type check_keyword(int start, int length, const char *rest, clox_token_type type)
+static clox_token_type check_keyword(clox_scanner* scanner, int start, int length, const char *rest, clox_token_type type)
 {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
+    if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
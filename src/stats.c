@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox/stats.h"
+#include "clox/debug.h"
+#include "memory.h"
+
+#ifdef CLOX_STATS
+static int compare_functions(const void* a, const void* b);
+#endif
+
+bool clox_has_stats()
+{
+#ifdef CLOX_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool clox_write_stats(clox_vm* vm, FILE* out)
+{
+#ifdef CLOX_STATS
+    clox_stats* stats = vm->stats;
+
+    int count = 0;
+    uint64_t calls = 0;
+    uint64_t instructions = 0;
+    uint64_t bytes_allocated = stats->compiler_bytes;
+    for (clox_function_stats* function = stats->functions; function != NULL; function = function->next) {
+        count++;
+        calls += function->calls;
+        instructions += function->instructions;
+        bytes_allocated += function->bytes_allocated;
+    }
+
+    clox_function_stats** functions = (clox_function_stats**)malloc(sizeof(clox_function_stats*) * (count + 1));
+    if (functions == NULL) return false;
+    count = 0;
+    for (clox_function_stats* function = stats->functions; function != NULL; function = function->next) {
+        functions[count++] = function;
+    }
+    qsort(functions, count, sizeof(clox_function_stats*), compare_functions);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"calls\": %llu,\n", (unsigned long long)calls);
+    fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)instructions);
+    fprintf(out, "  \"bytes_allocated\": %llu,\n", (unsigned long long)bytes_allocated);
+    fprintf(out, "  \"compiler_bytes_allocated\": %llu,\n", (unsigned long long)stats->compiler_bytes);
+
+    fprintf(out, "  \"opcodes\": {");
+    bool first = true;
+    for (int op = 0; op < CLOX_OP_COUNT; op++) {
+        if (stats->opcodes[op] == 0) continue;
+        fprintf(out, "%s\n    \"%s\": %llu", first ? "" : ",", clox_opcode_name(op), (unsigned long long)stats->opcodes[op]);
+        first = false;
+    }
+    fprintf(out, "%s},\n", first ? "" : "\n  ");
+
+    // Lox identifiers never need escaping.
+    fprintf(out, "  \"functions\": [");
+    for (int i = 0; i < count; i++) {
+        fprintf(
+            out,
+            "%s\n    {\"name\": \"%s\", \"line\": %d, \"calls\": %llu, \"instructions\": %llu, \"bytes_allocated\": %llu}",
+            i > 0 ? "," : "",
+            functions[i]->name,
+            functions[i]->line,
+            (unsigned long long)functions[i]->calls,
+            (unsigned long long)functions[i]->instructions,
+            (unsigned long long)functions[i]->bytes_allocated
+        );
+    }
+    fprintf(out, "%s]\n}\n", count > 0 ? "\n  " : "");
+
+    free(functions);
+    return !ferror(out);
+#else
+    (void)vm;
+    (void)out;
+    return false;
+#endif
+}
+
+#ifdef CLOX_STATS
+clox_stats* clox_new_stats()
+{
+    return (clox_stats*)calloc(1, sizeof(clox_stats));
+}
+
+void clox_free_stats(clox_vm* vm, clox_stats* stats)
+{
+    if (stats == NULL) return;
+
+    clox_function_stats* function = stats->functions;
+    while (function != NULL) {
+        clox_function_stats* next = function->next;
+        FREE_ARRAY(vm, char, function, sizeof(clox_function_stats) + strlen(function->name) + 1, CLOX_ALLOC_STATS);
+        function = next;
+    }
+    free(stats);
+}
+
+// Inside clox_interpret_*() running out of memory here stops the script like
+// any other allocation.
+clox_function_stats* clox_new_function_stats(clox_vm* vm, clox_obj_function* function)
+{
+    const char* name = function->name == NULL ? "script" : function->name->chars;
+    size_t length = strlen(name);
+    char* block = ALLOCATE(vm, char, sizeof(clox_function_stats) + length + 1, CLOX_ALLOC_STATS);
+    clox_function_stats* stats = (clox_function_stats*)block;
+    memset(stats, 0, sizeof(clox_function_stats));
+
+    stats->name = block + sizeof(clox_function_stats);
+    memcpy(stats->name, name, length + 1);
+    stats->line = clox_chunk_get_line(&function->chunk, 0);
+    stats->next = vm->stats->functions;
+    vm->stats->functions = stats;
+    function->stats = stats;
+    return stats;
+}
+
+clox_value clox_vmstats_native(clox_vm* vm, int arg_count, clox_value* args)
+{
+    (void)arg_count;
+    (void)args;
+
+    clox_obj_string* report = clox_string_from_report(vm, clox_write_stats);
+    return report == NULL ? CLOX_NIL_VAL : CLOX_OBJ_VAL(report);
+}
+
+// Most instructions first.
+static int compare_functions(const void* a, const void* b)
+{
+    const clox_function_stats* x = *(const clox_function_stats* const*)a;
+    const clox_function_stats* y = *(const clox_function_stats* const*)b;
+    if (x->instructions != y->instructions) return x->instructions < y->instructions ? 1 : -1;
+    return x->calls < y->calls ? 1 : (x->calls > y->calls ? -1 : 0);
+}
+#endif
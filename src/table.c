@@ -1,143 +1,423 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "clox/object.h"
 #include "clox/table.h"
 #include "clox/value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define GROUP CLOX_TABLE_GROUP
+
+// Control bytes. A live slot holds the low 7 bits of its key's hash, so only
+// the markers have the high bit set.
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xFE)
+
+// At most 7/8 of the slots are live or deleted, so every probe sequence
+// reaches an empty slot.
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
 
-static clox_entry* find_entry(clox_entry* entries, int capacity, clox_obj_string* key);
-static void adjust_capacity(clox_table* table, int capacity);
+// Old slots moved per insert or lookup while an incremental table resizes.
+// Moving them all takes old capacity / MIGRATE_SLOTS inserts, fewer than the
+// new arrays have room for even when the resize only drops tombstones.
+#define MIGRATE_SLOTS 8
+
+#ifdef __GNUC__
+#define TRAILING_ZEROS(mask) __builtin_ctz(mask)
+#define LEADING_ZEROS(mask) (__builtin_clz(mask) - (32 - GROUP))
+#else
+static int TRAILING_ZEROS(uint32_t mask);
+static int LEADING_ZEROS(uint32_t mask);
+#endif
+
+static inline uint32_t hash_position(uint32_t hash);
+static inline uint8_t hash_control(uint32_t hash);
+static inline uint32_t match_byte(const uint8_t* group, uint8_t byte);
+static inline uint32_t match_empty(const uint8_t* group);
+static inline uint32_t match_free(const uint8_t* group);
+static int find_index(uint8_t* control, clox_entry* entries, int capacity, clox_obj_string* key);
+static int find_slot(clox_table* table, clox_obj_string* key, int* free);
+static int find_free(uint8_t* control, int capacity, uint32_t hash);
+static void set_control(uint8_t* control, int capacity, int index, uint8_t value);
+static void erase(clox_table* table, int index);
+static void erase_old(clox_table* table, int index);
+static void resize(clox_vm* vm, clox_table* table, int capacity);
+static void migrate(clox_table* table, int slots);
+static void finish_migration(clox_vm* vm, clox_table* table);
+static void free_arrays(clox_vm* vm, clox_entry* entries, int capacity);
+static size_t table_size(int capacity);
 
 void clox_init_table(clox_table* table)
 {
     table->count = 0;
     table->capacity = 0;
+    table->growth_left = 0;
+    table->control = NULL;
     table->entries = NULL;
+    table->old_count = 0;
+    table->old_capacity = 0;
+    table->migrated = 0;
+    table->old_control = NULL;
+    table->old_entries = NULL;
+    table->incremental = true;
 }
 
-void clox_free_table(clox_table* table) {
-    FREE_ARRAY(clox_entry, table->entries, table->capacity);
+void clox_free_table(clox_vm* vm, clox_table* table) {
+    bool incremental = table->incremental;
+    free_arrays(vm, table->old_entries, table->old_capacity);
+    free_arrays(vm, table->entries, table->capacity);
     clox_init_table(table);
+    table->incremental = incremental;
 }
 
 bool clox_table_get(clox_table* table, clox_obj_string* key, clox_value* out_value)
 {
     if (table->count == 0) return false;
+    if (table->old_count > 0) migrate(table, MIGRATE_SLOTS);
 
-    clox_entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = find_index(table->control, table->entries, table->capacity, key);
+    if (index >= 0) {
+        *out_value = table->entries[index].value;
+        return true;
+    }
+    if (table->old_count > 0) {
+        index = find_index(table->old_control, table->old_entries, table->old_capacity, key);
+        if (index >= 0) {
+            *out_value = table->old_entries[index].value;
+            return true;
+        }
+    }
 
-    *out_value = entry->value;
-    return true; 
+    return false;
 }
 
-bool clox_table_set(clox_table* table, clox_obj_string* key, clox_value value)
+bool clox_table_set(clox_vm* vm, clox_table* table, clox_obj_string* key, clox_value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+    if (table->old_capacity > 0) {
+        migrate(table, MIGRATE_SLOTS);
+        if (table->old_count == 0) finish_migration(vm, table);
+    }
+
+    int index = -1;
+    if (table->capacity > 0) {
+        int existing = find_slot(table, key, &index);
+        if (existing >= 0) {
+            table->entries[existing].value = value;
+            return false;
+        }
+    }
+    if (table->old_count > 0) {
+        int existing = find_index(table->old_control, table->old_entries, table->old_capacity, key);
+        if (existing >= 0) {
+            table->old_entries[existing].value = value;
+            return false;
+        }
     }
 
-    clox_entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    
-    if (is_new_key && CLOX_IS_NIL(entry->value)) table->count++;
+    // A deleted slot can always be reused; taking an empty one needs room.
+    if (index < 0 || (table->growth_left == 0 && table->control[index] == CONTROL_EMPTY)) {
+        finish_migration(vm, table);
+
+        // Mostly tombstones: rebuild at the same size to drop them.
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = GROUP;
+        } else if (table->count + 1 > MAX_LOAD(capacity) / 2) {
+            capacity *= 2;
+        }
+        resize(vm, table, capacity);
+        if (!table->incremental) finish_migration(vm, table);
+        index = find_free(table->control, table->capacity, key->hash);
+    }
 
-    entry->key = key;
-    entry->value = value;
+    if (table->control[index] == CONTROL_EMPTY) table->growth_left--;
+    set_control(table->control, table->capacity, index, hash_control(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
 
-    return is_new_key;
+    return true;
 }
 
 bool clox_table_delete(clox_table* table, clox_obj_string* key)
 {
     if (table->count == 0) return false;
 
-    clox_entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->value = CLOX_BOOL_VAL(true);
+    int index = find_index(table->control, table->entries, table->capacity, key);
+    if (index >= 0) {
+        erase(table, index);
+        return true;
+    }
+    if (table->old_count > 0) {
+        index = find_index(table->old_control, table->old_entries, table->old_capacity, key);
+        if (index >= 0) {
+            erase_old(table, index);
+            return true;
+        }
+    }
 
-    return true;
+    return false;
 }
 
-void clox_table_add_all(clox_table* from, clox_table* to)
+void clox_table_add_all(clox_vm* vm, clox_table* from, clox_table* to)
 {
+    for (int i = 0; i < from->old_capacity; i++) {
+        clox_entry* entry = &from->old_entries[i];
+        if (CLOX_TABLE_IS_LIVE(from->old_control[i])) {
+            clox_table_set(vm, to, entry->key, entry->value);
+        }
+    }
     for (int i = 0; i < from->capacity; i++) {
         clox_entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            clox_table_set(to, entry->key, entry->value);
+        if (CLOX_TABLE_IS_LIVE(from->control[i])) {
+            clox_table_set(vm, to, entry->key, entry->value);
         }
     }
 }
 
-clox_obj_string* clox_table_find_string(clox_table* table, const char* chars, int length, uint32_t hash)
+// Groups are visited at triangular offsets, which covers every group of a
+// power-of-two table once.
+static int find_index(uint8_t* control, clox_entry* entries, int capacity, clox_obj_string* key)
 {
-    if (table->count == 0) return NULL;
+    if (capacity == 0) return -1;
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        clox_entry* entry = &table->entries[index];
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t position = hash_position(key->hash) & mask;
+    uint8_t byte = hash_control(key->hash);
 
-        if (entry->key == NULL) {
-            if (CLOX_IS_NIL(entry->value)) return NULL;
-        } else if (
-            entry->key->length == length 
-            && entry->key->hash == hash 
-            && memcmp(entry->key->chars, chars, length) == 0
-        ) {
-            return entry->key;
+    for (uint32_t step = GROUP;; step += GROUP) {
+        const uint8_t* group = &control[position];
+
+        for (uint32_t match = match_byte(group, byte); match != 0; match &= match - 1) {
+            uint32_t index = (position + TRAILING_ZEROS(match)) & mask;
+            if (entries[index].key == key) return (int)index;
         }
+        if (match_empty(group) != 0) return -1;
+
+        position = (position + step) & mask;
     }
 }
 
-static clox_entry* find_entry(clox_entry* entries, int capacity, clox_obj_string* key)
+// find_index() on the current arrays for inserts: also stores the first
+// empty or deleted slot the probe passed, where the key would go if it is
+// missing.
+static int find_slot(clox_table* table, clox_obj_string* key, int* free)
 {
-    uint32_t index = key->hash % capacity;
-    clox_entry* tombstone = NULL;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = hash_position(key->hash) & mask;
+    uint8_t control = hash_control(key->hash);
+
+    *free = -1;
+    for (uint32_t step = GROUP;; step += GROUP) {
+        const uint8_t* group = &table->control[position];
 
-    for (;;) {
-        clox_entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (CLOX_IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+        for (uint32_t match = match_byte(group, control); match != 0; match &= match - 1) {
+            uint32_t index = (position + TRAILING_ZEROS(match)) & mask;
+            if (table->entries[index].key == key) return (int)index;
         }
+        if (*free < 0) {
+            uint32_t match = match_free(group);
+            if (match != 0) *free = (int)((position + TRAILING_ZEROS(match)) & mask);
+        }
+        if (match_empty(group) != 0) return -1;
 
-        index = (index + 1) % capacity;
+        position = (position + step) & mask;
     }
 }
 
-static void adjust_capacity(clox_table* table, int capacity)
+// The first empty or deleted slot on the key's probe sequence.
+static int find_free(uint8_t* control, int capacity, uint32_t hash)
 {
-    clox_entry* entries = ALLOCATE(clox_entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = CLOX_NIL_VAL;
-    }
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t position = hash_position(hash) & mask;
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        clox_entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+    for (uint32_t step = GROUP;; step += GROUP) {
+        uint32_t match = match_free(&control[position]);
+        if (match != 0) return (int)((position + TRAILING_ZEROS(match)) & mask);
 
-        clox_entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        position = (position + step) & mask;
     }
+}
+
+// Also updates the copy of the first group after the last slot.
+static void set_control(uint8_t* control, int capacity, int index, uint8_t value)
+{
+    control[index] = value;
+    control[((index - GROUP) & (capacity - 1)) + GROUP] = value;
+}
 
-    FREE_ARRAY(clox_entry, table->entries, table->capacity);
+// A lookup stops at the first group with an empty slot. If no group that
+// contains this slot was ever full, no lookup probed past it and it can go
+// back to empty; otherwise it must stay a tombstone until the next rehash.
+static void erase(clox_table* table, int index)
+{
+    int before = (index - GROUP) & (table->capacity - 1);
+    uint32_t empty_before = match_empty(&table->control[before]);
+    uint32_t empty_after = match_empty(&table->control[index]);
+    bool was_never_full = empty_before != 0
+        && empty_after != 0
+        && LEADING_ZEROS(empty_before) + TRAILING_ZEROS(empty_after) < GROUP;
 
-    table->entries = entries;
+    set_control(table->control, table->capacity, index, was_never_full ? CONTROL_EMPTY : CONTROL_DELETED);
+    if (was_never_full) table->growth_left++;
+    table->count--;
+}
+
+// The old arrays only shrink, so a tombstone is always good enough.
+static void erase_old(clox_table* table, int index)
+{
+    set_control(table->old_control, table->old_capacity, index, CONTROL_DELETED);
+    table->old_count--;
+    table->count--;
+}
+
+// Allocates new arrays and makes the current ones the old arrays, with
+// their live entries still to be moved. Only the control bytes are cleared;
+// the pages of a large block of entries are faulted in as slots fill up. The
+// table is left alone until the allocation succeeded, since it may collect
+// garbage or fail.
+static void resize(clox_vm* vm, clox_table* table, int capacity)
+{
+    clox_entry* entries = (clox_entry*)ALLOCATE(vm, uint8_t, table_size(capacity), CLOX_ALLOC_TABLE);
+    uint8_t* control = (uint8_t*)(entries + capacity);
+    memset(control, CONTROL_EMPTY, capacity + GROUP);
+
+    table->old_count = table->count;
+    table->old_capacity = table->capacity;
+    table->migrated = 0;
+    table->old_control = table->control;
+    table->old_entries = table->entries;
+
+    // Room for every old entry is set aside up front.
     table->capacity = capacity;
+    table->growth_left = MAX_LOAD(capacity) - table->count;
+    table->control = control;
+    table->entries = entries;
 }
 
+// Moves the live entries of the next old slots into the current arrays.
+// Their slots were set aside by resize(), so growth_left stays.
+static void migrate(clox_table* table, int slots)
+{
+    int end = table->migrated + slots;
+    if (end > table->old_capacity) end = table->old_capacity;
+
+    for (int i = table->migrated; i < end && table->old_count > 0; i++) {
+        if (!CLOX_TABLE_IS_LIVE(table->old_control[i])) continue;
+
+        clox_entry* entry = &table->old_entries[i];
+        int index = find_free(table->control, table->capacity, entry->key->hash);
+        set_control(table->control, table->capacity, index, hash_control(entry->key->hash));
+        table->entries[index] = *entry;
+
+        set_control(table->old_control, table->old_capacity, i, CONTROL_DELETED);
+        table->old_count--;
+    }
+    table->migrated = end;
+}
+
+// Moves whatever is left and frees the old arrays. Lookups cannot free
+// them, having no VM, so an emptied old block waits for the next insert.
+static void finish_migration(clox_vm* vm, clox_table* table)
+{
+    if (table->old_capacity == 0) return;
+
+    migrate(table, table->old_capacity);
+    free_arrays(vm, table->old_entries, table->old_capacity);
+
+    table->old_count = 0;
+    table->old_capacity = 0;
+    table->migrated = 0;
+    table->old_control = NULL;
+    table->old_entries = NULL;
+}
+
+static void free_arrays(clox_vm* vm, clox_entry* entries, int capacity)
+{
+    if (capacity > 0) FREE_ARRAY(vm, uint8_t, entries, table_size(capacity), CLOX_ALLOC_TABLE);
+}
+
+// Entries and control bytes share one block.
+static size_t table_size(int capacity)
+{
+    return sizeof(clox_entry) * capacity + capacity + GROUP;
+}
+
+static inline uint32_t hash_position(uint32_t hash)
+{
+    return hash >> 7;
+}
+
+static inline uint8_t hash_control(uint32_t hash)
+{
+    return hash & 0x7F;
+}
+
+// The match functions return one bit per slot of the group, lowest slot in
+// the lowest bit.
+#ifdef __SSE2__
+static inline uint32_t match_byte(const uint8_t* group, uint8_t byte)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+}
+
+static inline uint32_t match_empty(const uint8_t* group)
+{
+    return match_byte(group, CONTROL_EMPTY);
+}
+
+// Empty or deleted: the markers are the only bytes with the high bit set.
+static inline uint32_t match_free(const uint8_t* group)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t match_byte(const uint8_t* group, uint8_t byte)
+{
+    uint32_t match = 0;
+    for (int i = 0; i < GROUP; i++) {
+        if (group[i] == byte) match |= 1u << i;
+    }
+    return match;
+}
+
+static inline uint32_t match_empty(const uint8_t* group)
+{
+    return match_byte(group, CONTROL_EMPTY);
+}
+
+static inline uint32_t match_free(const uint8_t* group)
+{
+    uint32_t match = 0;
+    for (int i = 0; i < GROUP; i++) {
+        if (group[i] & 0x80) match |= 1u << i;
+    }
+    return match;
+}
+#endif
+
+#ifndef __GNUC__
+static int TRAILING_ZEROS(uint32_t mask)
+{
+    int count = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        count++;
+    }
+    return count;
+}
+
+static int LEADING_ZEROS(uint32_t mask)
+{
+    int count = 0;
+    for (uint32_t bit = 1u << (GROUP - 1); (mask & bit) == 0; bit >>= 1) {
+        count++;
+    }
+    return count;
+}
+#endif
@@ -13,47 +13,137 @@ void clox_init_value_array(clox_value_array *array)
     array->values = NULL;
 }
 
-void clox_write_value_array(clox_value_array *array, clox_value value)
+void clox_write_value_array(clox_vm* vm, clox_value_array *array, clox_value value, clox_alloc_kind kind)
 {
-    if (array->capacity < array->count + 1) {
-        int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(clox_value, array->values, old_capacity, array->capacity);
-    }
-
+    clox_reserve_value_array(vm, array, 1, kind);
     array->values[array->count] = value;
     array->count++;
 }
 
-void clox_free_value_array(clox_value_array *array)
+void clox_reserve_value_array(clox_vm* vm, clox_value_array *array, int count, clox_alloc_kind kind)
+{
+    if (array->capacity >= array->count + count) return;
+
+    int capacity = array->capacity;
+    while (capacity < array->count + count) capacity = GROW_CAPACITY(capacity);
+    array->values = GROW_ARRAY(vm, clox_value, array->values, array->capacity, capacity, kind);
+    array->capacity = capacity;
+}
+
+void clox_free_value_array(clox_vm* vm, clox_value_array *array, clox_alloc_kind kind)
 {
-    FREE_ARRAY(clox_value, array->values, array->capacity);
+    FREE_ARRAY(vm, clox_value, array->values, array->capacity, kind);
     clox_init_value_array(array);
 }
 
-void clox_print_value(clox_value value)
+void clox_print_value(FILE* out, clox_value value)
 {
+#ifdef CLOX_NAN_BOXING
+    if (CLOX_IS_BOOL(value)) {
+        fputs(CLOX_AS_BOOL(value) ? "true" : "false", out);
+    } else if (CLOX_IS_NIL(value)) {
+        fputs("nil", out);
+    } else if (CLOX_IS_NUMBER(value)) {
+        fprintf(out, "%g", CLOX_AS_NUMBER(value));
+    } else if (CLOX_IS_OBJ(value)) {
+        clox_print_object(out, value);
+    } else if (CLOX_IS_UNDEFINED(value)) {
+        fputs("undefined", out);
+    }
+#else
     switch (value.type) {
         case CLOX_VAL_BOOL:
-            printf(CLOX_AS_BOOL(value) ? "true" : "false");
+            fputs(CLOX_AS_BOOL(value) ? "true" : "false", out);
             break;
-        case CLOX_VAL_NIL: printf("nil"); break;
+        case CLOX_VAL_NIL: fputs("nil", out); break;
         case CLOX_VAL_NUMBER: 
-            printf("%g", CLOX_AS_NUMBER(value));
+            fprintf(out, "%g", CLOX_AS_NUMBER(value));
             break;
-        case CLOX_VAL_OBJ: clox_print_object(value); break;
+        case CLOX_VAL_OBJ: clox_print_object(out, value); break;
+        case CLOX_VAL_UNDEFINED: fputs("undefined", out); break;
     }
+#endif
+}
+
+// Whether string[start, start + length) holds chars, for a string that may
+// be an unflattened rope. A range that lies in one operand narrows to it,
+// and one that spans both is split there, with the shorter part checked by
+// recursion so the depth stays logarithmic. Every node is visited once.
+static bool range_equal(const clox_obj_string* string, int start, const char* chars, int length)
+{
+    for (;;) {
+        if (length == 0) return true;
+        if (string->chars != NULL) return memcmp(string->chars + start, chars, length) == 0;
+
+        const clox_obj_rope* rope = (const clox_obj_rope*)string;
+        int split = rope->left->length;
+        if (start + length <= split) {
+            string = rope->left;
+        } else if (start >= split) {
+            string = rope->right;
+            start -= split;
+        } else {
+            int head = split - start;
+            if (head <= length - head) {
+                if (!range_equal(rope->left, start, chars, head)) return false;
+                string = rope->right;
+                start = 0;
+                chars += head;
+                length -= head;
+            } else {
+                if (!range_equal(rope->right, 0, chars + head, length - head)) return false;
+                string = rope->left;
+                length = head;
+            }
+        }
+    }
+}
+
+// Two interned strings are only equal if they are the same object. Any
+// other pair is compared by length, by hash when both have one, and then
+// by characters. There is no VM to flatten ropes with here: when both are
+// unflattened, y is copied out a window at a time, the way printing does.
+// The VM flattens its operands first, so only embedders get here.
+static bool strings_equal(clox_obj* a, clox_obj* b)
+{
+    if (a->type != CLOX_OBJ_STRING || b->type != CLOX_OBJ_STRING) return false;
+
+    clox_obj_string* x = (clox_obj_string*)a;
+    clox_obj_string* y = (clox_obj_string*)b;
+    if (x->is_interned && y->is_interned) return false;
+    if (x->length != y->length) return false;
+    if (x->hash != 0 && y->hash != 0 && x->hash != y->hash) return false;
+    if (x->chars != NULL) return range_equal(y, 0, x->chars, x->length);
+    if (y->chars != NULL) return range_equal(x, 0, y->chars, y->length);
+
+    char window[CLOX_ROPE_WINDOW];
+    for (int start = 0; start < y->length; start += CLOX_ROPE_WINDOW) {
+        int length = y->length - start < CLOX_ROPE_WINDOW ? y->length - start : CLOX_ROPE_WINDOW;
+        clox_copy_range(y, start, length, window);
+        if (!range_equal(x, start, window, length)) return false;
+    }
+    return true;
 }
 
 bool clox_value_equal(clox_value a, clox_value b)
 {
-    
+#ifdef CLOX_NAN_BOXING
+    // Numbers and strings need more than a bit compare: NaN != NaN, 0 == -0,
+    // and equal strings may be different objects.
+    if (CLOX_IS_NUMBER(a) && CLOX_IS_NUMBER(b)) {
+        return CLOX_AS_NUMBER(a) == CLOX_AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return CLOX_IS_OBJ(a) && CLOX_IS_OBJ(b) && strings_equal(CLOX_AS_OBJ(a), CLOX_AS_OBJ(b));
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case CLOX_VAL_BOOL: return CLOX_AS_BOOL(a) == CLOX_AS_BOOL(b);
         case CLOX_VAL_NIL: return true;
         case CLOX_VAL_NUMBER: return CLOX_AS_NUMBER(a) == CLOX_AS_NUMBER(b);
-        case CLOX_VAL_OBJ: return CLOX_AS_OBJ(a) == CLOX_AS_OBJ(b);
+        case CLOX_VAL_OBJ: return CLOX_AS_OBJ(a) == CLOX_AS_OBJ(b) || strings_equal(CLOX_AS_OBJ(a), CLOX_AS_OBJ(b));
+        case CLOX_VAL_UNDEFINED: return true;
         default: return false;
     }
+#endif
 }
@@ -1,286 +1,927 @@
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "clox/common.h"
 #include "clox/vm.h"
+#include "clox/bytecode.h"
 #include "clox/debug.h"
 #include "clox/compiler.h"
 #include "clox/value.h"
 #include "clox/object.h"
+#include "clox/profile.h"
+#include "clox/sampler.h"
+#include "clox/stats.h"
+#include "clox/jit.h"
 #include "memory.h"
 
-clox_vm clox_vm_instance;
+#if defined(CLOX_COMPUTED_GOTO) && !defined(__GNUC__)
+#undef CLOX_COMPUTED_GOTO
+#endif
 
-static void reset_stack();
-static clox_interpret_result run();
-static void runtime_error(const char *format, ...);
+static void reset_stack(clox_vm* vm);
+static bool map_stacks(clox_vm* vm, int frame_max);
+static void unmap_stacks(clox_call_frame* frames, clox_value* stack, int frame_max);
+static clox_interpret_result interpret(clox_vm* vm, const char* source, const char* cache_path, clox_obj_function* function);
+static clox_obj_function* load_script(clox_vm* vm, const char* source, const char* cache_path);
+static clox_interpret_result run_script(clox_vm* vm, clox_obj_function* function);
+static clox_interpret_result run(clox_vm* vm, int base_frame);
+static void runtime_error(clox_vm* vm, const char *format, ...);
 static bool is_falsey(clox_value value);
-static void concatenate();
-static bool call_value(clox_value callee, int args_count);
-static bool call(clox_obj_function* function, int arg_count);
-static clox_value clock_native(int arg_count, clox_value* args);
-static void define_native_function(const char* name, clox_native_fn function);
+static bool concatenate(clox_vm* vm);
+static bool call_value(clox_vm* vm, clox_value callee, int args_count);
+static bool call(clox_vm* vm, clox_obj_function* function, int arg_count);
+static clox_tail_call_result tail_call(clox_vm* vm, clox_call_frame* frame, int arg_count);
+static clox_value clock_native(clox_vm* vm, int arg_count, clox_value* args);
+static clox_value heapstats_native(clox_vm* vm, int arg_count, clox_value* args);
+#ifdef CLOX_DEBUG_TRACE_EXECUTION
+static void trace_instruction(clox_vm* vm, clox_call_frame* frame);
+#endif
+static void define_native_function(clox_vm* vm, const char* name, clox_native_fn function);
+
+clox_interpret_result clox_runtime_call(clox_vm* vm, int arg_count)
+{
+    int base_frame = vm->frame_count;
+    if (!call_value(vm, clox_stack_peek(vm, arg_count), arg_count)) {
+        return CLOX_INTERPRET_RUNTIME_ERROR;
+    }
+    if (vm->frame_count == base_frame) return CLOX_INTERPRET_OK;
+    return clox_runtime_resume(vm);
+}
+
+clox_tail_call_result clox_runtime_tail_call(clox_vm* vm, int arg_count)
+{
+    return tail_call(vm, &vm->frames[vm->frame_count - 1], arg_count);
+}
+
+clox_interpret_result clox_runtime_resume(clox_vm* vm)
+{
+    clox_call_frame* frame = &vm->frames[vm->frame_count - 1];
+    if (vm->frame_count > CLOX_NATIVE_FRAME_MAX) return run(vm, vm->frame_count - 1);
+
+    if (frame->function->aot != NULL) {
+        return frame->function->aot(vm) ? CLOX_INTERPRET_OK : CLOX_INTERPRET_RUNTIME_ERROR;
+    }
+#ifdef CLOX_HAVE_JIT
+    if (clox_jit_is_hot(vm, frame->function)) {
+        return clox_jit_run(vm, frame, frame->ip);
+    }
+#endif
+    return run(vm, vm->frame_count - 1);
+}
+
+bool clox_runtime_add(clox_vm* vm)
+{
+    if (CLOX_IS_STRING(clox_stack_peek(vm, 0)) && CLOX_IS_STRING(clox_stack_peek(vm, 1))) {
+        return concatenate(vm);
+    }
+
+    runtime_error(vm, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+void clox_runtime_equal(clox_vm* vm)
+{
+    // Flattening and interning allocate, so both operands stay on the stack
+    // until then. Only a comparison with another string needs either.
+    bool strings = CLOX_IS_STRING(vm->stack_top[-1]) && CLOX_IS_STRING(vm->stack_top[-2]);
+    for (int distance = 0; strings && distance < 2; distance++) {
+        clox_value* operand = vm->stack_top - 1 - distance;
+        if (!CLOX_IS_UNINTERNED(*operand)) continue;
+
+        clox_obj_string* string = CLOX_AS_STRING(*operand);
+        clox_flatten_string(vm, string);
+        if (string->compares < CLOX_INTERN_AFTER_COMPARES && ++string->compares == CLOX_INTERN_AFTER_COMPARES) {
+            *operand = CLOX_OBJ_VAL(clox_intern_string(vm, string));
+        }
+    }
+
+    clox_value b = clox_stack_pop(vm);
+    clox_value a = clox_stack_pop(vm);
+    clox_stack_push(vm, CLOX_BOOL_VAL(clox_value_equal(a, b)));
+}
+
+void clox_runtime_error(clox_vm* vm, const char* message)
+{
+    runtime_error(vm, "%s", message);
+}
+
+void clox_runtime_undefined_global(clox_vm* vm, int slot)
+{
+    runtime_error(vm, "Undefined variable '%s'.", CLOX_AS_CSTRING(vm->global_names.values[slot]));
+}
+
+clox_vm* clox_new_vm()
+{
+    // This is the VM itself, not something the collector owns.
+    clox_vm* vm = (clox_vm*)malloc(sizeof(clox_vm));
+    if (vm == NULL) return NULL;
+    if (!map_stacks(vm, CLOX_FRAME_MAX)) {
+        free(vm);
+        return NULL;
+    }
+
+#ifdef CLOX_STATS
+    vm->stats = clox_new_stats();
+    if (vm->stats == NULL) {
+        unmap_stacks(vm->frames, vm->stack, vm->frame_max);
+        free(vm);
+        return NULL;
+    }
+#endif
+
+    reset_stack(vm);
+    clox_init_pool(&vm->pool);
+    vm->objects = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_gc = CLOX_GC_INITIAL_HEAP;
+    vm->gc_heap_grow_factor = CLOX_GC_HEAP_GROW_FACTOR;
+    vm->peak_bytes = 0;
+    vm->heap_limit = 0;
+    vm->collections = 0;
+    memset(vm->allocations, 0, sizeof(vm->allocations));
+    vm->out_of_memory = NULL;
+
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
+
+    clox_init_intern_set(&vm->strings);
+    clox_init_table(&vm->global_slots);
+    clox_init_value_array(&vm->global_names);
+    clox_init_value_array(&vm->global_values);
+    vm->compiler = NULL;
+    clox_init_intern_batch(&vm->compile_strings);
+    vm->profile = NULL;
+    vm->sampler = NULL;
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->jit_enabled = true;
+    vm->jit_threshold = CLOX_JIT_THRESHOLD;
+
+#ifdef CLOX_PROFILE_OPCODES
+    vm->profile = clox_new_opcode_profile();
+#endif
+
+    define_native_function(vm, "clock", clock_native);
+    define_native_function(vm, "heapstats", heapstats_native);
+#ifdef CLOX_STATS
+    define_native_function(vm, "vmstats", clox_vmstats_native);
+#endif
+    return vm;
+}
+
+void clox_free_vm(clox_vm* vm)
+{
+    clox_free_table(vm, &vm->global_slots);
+    clox_free_value_array(vm, &vm->global_names, CLOX_ALLOC_GLOBALS);
+    clox_free_value_array(vm, &vm->global_values, CLOX_ALLOC_GLOBALS);
+    clox_free_intern_batch(vm, &vm->compile_strings);
+    clox_free_intern_set(vm, &vm->strings);
+    clox_free_sampler(vm);
+    free_objects(vm);
+#ifdef CLOX_STATS
+    clox_free_stats(vm, vm->stats);
+#endif
+    clox_free_pool(&vm->pool);
+    unmap_stacks(vm->frames, vm->stack, vm->frame_max);
 
-void clox_init_vm()
+#ifdef CLOX_PROFILE_OPCODES
+    clox_print_opcode_profile(vm->profile, stderr, 15);
+    clox_free_opcode_profile(vm->profile);
+#endif
+
+    free(vm);
+}
+
+void clox_reset_vm(clox_vm* vm)
+{
+    reset_stack(vm);
+
+    // Slots are handed out for good, so dropping the whole table keeps a long
+    // run of unrelated scripts from exhausting CLOX_GLOBALS_MAX.
+    clox_free_table(vm, &vm->global_slots);
+    clox_free_value_array(vm, &vm->global_names, CLOX_ALLOC_GLOBALS);
+    clox_free_value_array(vm, &vm->global_values, CLOX_ALLOC_GLOBALS);
+    define_native_function(vm, "clock", clock_native);
+    define_native_function(vm, "heapstats", heapstats_native);
+#ifdef CLOX_STATS
+    define_native_function(vm, "vmstats", clox_vmstats_native);
+#endif
+}
+
+bool clox_set_frame_max(clox_vm* vm, int frame_max)
 {
-    reset_stack();
-    clox_vm_instance.objects = NULL;
+    if (vm->frame_count > 0 || frame_max < 1 || frame_max > CLOX_FRAME_LIMIT) return false;
 
-    clox_init_table(&clox_vm_instance.strings);
-    clox_init_table(&clox_vm_instance.globals);
+    clox_call_frame* frames = vm->frames;
+    clox_value* stack = vm->stack;
+    int old_max = vm->frame_max;
+    if (!map_stacks(vm, frame_max)) return false;
 
-    define_native_function("clock", clock_native);
+    unmap_stacks(frames, stack, old_max);
+    reset_stack(vm);
+    return true;
 }
 
-void clox_free_vm()
+clox_interpret_result clox_interpret(clox_vm* vm, const char *source)
 {
-    clox_free_table(&clox_vm_instance.globals);
-    clox_free_table(&clox_vm_instance.strings);
-    free_objects();
+    return interpret(vm, source, NULL, NULL);
 }
 
-clox_interpret_result clox_interpret(const char *source)
+clox_interpret_result clox_interpret_cached(clox_vm* vm, const char* source, const char* cache_path)
 {
-    clox_obj_function* function = clox_compile(source);
-    if (function == NULL) return CLOX_INTERPRET_COMPILE_ERROR;
+    return interpret(vm, source, cache_path, NULL);
+}
 
-    clox_stack_push(CLOX_OBJ_VAL(function));
-    call(function, 0);
-    
-    return run();
+clox_interpret_result clox_interpret_function(clox_vm* vm, clox_obj_function* function)
+{
+    return interpret(vm, NULL, NULL, function);
 }
 
-void clox_stack_push(clox_value value)
+// Compiles or loads source unless it is NULL, then runs function. reallocate()
+// longjmps back here when the heap limit or the system's memory runs out,
+// after reporting the runtime error. The objects that were already
+// allocated are in the heap for the collector to find. Code in between that
+// holds memory outside the heap, like the mapped image of a cached script,
+// catches the jump with its own jmp_buf, releases it and passes it on.
+static clox_interpret_result interpret(clox_vm* vm, const char* source, const char* cache_path, clox_obj_function* function)
 {
-    *clox_vm_instance.stack_top = value;
-    clox_vm_instance.stack_top++;
+    jmp_buf out_of_memory;
+    jmp_buf* enclosing = vm->out_of_memory;
+    if (setjmp(out_of_memory) != 0) {
+        vm->out_of_memory = enclosing;
+        vm->compiler = NULL;
+        clox_intern_batch_clear(&vm->compile_strings);
+        return CLOX_INTERPRET_RUNTIME_ERROR;
+    }
+    vm->out_of_memory = &out_of_memory;
+
+    // A new local rather than function itself, which would be clobbered if
+    // it changed between setjmp() and a longjmp().
+    clox_interpret_result result = CLOX_INTERPRET_COMPILE_ERROR;
+    clox_obj_function* script = source != NULL ? load_script(vm, source, cache_path) : function;
+    if (script != NULL) result = run_script(vm, script);
+
+    vm->out_of_memory = enclosing;
+    return result;
 }
 
-clox_value clox_stack_pop()
+static clox_obj_function* load_script(clox_vm* vm, const char* source, const char* cache_path)
 {
-    clox_vm_instance.stack_top--;
-    return *clox_vm_instance.stack_top;
+    if (cache_path == NULL) return clox_compile(vm, source);
+
+    uint64_t hash = clox_hash_source(source, strlen(source));
+    clox_obj_function* function = clox_read_bytecode(vm, cache_path, hash);
+    if (function == NULL) {
+        function = clox_compile(vm, source);
+        if (function != NULL) clox_write_bytecode(vm, cache_path, function, hash);
+    }
+    return function;
 }
 
-clox_value clox_stack_peek(int distance)
+static clox_interpret_result run_script(clox_vm* vm, clox_obj_function* function)
 {
-    return clox_vm_instance.stack_top[-1 - distance];
+    clox_stack_push(vm, CLOX_OBJ_VAL(function));
+    if (!call(vm, function, 0)) return CLOX_INTERPRET_RUNTIME_ERROR;
+
+    if (function->aot != NULL) {
+        return function->aot(vm) ? CLOX_INTERPRET_OK : CLOX_INTERPRET_RUNTIME_ERROR;
+    }
+#ifdef CLOX_HAVE_JIT
+    if (clox_jit_is_hot(vm, function)) {
+        return clox_jit_run(vm, &vm->frames[0], function->chunk.code);
+    }
+#endif
+
+    return run(vm, 0);
 }
 
-static clox_interpret_result run()
+int clox_resolve_global(clox_vm* vm, clox_obj_string* name)
 {
-    clox_call_frame* frame = &clox_vm_instance.frames[clox_vm_instance.frame_count - 1];
+    name = clox_intern_string(vm, name);
+    clox_value slot;
+    if (clox_table_get(&vm->global_slots, name, &slot)) {
+        return (int)CLOX_AS_NUMBER(slot);
+    }
+
+    int index = vm->global_values.count;
+    if (index == CLOX_GLOBALS_MAX) return -1;
+
+    // The slot stays undefined until a DEFINE_GLOBAL runs, so code can refer
+    // to globals that are declared later or redefined from the REPL.
+    // Everything that allocates comes before the first write, so running
+    // past the heap limit leaves the names, values and slots in step.
+    clox_stack_push(vm, CLOX_OBJ_VAL(name));
+    clox_reserve_value_array(vm, &vm->global_names, 1, CLOX_ALLOC_GLOBALS);
+    clox_reserve_value_array(vm, &vm->global_values, 1, CLOX_ALLOC_GLOBALS);
+    clox_table_set(vm, &vm->global_slots, name, CLOX_NUMBER_VAL(index));
+    clox_write_value_array(vm, &vm->global_names, CLOX_OBJ_VAL(name), CLOX_ALLOC_GLOBALS);
+    clox_write_value_array(vm, &vm->global_values, CLOX_UNDEFINED_VAL, CLOX_ALLOC_GLOBALS);
+    clox_stack_pop(vm);
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+    return index;
+}
+
+void clox_stack_push(clox_vm* vm, clox_value value)
+{
+    *vm->stack_top = value;
+    vm->stack_top++;
+}
+
+clox_value clox_stack_pop(clox_vm* vm)
+{
+    vm->stack_top--;
+    return *vm->stack_top;
+}
+
+clox_value clox_stack_peek(clox_vm* vm, int distance)
+{
+    return vm->stack_top[-1 - distance];
+}
+
+// Runs until the frame at base_frame returns, so the JIT can run a callee
+// that is not compiled yet to completion. The script itself uses base 0.
+static clox_interpret_result run(clox_vm* vm, int base_frame)
+{
+    clox_call_frame* frame = &vm->frames[vm->frame_count - 1];
+
+#ifdef CLOX_COMPUTED_GOTO
+    // In threaded mode the hot interpreter state lives in locals and is only
+    // written back to the frame and the VM at calls, returns and errors.
+    register uint8_t* ip = frame->ip;
+    register clox_value* stack_top = vm->stack_top;
+    register clox_value* slots = frame->slots;
+    register clox_value* constants = frame->function->chunk.constants.values;
+
+#define IP ip
+#define SLOT(index) (slots[index])
+#define CONSTANT_AT(index) (constants[index])
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define DROP() ((void)--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define STORE_STATE() \
+    (frame->ip = ip, vm->stack_top = stack_top)
+#define LOAD_STATE() \
+    do { \
+        frame = &vm->frames[vm->frame_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->function->chunk.constants.values; \
+        stack_top = vm->stack_top; \
+    } while (false)
+#else
+#define IP (frame->ip)
+#define SLOT(index) (frame->slots[index])
+#define CONSTANT_AT(index) (frame->function->chunk.constants.values[index])
+// Not clox_stack_push() and friends: those are exported, and calls to them
+// from inside a shared library go through the PLT.
+#define PUSH(value) (*vm->stack_top++ = (value))
+#define POP() (*--vm->stack_top)
+#define DROP() ((void)--vm->stack_top)
+#define PEEK(distance) (vm->stack_top[-1 - (distance)])
+#define STORE_STATE() ((void)0)
+#define LOAD_STATE() \
+    (frame = &vm->frames[vm->frame_count - 1])
+#endif
+
+#define READ_BYTE() (*IP++)
+#define READ_CONSTANT() CONSTANT_AT(READ_BYTE())
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() CLOX_AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op) \
+    (IP += 2, (uint16_t)((IP[-2] << 8) | IP[-1]))
+#define GLOBAL(slot) (vm->global_values.values[slot])
+#define GLOBAL_NAME(slot) CLOX_AS_CSTRING(vm->global_names.values[slot])
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_STATE(); \
+        runtime_error(vm, __VA_ARGS__); \
+        return CLOX_INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define BINARY_OP(value_type, op, quickened) \
     do { \
-        if ((!CLOX_IS_NUMBER(clox_stack_peek(0)) || (!CLOX_IS_NUMBER(clox_stack_peek(1))))) { \
-            runtime_error("Operands must be numbers."); \
-            return CLOX_INTERPRET_RUNTIME_ERROR; \
+        if ((!CLOX_IS_NUMBER(PEEK(0)) || (!CLOX_IS_NUMBER(PEEK(1))))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        IP[-1] = quickened; \
+        double b = CLOX_AS_NUMBER(POP()); \
+        double a = CLOX_AS_NUMBER(POP()); \
+        PUSH(value_type(a op b)); \
+    } while (false)
+// Handler body for a quickened opcode. When the guard fails the opcode is
+// rewritten back to its generic form and dispatched again.
+#define NUMBER_OP(value_type, op, generic) \
+    do { \
+        clox_value b = PEEK(0); \
+        clox_value a = PEEK(1); \
+        if (CLOX_IS_NUMBER(a) && CLOX_IS_NUMBER(b)) { \
+            DROP(); \
+            DROP(); \
+            PUSH(value_type(CLOX_AS_NUMBER(a) op CLOX_AS_NUMBER(b))); \
+        } else { \
+            IP[-1] = generic; \
+            IP--; \
+        } \
+    } while (false)
+// Operands: local slot, CONSTANT, constant index, then the arithmetic opcode.
+// Falls back to the original instructions after pushing the local.
+#define LOCAL_CONSTANT_OP(op) \
+    do { \
+        clox_value a = SLOT(IP[0]); \
+        clox_value b = CONSTANT_AT(IP[2]); \
+        if (CLOX_IS_NUMBER(a) && CLOX_IS_NUMBER(b)) { \
+            PUSH(CLOX_NUMBER_VAL(CLOX_AS_NUMBER(a) op CLOX_AS_NUMBER(b))); \
+            IP += 4; \
+        } else { \
+            PUSH(a); \
+            IP += 1; \
         } \
-        double b = CLOX_AS_NUMBER(clox_stack_pop()); \
-        double a = CLOX_AS_NUMBER(clox_stack_pop()); \
-        clox_stack_push(value_type(a op b)); \
     } while (false)
 
-    for (;;) {
 #ifdef CLOX_DEBUG_TRACE_EXECUTION
-        printf("      ");
-        for (clox_value *slot = clox_vm_instance.stack; slot < clox_vm_instance.stack_top; slot++) {
-            printf("[ ");
-            clox_print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        clox_disassemble_instruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        STORE_STATE(); \
+        trace_instruction(vm, frame); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case CLOX_OP_CONSTANT: {
+#ifdef CLOX_HAVE_JIT
+// Continues the frame that was just called, or the current frame at a loop
+// back-edge, in native code once its function is hot. The native code runs
+// the frame until it returns.
+#define JIT_ENTER(entry_frame, entry_ip) \
+    do { \
+        if (vm->frame_count <= CLOX_NATIVE_FRAME_MAX && clox_jit_is_hot(vm, (entry_frame)->function)) { \
+            STORE_STATE(); \
+            clox_interpret_result result = clox_jit_run(vm, (entry_frame), (entry_ip)); \
+            if (result != CLOX_INTERPRET_OK) return result; \
+            if (vm->frame_count == base_frame) return CLOX_INTERPRET_OK; \
+            LOAD_STATE(); \
+        } \
+    } while (false)
+#else
+#define JIT_ENTER(entry_frame, entry_ip) ((void)0)
+#endif
+
+#ifdef CLOX_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION(instruction) clox_profile_opcode(vm->profile, instruction)
+#else
+#define PROFILE_INSTRUCTION(instruction) ((void)0)
+#endif
+
+#ifdef CLOX_STATS
+#define COUNT_INSTRUCTION(instruction) clox_stats_instruction(vm, frame->function, instruction)
+#else
+#define COUNT_INSTRUCTION(instruction) ((void)0)
+#endif
+
+    uint8_t instruction;
+
+#ifdef CLOX_COMPUTED_GOTO
+    static void* dispatch_table[CLOX_UINT8_COUNT] = {
+        [CLOX_OP_RETURN] = &&op_CLOX_OP_RETURN,
+        [CLOX_OP_ADD] = &&op_CLOX_OP_ADD,
+        [CLOX_OP_SUBTRACT] = &&op_CLOX_OP_SUBTRACT,
+        [CLOX_OP_MULTIPLY] = &&op_CLOX_OP_MULTIPLY,
+        [CLOX_OP_DEVIDE] = &&op_CLOX_OP_DEVIDE,
+        [CLOX_OP_NEGATE] = &&op_CLOX_OP_NEGATE,
+        [CLOX_OP_CONSTANT] = &&op_CLOX_OP_CONSTANT,
+        [CLOX_OP_NIL] = &&op_CLOX_OP_NIL,
+        [CLOX_OP_TRUE] = &&op_CLOX_OP_TRUE,
+        [CLOX_OP_FALSE] = &&op_CLOX_OP_FALSE,
+        [CLOX_OP_NOT] = &&op_CLOX_OP_NOT,
+        [CLOX_OP_EQUAL] = &&op_CLOX_OP_EQUAL,
+        [CLOX_OP_GREATER] = &&op_CLOX_OP_GREATER,
+        [CLOX_OP_LESS] = &&op_CLOX_OP_LESS,
+        [CLOX_OP_PRINT] = &&op_CLOX_OP_PRINT,
+        [CLOX_OP_POP] = &&op_CLOX_OP_POP,
+        [CLOX_OP_DEFINE_GLOBAL] = &&op_CLOX_OP_DEFINE_GLOBAL,
+        [CLOX_OP_GET_GLOBAL] = &&op_CLOX_OP_GET_GLOBAL,
+        [CLOX_OP_SET_GLOBAL] = &&op_CLOX_OP_SET_GLOBAL,
+        [CLOX_OP_GET_LOCAL] = &&op_CLOX_OP_GET_LOCAL,
+        [CLOX_OP_SET_LOCAL] = &&op_CLOX_OP_SET_LOCAL,
+        [CLOX_OP_JUMP_IF_FALSE] = &&op_CLOX_OP_JUMP_IF_FALSE,
+        [CLOX_OP_JUMP] = &&op_CLOX_OP_JUMP,
+        [CLOX_OP_LOOP] = &&op_CLOX_OP_LOOP,
+        [CLOX_OP_CALL] = &&op_CLOX_OP_CALL,
+        [CLOX_OP_TAIL_CALL] = &&op_CLOX_OP_TAIL_CALL,
+        [CLOX_OP_ADD_LOCALS] = &&op_CLOX_OP_ADD_LOCALS,
+        [CLOX_OP_ADD_LOCAL_CONSTANT] = &&op_CLOX_OP_ADD_LOCAL_CONSTANT,
+        [CLOX_OP_SUBTRACT_LOCAL_CONSTANT] = &&op_CLOX_OP_SUBTRACT_LOCAL_CONSTANT,
+        [CLOX_OP_LESS_LOCAL_CONSTANT_JUMP] = &&op_CLOX_OP_LESS_LOCAL_CONSTANT_JUMP,
+        [CLOX_OP_SET_LOCAL_POP] = &&op_CLOX_OP_SET_LOCAL_POP,
+        [CLOX_OP_POP_LOOP] = &&op_CLOX_OP_POP_LOOP,
+        [CLOX_OP_ADD_NUM] = &&op_CLOX_OP_ADD_NUM,
+        [CLOX_OP_SUBTRACT_NUM] = &&op_CLOX_OP_SUBTRACT_NUM,
+        [CLOX_OP_MULTIPLY_NUM] = &&op_CLOX_OP_MULTIPLY_NUM,
+        [CLOX_OP_DEVIDE_NUM] = &&op_CLOX_OP_DEVIDE_NUM,
+        [CLOX_OP_GREATER_NUM] = &&op_CLOX_OP_GREATER_NUM,
+        [CLOX_OP_LESS_NUM] = &&op_CLOX_OP_LESS_NUM
+    };
+
+// Every handler ends with its own copy of the dispatch so the indirect
+// branch predictor sees one branch per opcode instead of a shared one.
+#define TARGET(op) op_##op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        instruction = READ_BYTE(); \
+        PROFILE_INSTRUCTION(instruction); \
+        COUNT_INSTRUCTION(instruction); \
+        goto *dispatch_table[instruction]; \
+    } while (false)
+
+    DISPATCH();
+    {
+        {
+#else
+#define TARGET(op) case op
+#define DISPATCH() break
+
+    for (;;) {
+        TRACE_INSTRUCTION();
+
+        instruction = READ_BYTE();
+        PROFILE_INSTRUCTION(instruction);
+        COUNT_INSTRUCTION(instruction);
+
+        switch (instruction) {
+#endif
+            TARGET(CLOX_OP_CONSTANT): {
                 clox_value constant = READ_CONSTANT();
-                clox_stack_push(constant);
-                break;
+                PUSH(constant);
+                DISPATCH();
             }
-            case CLOX_OP_ADD: {
-                if (CLOX_IS_STRING(clox_stack_peek(0)) && CLOX_IS_STRING(clox_stack_peek(1))) {
-                    concatenate();
-                } else if (CLOX_IS_NUMBER(clox_stack_peek(0)) && CLOX_IS_NUMBER(clox_stack_peek(1))) {
-                    double b = CLOX_AS_NUMBER(clox_stack_pop());
-                    double a = CLOX_AS_NUMBER(clox_stack_pop());
-                    clox_stack_push(CLOX_NUMBER_VAL(a + b));
+            TARGET(CLOX_OP_ADD): {
+                if (CLOX_IS_STRING(PEEK(0)) && CLOX_IS_STRING(PEEK(1))) {
+                    STORE_STATE();
+                    if (!concatenate(vm)) return CLOX_INTERPRET_RUNTIME_ERROR;
+                    LOAD_STATE();
+                } else if (CLOX_IS_NUMBER(PEEK(0)) && CLOX_IS_NUMBER(PEEK(1))) {
+                    IP[-1] = CLOX_OP_ADD_NUM;
+                    double b = CLOX_AS_NUMBER(POP());
+                    double a = CLOX_AS_NUMBER(POP());
+                    PUSH(CLOX_NUMBER_VAL(a + b));
                 } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return CLOX_INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
+                DISPATCH();
             }
-            case CLOX_OP_SUBTRACT: {
-                BINARY_OP(CLOX_NUMBER_VAL, -);
-                break;
+            TARGET(CLOX_OP_SUBTRACT): {
+                BINARY_OP(CLOX_NUMBER_VAL, -, CLOX_OP_SUBTRACT_NUM);
+                DISPATCH();
             }
-            case CLOX_OP_MULTIPLY: {
-                BINARY_OP(CLOX_NUMBER_VAL, *);
-                break;
+            TARGET(CLOX_OP_MULTIPLY): {
+                BINARY_OP(CLOX_NUMBER_VAL, *, CLOX_OP_MULTIPLY_NUM);
+                DISPATCH();
             }
-            case CLOX_OP_DEVIDE: {
-                BINARY_OP(CLOX_NUMBER_VAL, /);
-                break;
+            TARGET(CLOX_OP_DEVIDE): {
+                BINARY_OP(CLOX_NUMBER_VAL, /, CLOX_OP_DEVIDE_NUM);
+                DISPATCH();
             }
-            case CLOX_OP_NEGATE: {
-                if (!CLOX_IS_NUMBER(clox_stack_peek(0))) {
-                    runtime_error("Operand must be number.");
-                    return CLOX_INTERPRET_RUNTIME_ERROR;
+            TARGET(CLOX_OP_NEGATE): {
+                if (!CLOX_IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("Operand must be number.");
                 }
 
-                clox_stack_push(
-                    CLOX_NUMBER_VAL(-CLOX_AS_NUMBER(clox_stack_pop()))
-                );
-                break;
+                double value = CLOX_AS_NUMBER(POP());
+                PUSH(CLOX_NUMBER_VAL(-value));
+                DISPATCH();
             }
-            case CLOX_OP_RETURN: {
-                clox_value result = clox_stack_pop();
-                clox_vm_instance.frame_count--;
+            TARGET(CLOX_OP_RETURN): {
+                clox_value result = POP();
+                STORE_STATE();
+                vm->frame_count--;
 
-                if (clox_vm_instance.frame_count == 0) {
-                    clox_stack_pop();
+                if (vm->frame_count == 0) {
+                    clox_stack_pop(vm);
                     return CLOX_INTERPRET_OK;
                 }
 
-                clox_vm_instance.stack_top = frame->slots;
-                clox_stack_push(result);
-                frame = &clox_vm_instance.frames[clox_vm_instance.frame_count - 1];
-                break;
+                vm->stack_top = frame->slots;
+                clox_stack_push(vm, result);
+                if (vm->frame_count == base_frame) return CLOX_INTERPRET_OK;
+                LOAD_STATE();
+                DISPATCH();
             }
-            case CLOX_OP_NIL: clox_stack_push(CLOX_NIL_VAL); break;
-            case CLOX_OP_TRUE: clox_stack_push(CLOX_BOOL_VAL(true)); break;
-            case CLOX_OP_FALSE: clox_stack_push(CLOX_BOOL_VAL(false)); break;
-            case CLOX_OP_NOT: 
-                clox_stack_push(CLOX_BOOL_VAL(!is_falsey(clox_stack_pop())));
-                break;
-            case CLOX_OP_EQUAL:
-                clox_value b = clox_stack_pop();
-                clox_value a = clox_stack_pop();
-                clox_stack_push(CLOX_BOOL_VAL(clox_value_equal(a, b)));
-                break;
-            case CLOX_OP_GREATER: BINARY_OP(CLOX_BOOL_VAL, >); break;
-            case CLOX_OP_LESS: BINARY_OP(CLOX_BOOL_VAL, <); break;
-            case CLOX_OP_PRINT: {
-                clox_print_value(clox_stack_pop());
-                printf("\n");
-                break;
+            TARGET(CLOX_OP_NIL): PUSH(CLOX_NIL_VAL); DISPATCH();
+            TARGET(CLOX_OP_TRUE): PUSH(CLOX_BOOL_VAL(true)); DISPATCH();
+            TARGET(CLOX_OP_FALSE): PUSH(CLOX_BOOL_VAL(false)); DISPATCH();
+            TARGET(CLOX_OP_NOT): {
+                clox_value value = POP();
+                PUSH(CLOX_BOOL_VAL(is_falsey(value)));
+                DISPATCH();
             }
-            case CLOX_OP_POP: clox_stack_pop(); break;
-            case CLOX_OP_DEFINE_GLOBAL: {
-                clox_obj_string* name = READ_STRING();
-                clox_table_set(&clox_vm_instance.globals, name, clox_stack_peek(0));
-                clox_stack_pop();
-                break;
+            TARGET(CLOX_OP_EQUAL): {
+                if (CLOX_IS_UNINTERNED(PEEK(0)) || CLOX_IS_UNINTERNED(PEEK(1))) {
+                    STORE_STATE();
+                    clox_runtime_equal(vm);
+                    LOAD_STATE();
+                    DISPATCH();
+                }
+                clox_value b = POP();
+                clox_value a = POP();
+                PUSH(CLOX_BOOL_VAL(clox_value_equal(a, b)));
+                DISPATCH();
             }
-            case CLOX_OP_GET_GLOBAL: {
-                clox_obj_string* name = READ_STRING();
-                clox_value value;
-                if (!clox_table_get(&clox_vm_instance.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return CLOX_INTERPRET_RUNTIME_ERROR;
+            TARGET(CLOX_OP_GREATER): BINARY_OP(CLOX_BOOL_VAL, >, CLOX_OP_GREATER_NUM); DISPATCH();
+            TARGET(CLOX_OP_LESS): BINARY_OP(CLOX_BOOL_VAL, <, CLOX_OP_LESS_NUM); DISPATCH();
+            TARGET(CLOX_OP_PRINT): {
+                clox_print_value(vm->out, POP());
+                fputc('\n', vm->out);
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_POP): DROP(); DISPATCH();
+            TARGET(CLOX_OP_DEFINE_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                GLOBAL(slot) = POP();
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_GET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                clox_value value = GLOBAL(slot);
+                if (CLOX_IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
                 }
-                clox_stack_push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             }
-            case CLOX_OP_SET_GLOBAL: {
-                clox_obj_string* name = READ_STRING();
-                if (clox_table_set(&clox_vm_instance.globals, name, clox_stack_peek(0))) {
-                    clox_table_delete(&clox_vm_instance.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return CLOX_INTERPRET_RUNTIME_ERROR;
+            TARGET(CLOX_OP_SET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                if (CLOX_IS_UNDEFINED(GLOBAL(slot))) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
                 }
-                break;
+                GLOBAL(slot) = PEEK(0);
+                DISPATCH();
             }
-            case CLOX_OP_GET_LOCAL: {
+            TARGET(CLOX_OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                clox_stack_push(frame->slots[slot]);
-                break;
+                PUSH(SLOT(slot));
+                DISPATCH();
             }
-            case CLOX_OP_SET_LOCAL: {
+            TARGET(CLOX_OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = clox_stack_peek(0);
-                break;
+                SLOT(slot) = PEEK(0);
+                DISPATCH();
             }
-            case CLOX_OP_JUMP_IF_FALSE: {
+            TARGET(CLOX_OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (is_falsey(clox_stack_peek(0))) frame->ip += offset;
-                break;
+                if (is_falsey(PEEK(0))) IP += offset;
+                DISPATCH();
             }
-            case CLOX_OP_JUMP: {
+            TARGET(CLOX_OP_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                IP += offset;
+                DISPATCH();
             }
-            case CLOX_OP_LOOP: {
+            TARGET(CLOX_OP_LOOP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                IP -= offset;
+                JIT_ENTER(frame, IP);
+                DISPATCH();
             }
-            case CLOX_OP_CALL: {
+            TARGET(CLOX_OP_CALL): {
                 int arg_count = READ_BYTE();
-                if (!call_value(clox_stack_peek(arg_count), arg_count)) {
+                clox_call_frame* caller = frame;
+                STORE_STATE();
+                if (!call_value(vm, clox_stack_peek(vm, arg_count), arg_count)) {
                     return CLOX_INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &clox_vm_instance.frames[clox_vm_instance.frame_count - 1];
-                break;
+                LOAD_STATE();
+                if (frame != caller) JIT_ENTER(frame, frame->function->chunk.code);
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_TAIL_CALL): {
+                int arg_count = READ_BYTE();
+                STORE_STATE();
+                clox_tail_call_result result = tail_call(vm, frame, arg_count);
+                if (result == CLOX_TAIL_CALL_ERROR) return CLOX_INTERPRET_RUNTIME_ERROR;
+                LOAD_STATE();
+                if (result == CLOX_TAIL_CALL_REPLACED) JIT_ENTER(frame, frame->function->chunk.code);
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_ADD_LOCALS): {
+                clox_value a = SLOT(IP[0]);
+                clox_value b = SLOT(IP[2]);
+                if (CLOX_IS_NUMBER(a) && CLOX_IS_NUMBER(b)) {
+                    PUSH(CLOX_NUMBER_VAL(CLOX_AS_NUMBER(a) + CLOX_AS_NUMBER(b)));
+                    IP += 4;
+                } else {
+                    PUSH(a);
+                    IP += 1;
+                }
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_ADD_LOCAL_CONSTANT): LOCAL_CONSTANT_OP(+); DISPATCH();
+            TARGET(CLOX_OP_SUBTRACT_LOCAL_CONSTANT): LOCAL_CONSTANT_OP(-); DISPATCH();
+            TARGET(CLOX_OP_LESS_LOCAL_CONSTANT_JUMP): {
+                // Operands: slot, CONSTANT, index, LESS, JUMP_IF_FALSE, offset
+                // (two bytes), POP. The POP is skipped on the fall-through path.
+                clox_value a = SLOT(IP[0]);
+                clox_value b = CONSTANT_AT(IP[2]);
+                if (CLOX_IS_NUMBER(a) && CLOX_IS_NUMBER(b)) {
+                    if (CLOX_AS_NUMBER(a) < CLOX_AS_NUMBER(b)) {
+                        IP += 8;
+                    } else {
+                        uint16_t offset = (uint16_t)((IP[5] << 8) | IP[6]);
+                        IP += 7 + offset;
+                        PUSH(CLOX_BOOL_VAL(false));
+                    }
+                } else {
+                    PUSH(a);
+                    IP += 1;
+                }
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_SET_LOCAL_POP): {
+                uint8_t slot = IP[0];
+                SLOT(slot) = POP();
+                IP += 2;
+                DISPATCH();
+            }
+            TARGET(CLOX_OP_POP_LOOP): {
+                DROP();
+                uint16_t offset = (uint16_t)((IP[1] << 8) | IP[2]);
+                IP += 3;
+                IP -= offset;
+                JIT_ENTER(frame, IP);
+                DISPATCH();
             }
+            TARGET(CLOX_OP_ADD_NUM): NUMBER_OP(CLOX_NUMBER_VAL, +, CLOX_OP_ADD); DISPATCH();
+            TARGET(CLOX_OP_SUBTRACT_NUM): NUMBER_OP(CLOX_NUMBER_VAL, -, CLOX_OP_SUBTRACT); DISPATCH();
+            TARGET(CLOX_OP_MULTIPLY_NUM): NUMBER_OP(CLOX_NUMBER_VAL, *, CLOX_OP_MULTIPLY); DISPATCH();
+            TARGET(CLOX_OP_DEVIDE_NUM): NUMBER_OP(CLOX_NUMBER_VAL, /, CLOX_OP_DEVIDE); DISPATCH();
+            TARGET(CLOX_OP_GREATER_NUM): NUMBER_OP(CLOX_BOOL_VAL, >, CLOX_OP_GREATER); DISPATCH();
+            TARGET(CLOX_OP_LESS_NUM): NUMBER_OP(CLOX_BOOL_VAL, <, CLOX_OP_LESS); DISPATCH();
         }
     }
 
+#undef IP
+#undef SLOT
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef CONSTANT_AT
+#undef LOCAL_CONSTANT_OP
 #undef READ_SHORT
-#undef READ_STRING
+#undef GLOBAL
+#undef GLOBAL_NAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef STORE_STATE
+#undef LOAD_STATE
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef JIT_ENTER
+#undef TARGET
+#undef DISPATCH
 }
 
-static void reset_stack()
+#ifdef CLOX_DEBUG_TRACE_EXECUTION
+static void trace_instruction(clox_vm* vm, clox_call_frame* frame)
+{
+    fprintf(vm->out, "      ");
+    for (clox_value *slot = vm->stack; slot < vm->stack_top; slot++) {
+        fprintf(vm->out, "[ ");
+        clox_print_value(vm->out, *slot);
+        fprintf(vm->out, " ]");
+    }
+    fprintf(vm->out, "\n");
+    clox_disassemble_instruction(vm, &frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+}
+#endif
+
+static void reset_stack(clox_vm* vm)
+{
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+}
+
+#ifdef CLOX_HAVE_MMAP
+static size_t page_size()
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t round_to_pages(size_t bytes)
+{
+    size_t page = page_size();
+    return (bytes + page - 1) / page * page;
+}
+
+// Reserves bytes followed by an inaccessible guard page. The kernel only
+// backs the pages that are touched, so a stack costs what the deepest
+// script used, and running off its end faults instead of corrupting
+// whatever is mapped next.
+static void* map_region(size_t bytes)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    size_t size = round_to_pages(bytes);
+    char* memory = (char*)mmap(NULL, size + page_size(), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    if (mprotect(memory + size, page_size(), PROT_NONE) != 0) {
+        munmap(memory, size + page_size());
+        return NULL;
+    }
+    return memory;
+}
+
+static void unmap_region(void* memory, size_t bytes)
 {
-    clox_vm_instance.stack_top = clox_vm_instance.stack;
-    clox_vm_instance.frame_count = 0;
+    if (memory != NULL) munmap(memory, round_to_pages(bytes) + page_size());
+}
+#else
+static void* map_region(size_t bytes)
+{
+    return malloc(bytes);
 }
 
-static void runtime_error(const char *format, ...)
+static void unmap_region(void* memory, size_t bytes)
+{
+    free(memory);
+}
+#endif
+
+// Points vm at freshly reserved stacks for frame_max frames. The stacks are
+// reserved whole instead of reallocated as they fill, so frame slots and
+// the stack pointers the interpreter and native code cache never move.
+static bool map_stacks(clox_vm* vm, int frame_max)
+{
+    size_t slot_count = (size_t)frame_max * CLOX_UINT8_COUNT;
+    clox_call_frame* frames = (clox_call_frame*)map_region(sizeof(clox_call_frame) * frame_max);
+    clox_value* stack = (clox_value*)map_region(sizeof(clox_value) * slot_count);
+    if (frames == NULL || stack == NULL) {
+        unmap_region(frames, sizeof(clox_call_frame) * frame_max);
+        unmap_region(stack, sizeof(clox_value) * slot_count);
+        return false;
+    }
+
+    vm->frames = frames;
+    vm->stack = stack;
+    vm->stack_end = stack + slot_count;
+    vm->frame_max = frame_max;
+    return true;
+}
+
+static void unmap_stacks(clox_call_frame* frames, clox_value* stack, int frame_max)
+{
+    unmap_region(frames, sizeof(clox_call_frame) * frame_max);
+    unmap_region(stack, sizeof(clox_value) * frame_max * CLOX_UINT8_COUNT);
+}
+
+static void runtime_error(clox_vm* vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    for (int i = clox_vm_instance.frame_count - 1; i >= 0; i--) {
-        clox_call_frame* frame = &clox_vm_instance.frames[i];
+    for (int i = vm->frame_count - 1; i >= 0; i--) {
+        clox_call_frame* frame = &vm->frames[i];
         clox_obj_function* function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(vm->err, "[line %d] in ", clox_chunk_get_line(&function->chunk, (int)instruction));
         if (function->name == NULL) {
-            fprintf(stderr, "script\n");
+            fprintf(vm->err, "script\n");
         } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(vm->err, "%s()\n", function->name->chars);
         }
     }
 
-    reset_stack();
+    reset_stack(vm);
 }
 
-static void define_native_function(const char* name, clox_native_fn function)
+static void define_native_function(clox_vm* vm, const char* name, clox_native_fn function)
 {
-    clox_stack_push(CLOX_OBJ_VAL(clox_copy_string(name, (int)strlen(name))));
-    clox_stack_push(CLOX_OBJ_VAL(clox_new_native_function(function)));
-    clox_table_set(&clox_vm_instance.globals, CLOX_AS_STRING(clox_vm_instance.stack[0]), clox_vm_instance.stack[1]);
-    clox_stack_pop();
-    clox_stack_pop();
+    clox_stack_push(vm, CLOX_OBJ_VAL(clox_copy_string(vm, name, (int)strlen(name))));
+    clox_stack_push(vm, CLOX_OBJ_VAL(clox_new_native_function(vm, function)));
+    int slot = clox_resolve_global(vm, CLOX_AS_STRING(vm->stack[0]));
+    vm->global_values.values[slot] = vm->stack[1];
+    clox_stack_pop(vm);
+    clox_stack_pop(vm);
 }
 
 static bool is_falsey(clox_value value)
@@ -288,51 +929,86 @@ static bool is_falsey(clox_value value)
     return CLOX_IS_NIL(value) || (CLOX_IS_BOOL(value) && !CLOX_AS_BOOL(value));
 }
 
-static void concatenate()
+static bool concatenate(clox_vm* vm)
 {
-    clox_obj_string *b = CLOX_AS_STRING(clox_stack_pop());
-    clox_obj_string *a = CLOX_AS_STRING(clox_stack_pop());
+    clox_obj_string *b = CLOX_AS_STRING(clox_stack_peek(vm, 0));
+    clox_obj_string *a = CLOX_AS_STRING(clox_stack_peek(vm, 1));
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    clox_obj_string* result = clox_take_string(chars, length);
-    clox_stack_push(CLOX_OBJ_VAL(result));
+    clox_obj_string* result = clox_concatenate(vm, a, b);
+    if (result == NULL) {
+        runtime_error(vm, "String is too long.");
+        return false;
+    }
+    clox_stack_pop(vm);
+    clox_stack_pop(vm);
+    clox_stack_push(vm, CLOX_OBJ_VAL(result));
+    return true;
 }
 
-static bool call(clox_obj_function* function, int arg_count)
+static bool call(clox_vm* vm, clox_obj_function* function, int arg_count)
 {
     if (arg_count != function->arity) {
-        runtime_error("Expect %d arguments but got %d.", function->arity, arg_count);
+        runtime_error(vm, "Expect %d arguments but got %d.", function->arity, arg_count);
         return false;
     }
 
-    if (clox_vm_instance.frame_count == CLOX_FRAME_MAX) {
-        runtime_error("Stack overflow.");
+    clox_value* slots = vm->stack_top - arg_count - 1;
+    if (vm->frame_count == vm->frame_max || slots + function->max_slots > vm->stack_end) {
+        runtime_error(vm, "Stack overflow.");
         return false;
     }
 
-    clox_call_frame* frame = &clox_vm_instance.frames[clox_vm_instance.frame_count++];
+    // The frame is complete before it is counted, for the sampler's signal
+    // handler.
+    clox_call_frame* frame = &vm->frames[vm->frame_count];
     frame->function = function;
     frame->ip = function->chunk.code;
-    frame->slots = clox_vm_instance.stack_top - arg_count - 1;
+    frame->slots = slots;
+    atomic_signal_fence(memory_order_release);
+    vm->frame_count++;
+#ifdef CLOX_STATS
+    clox_function_stats_of(vm, function)->calls++;
+#endif
     return true;
 }
 
-static bool call_value(clox_value callee, int args_count)
+// Slides the callee and its arguments down over frame's slots and restarts
+// the frame in the callee, so tail-recursive code runs in constant stack.
+// Anything but a Lox function with the right arity is an ordinary call.
+static clox_tail_call_result tail_call(clox_vm* vm, clox_call_frame* frame, int arg_count)
+{
+    clox_value callee = clox_stack_peek(vm, arg_count);
+    if (!CLOX_IS_FUNCTION(callee) || CLOX_AS_FUNCTION(callee)->arity != arg_count) {
+        return call_value(vm, callee, arg_count) ? CLOX_TAIL_CALL_RETURNED : CLOX_TAIL_CALL_ERROR;
+    }
+
+    clox_obj_function* function = CLOX_AS_FUNCTION(callee);
+    if (frame->slots + function->max_slots > vm->stack_end) {
+        runtime_error(vm, "Stack overflow.");
+        return CLOX_TAIL_CALL_ERROR;
+    }
+
+    memmove(frame->slots, vm->stack_top - arg_count - 1, sizeof(clox_value) * (arg_count + 1));
+    vm->stack_top = frame->slots + arg_count + 1;
+    frame->function = function;
+    frame->ip = function->chunk.code;
+#ifdef CLOX_STATS
+    clox_function_stats_of(vm, function)->calls++;
+#endif
+    return CLOX_TAIL_CALL_REPLACED;
+}
+
+static bool call_value(clox_vm* vm, clox_value callee, int args_count)
 {
     if (CLOX_IS_OBJ(callee)) {
         switch (CLOX_OBJ_TYPE(callee)) {
             case CLOX_OBJ_FUNCTION:
-                return call(CLOX_AS_FUNCTION(callee), args_count);
+                return call(vm, CLOX_AS_FUNCTION(callee), args_count);
             case CLOX_OBJ_NATIVE_FUNCTION: {
                 clox_native_fn native = CLOX_AS_NATIVE_FUNCTION(callee);
-                clox_value result = native(args_count, clox_vm_instance.stack_top - args_count);
-                clox_vm_instance.stack_top -= args_count + 1;
-                clox_stack_push(result);
+                clox_value result = native(vm, args_count, vm->stack_top - args_count);
+                vm->stack_top -= args_count + 1;
+                clox_stack_push(vm, result);
                 return true;
             }
             default:
@@ -340,11 +1016,17 @@ static bool call_value(clox_value callee, int args_count)
         }
     }
 
-    runtime_error("Can only call functions and classes.");
+    runtime_error(vm, "Can only call functions and classes.");
     return false;
 }
 
-static clox_value clock_native(int arg_count, clox_value* args)
+static clox_value clock_native(clox_vm* vm, int arg_count, clox_value* args)
 {
     return CLOX_NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
+
+static clox_value heapstats_native(clox_vm* vm, int arg_count, clox_value* args)
+{
+    clox_obj_string* report = clox_string_from_report(vm, clox_write_heap_stats);
+    return report == NULL ? CLOX_NIL_VAL : CLOX_OBJ_VAL(report);
+}